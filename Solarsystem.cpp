@@ -4,6 +4,8 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <chrono>
+#include <algorithm>
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -18,8 +20,47 @@ GLFWwindow* window;
 #include <glm/gtc/matrix_transform.hpp>
 using namespace glm;
 
+#include "glstate.h"
+#include "jobs.h"
+#include "objloader.h"
+#include "meshcache.h"
+#include "meshopt.h"
+#include "programcache.h"
+#include "shaderprogram.h"
+#include "meshgen.h"
+#include "simplify.h"
+#include "instancing.h"
+#include "bvh.h"
+#include "scene.h"
+#include "vertexformat.h"
+#include "geometryarena.h"
+#include "lod.h"
+#include "flagwave.h"
+#include "cloth.h"
+#include "streambuffer.h"
+#include "offscreen.h"
+#include "headless.h"
+#include "profiler.h"
+#include "simthread.h"
+#include "assets.h"
+#include "recorder.h"
+#include "renderqueue.h"
+#include "trace.h"
+
 struct centerstruct { float x = 0.0f, y = 0.0f, z = 0.0f; };
 
+// Segments around the flagpole
+#define POLE_SEGMENTS 360
+
+// Distance between neighbouring flagpoles when the scene is instanced
+#define INSTANCE_SPACING 2.0f
+
+// Height of the finial sphere above the foot of its pole
+#define FINIAL_HEIGHT 0.08f
+
+// Meshes the scene entities refer to
+enum { MESH_GROUND, MESH_POLE, MESH_SPHERE, MESH_FLAG, MESH_COUNT };
+
 
 // Read file contents
 char* readFile(const char *filename) {
@@ -93,6 +134,7 @@ GLuint checkShader(GLuint shader) {
 
 // Load and Compile Shader from source file
 GLuint loadShader(GLuint type, const char *filename) {
+	TRACE_ZONE("load shader");
 	// Read the shader source from file
 	char *source = readFile(filename);
 
@@ -167,6 +209,24 @@ GLuint checkProgram(GLuint program) {
 }
 
 GLuint loadProgram(const char *vert_file, const char *ctrl_file, const char *eval_file, const char *geom_file, const char *frag_file) {
+	TRACE_ZONE("load program");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Reuse the driver binary from an earlier run if the sources and driver are unchanged
+	const char *files[5] = { vert_file, ctrl_file, eval_file, geom_file, frag_file };
+	std::string cache_path;
+	uint64_t cache_key = 0;
+	bool cache = vert_file != NULL && programCacheSupported() && programCacheKey(files, 5, cache_key);
+	if (cache) {
+		cache_path = programCachePath(vert_file);
+		GLuint cached = loadProgramBinary(cache_path.c_str(), cache_key);
+		if (cached != 0) {
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			printf("Loaded program %s (warm cache): %.2f ms\n", vert_file, ms);
+			return cached;
+		}
+	}
+
 	// Create new OpenGL program
 	GLuint program = glCreateProgram();
 
@@ -223,7 +283,8 @@ GLuint loadProgram(const char *vert_file, const char *ctrl_file, const char *eva
 		return 0;
 	}
 
-	// Link program
+	// Link program, keeping the binary retrievable for the cache
+	if (cache) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
 
 	// Delete Shaders (no longer needed)
@@ -246,17 +307,30 @@ GLuint loadProgram(const char *vert_file, const char *ctrl_file, const char *eva
 		return 0;
 	}
 
+	// Store the binary for the next run
+	if (cache && !saveProgramBinary(cache_path.c_str(), cache_key, program)) {
+		std::cerr << "Warning: could not write " << cache_path << std::endl;
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Loaded program %s (%s): %.2f ms\n", vert_file, cache ? "cold cache" : "no cache", ms);
+
 	// Return program
 	return program;
 }
 
-bool loadOBJ(
+// Load a vertex and fragment shader program and reflect its uniforms and blocks
+bool loadShaderProgram(shaderprogram &prog, const char *vert_file, const char *frag_file) {
+	return reflectProgram(prog, loadProgram(vert_file, NULL, NULL, NULL, frag_file));
+}
+
+// Original fscanf based parser, kept as the reference for benchmarkOBJ
+bool loadOBJScanf(
 	const char * path,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<unsigned int> & out_indexes
 	//std::vector<glm::vec3> & out_normals
 ) {
-	printf("Loading OBJ file %s...\n", path);
 
 	//std::vector<unsigned int> vertexIndices, uvIndices, normalIndices;
 	std::vector<unsigned int> vertexIndices, colorIndices;
@@ -365,216 +439,102 @@ bool loadOBJ(
 	return true;
 }
 
-
-void createSphere(
+bool loadOBJ(
+	const char * path,
 	std::vector<glm::vec3> & out_vertices,
-	std::vector<unsigned int> & out_indexes, centerstruct center, float radius
-){
-
-	std::vector<glm::vec3> temp_sphere;
-	std::vector<glm::vec3> temp_color;
-
-	float x, y, z, xy;                              // vertex position
-	//radius = 0.08f;
-	unsigned int sectorCount = 36, stackCount = 18;
-	//float nx, ny, nz, lengthInv = 1.0f / radius;    // normal
-	//float s, t;                                     // texCoord
-	//center.y = 0.08f;
-
-	float sectorStep = 2 * float(M_PI) / sectorCount;
-	float stackStep = float(M_PI) / stackCount;
-	float sectorAngle, stackAngle;
-
-	for (unsigned int i = 0; i <= stackCount; ++i)
-	{
-		glm::vec3 temp;
-
-		stackAngle = float(M_PI) / 2 - i * stackStep;        // starting from pi/2 to -pi/2
-		xy = radius * cosf(stackAngle);             // r * cos(u)
-		z = center.z + radius * sinf(stackAngle);              // r * sin(u)
-
-		// add (sectorCount+1) vertices per stack
-		// the first and last vertices have same position and normal
-		for (unsigned int j = 0; j <= sectorCount; ++j)
-		{
-			sectorAngle = j * sectorStep;           // starting from 0 to 2pi
-
-			// vertex position
-			x = center.x + xy * cosf(sectorAngle);             // r * cos(u) * cos(v)
-			y = center.y + xy * sinf(sectorAngle);             // r * cos(u) * sin(v)
-			temp.x = x;
-			temp.y = y;
-			temp.z = z;
-
-			out_vertices.push_back(temp);
-
-			temp.x = 0.0f;
-			temp.y = 1.0f;
-			temp.z = 0.0f;
-
-			out_vertices.push_back(temp);
-
-
-			// normalized vertex normal
-			/*nx = x * lengthInv;
-			ny = y * lengthInv;
-			nz = z * lengthInv;
-			addNormal(nx, ny, nz);*/
+	std::vector<unsigned int> & out_indexes,
+	jobsystem * jobs = NULL
+) {
+	printf("Loading OBJ file %s...\n", path);
 
-			// vertex tex coord between [0, 1]
-			/*s = (float)j / sectorCount;
-			t = (float)i / stackCount;
-			addTexCoord(s, t);*/
-		}
+	// Check the file exists before handing it to the parser
+	FILE * file = fopen(path, "r");
+	if (file == NULL) {
+		printf("Impossible to open the file ! Are you in the right path ? See Tutorial 1 for details\n");
+		return false;
 	}
+	fclose(file);
 
-	// indices
-	//  k1--k1+1
-	//  |  / |
-	//  | /  |
-	//  k2--k2+1
-	unsigned int k1, k2;
-	for (unsigned int i = 0; i < stackCount; ++i)
-	{
-		k1 = i * (sectorCount + 1);     // beginning of current stack
-		k2 = k1 + sectorCount + 1;      // beginning of next stack
-
-		for (unsigned int j = 0; j < sectorCount; ++j, ++k1, ++k2)
-		{
-			// 2 triangles per sector excluding 1st and last stacks
-			if (i != 0)
-			{
-				//addIndices(k1, k2, k1 + 1);   // k1---k2---k1+1
-
-				out_indexes.push_back(k1);
-				out_indexes.push_back(k2);
-				out_indexes.push_back(k1 + 1);
-
-			}
+	return loadOBJMapped(path, out_vertices, out_indexes, jobs);
+}
 
-			if (i != (stackCount - 1))
-			{
-				//addIndices(k1 + 1, k2, k2 + 1); // k1+1---k2---k2+1
+// Load an OBJ file through its binary cache, writing the cache on a miss
+bool loadOBJCached(const char * path, cachedmesh & mesh, jobsystem * jobs = NULL) {
+	TRACE_ZONE("load obj");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-				out_indexes.push_back(k1 + 1);
-				out_indexes.push_back(k2);
-				out_indexes.push_back(k2 + 1);
-			}
+	if (!openMeshCache(path, mesh)) {
+		// Parse the source and write the cache for the next run
+		if (!loadOBJ(path, mesh.owned_vertices, mesh.owned_indexes, jobs)) {
+			return false;
+		}
+		optimizeMesh(path, mesh.owned_vertices, mesh.owned_indexes);
+		useOwnedMesh(mesh);
+		mesh.source = path;
 
+		if (!writeMeshCache(path, mesh.vertices, mesh.vertex_count, mesh.indexes, mesh.index_count)) {
+			std::cerr << "Warning: could not write " << meshCachePath(path) << std::endl;
 		}
 	}
 
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Loaded %s (%s cache): %.2f ms\n", path, mesh.warm ? "warm" : "cold", ms);
+	return true;
 }
 
+// Compare parse throughput of the fscanf loader and the mapped loader
+int benchmarkOBJ(const char * path, int iterations) {
+	typedef std::chrono::steady_clock clock;
 
-int main( void )
-{
-	// Initialise GLFW
-	if( !glfwInit() )
-	{
-		fprintf( stderr, "Failed to initialize GLFW\n" );
-		getchar();
+	// Get file size
+	std::ifstream input(path, std::ios::binary | std::ios::ate);
+	if (!input.good()) {
+		std::cerr << "Error: Could not open " << path << std::endl;
 		return -1;
 	}
+	double megabytes = double(input.tellg()) / (1024.0 * 1024.0);
+	input.close();
 
-	glfwWindowHint(GLFW_SAMPLES, 4);
-	glfwWindowHint(GLFW_RESIZABLE,GL_FALSE);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-	// Open a window and create its OpenGL context
-	window = glfwCreateWindow( 1024, 768, "Playground", NULL, NULL);
-	if( window == NULL ){
-		fprintf( stderr, "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials.\n" );
-		getchar();
-		glfwTerminate();
-		return -1;
+	jobsystem jobs;
+	createJobSystem(jobs);
+	double best_scanf = 1e30, best_mapped = 1e30;
+	std::vector<glm::vec3> scanf_vertices, mapped_vertices;
+	std::vector<unsigned int> scanf_indexes, mapped_indexes;
+
+	for (int i = 0; i < iterations; ++i) {
+		scanf_vertices.clear();
+		scanf_indexes.clear();
+		clock::time_point start = clock::now();
+		if (!loadOBJScanf(path, scanf_vertices, scanf_indexes)) return -1;
+		best_scanf = std::min(best_scanf, std::chrono::duration<double>(clock::now() - start).count());
+
+		mapped_vertices.clear();
+		mapped_indexes.clear();
+		start = clock::now();
+		if (!loadOBJMapped(path, mapped_vertices, mapped_indexes, &jobs)) return -1;
+		best_mapped = std::min(best_mapped, std::chrono::duration<double>(clock::now() - start).count());
 	}
-	glfwMakeContextCurrent(window);
 
-	// Initialize GLEW
-	if (glewInit() != GLEW_OK) {
-		fprintf(stderr, "Failed to initialize GLEW\n");
-		getchar();
-		glfwTerminate();
-		return -1;
+	// Both loaders must agree
+	float max_error = 0.0f;
+	bool match = scanf_vertices.size() == mapped_vertices.size() && scanf_indexes == mapped_indexes;
+	for (size_t i = 0; match && i < scanf_vertices.size(); ++i) {
+		glm::vec3 d = scanf_vertices[i] - mapped_vertices[i];
+		max_error = std::max(max_error, std::max(fabsf(d.x), std::max(fabsf(d.y), fabsf(d.z))));
 	}
 
-	// Ensure we can capture the escape key being pressed below
-	glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
-
-	// Dark blue background
-	glClearColor(0.0f, 0.0f, 0.2f, 0.0f);
-
-	//enable depth test
-	glEnable(GL_DEPTH_TEST);
-
-	// Create and compile our GLSL program from the shaders
-	GLuint programID = loadProgram("vert.glsl", NULL, NULL, NULL, "frag.glsl");
-
-	
-	//generate the ground vertices
-
-	std::vector<glm::vec3> vertices;
-	unsigned int vertices_number = 0;
-
-	glm::vec3 temp_ground;
-	temp_ground.x = -1.5f;  temp_ground.y = -1.3f;   temp_ground.z = -0.8f;
-	vertices.push_back(temp_ground);
-	temp_ground.x = 0.8f;  temp_ground.y = 0.8f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-
-	temp_ground.x = -1.5f;  temp_ground.y = -1.3f;   temp_ground.z = 0.0f;
-	vertices.push_back(temp_ground);
-	temp_ground.x = 0.8f;  temp_ground.y = 0.8f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-
-	temp_ground.x = 1.5f;  temp_ground.y = -1.3f;   temp_ground.z = 0.0f;
-	vertices.push_back(temp_ground);
-	temp_ground.x = 0.8f;  temp_ground.y = 0.8f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-
-	temp_ground.x = 1.5f;  temp_ground.y = -1.3f;   temp_ground.z = -0.8f;
-	vertices.push_back(temp_ground);
-	temp_ground.x = 0.8f;  temp_ground.y = 0.8f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-	
-	temp_ground.x = -1.5f;  temp_ground.y = -1.3f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-	temp_ground.x = 0.8f;  temp_ground.y = 0.8f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-
-	temp_ground.x = 1.5f;  temp_ground.y = -1.3f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-	temp_ground.x = 0.8f;  temp_ground.y = 0.8f;   temp_ground.z = 0.8f;
-	vertices.push_back(temp_ground);
-
-	//index start number after the ground index, it should be index starting point for the next object
-	vertices_number = vertices_number+6;
-
-
-	// Triangle Indexes
-	std::vector<unsigned int> indexes;
-	
-	indexes.push_back(0);
-	indexes.push_back(1);
-	indexes.push_back(2);
+	printf("%s: %.2f MB, %u threads, best of %d\n", path, megabytes, jobs.thread_count, iterations);
+	printf("  fscanf: %8.2f ms %8.1f MB/s\n", best_scanf * 1000.0, megabytes / best_scanf);
+	printf("  mapped: %8.2f ms %8.1f MB/s (%.1fx)\n", best_mapped * 1000.0, megabytes / best_mapped, best_scanf / best_mapped);
+	printf("  output %s, max difference %g\n", match ? "matches" : "DIFFERS", max_error);
 
-	indexes.push_back(0);
-	indexes.push_back(2);
-	indexes.push_back(3);
-
-	indexes.push_back(1);
-	indexes.push_back(2);
-	indexes.push_back(4);
+	return match ? 0 : -1;
+}
 
-	indexes.push_back(4);
-	indexes.push_back(5);
-	indexes.push_back(2);
 
-		
+// Original copy-pasted pole loops, kept as the reference for benchmarkMeshGen.
+// Every quad gets four vertices of its own and n <= segments adds one quad too many.
+void createPoleQuads(std::vector<glm::vec3> & vertices, std::vector<unsigned int> & indexes, unsigned int vertices_number) {
 	//generate the vertice of the Cylinder
 	GLfloat segments = 360.0f;
 	float bottom = -1.1f;
@@ -723,185 +683,1724 @@ int main( void )
 		indexes.push_back(vertices_number + 4 * n + 2);
 		indexes.push_back(vertices_number + 4 * n + 3);
 	}
+}
 
-	vertices_number = vertices_number + n * 4;
-
+// Compare the copy-pasted pole loops with the shared vertex generator
+int benchmarkMeshGen(int iterations) {
+	typedef std::chrono::steady_clock clock;
+
+	double best_quads = 1e30, best_shared = 1e30;
+	std::vector<glm::vec3> quad_vertices, shared_vertices;
+	std::vector<unsigned int> quad_indexes, shared_indexes;
+	glm::vec3 center(0.0f, 0.0f, 0.0f), color(0.0f, 0.0f, 1.0f);
+
+	for (int i = 0; i < iterations; ++i) {
+		quad_vertices.clear();
+		quad_indexes.clear();
+		quad_vertices.shrink_to_fit();
+		quad_indexes.shrink_to_fit();
+		clock::time_point start = clock::now();
+		createPoleQuads(quad_vertices, quad_indexes, 0);
+		best_quads = std::min(best_quads, std::chrono::duration<double, std::micro>(clock::now() - start).count());
+
+		shared_vertices.clear();
+		shared_indexes.clear();
+		shared_vertices.shrink_to_fit();
+		shared_indexes.shrink_to_fit();
+		start = clock::now();
+		meshcounts counts = cylinderCounts(POLE_SEGMENTS, false);
+		counts.vertices *= 2;
+		counts.indexes *= 2;
+		reserveMesh(shared_vertices, shared_indexes, counts);
+		generateCylinder(shared_vertices, shared_indexes, center, 0.05f, -1.1f, 0.0f, POLE_SEGMENTS, false, color);
+		generateCylinder(shared_vertices, shared_indexes, center, 0.02f, -1.3f, -1.1f, POLE_SEGMENTS, false, color);
+		best_shared = std::min(best_shared, std::chrono::duration<double, std::micro>(clock::now() - start).count());
+	}
 
-	// Vertex Array Objects
-	GLuint vao = 0;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	printf("flagpole, %d segments, best of %d\n", POLE_SEGMENTS, iterations);
+	printf("  quads:  %6u vertices %6u indexes %8.1f us\n", (unsigned int)(quad_vertices.size() / 2), (unsigned int)quad_indexes.size(), best_quads);
+	printf("  shared: %6u vertices %6u indexes %8.1f us (%.1fx)\n", (unsigned int)(shared_vertices.size() / 2), (unsigned int)shared_indexes.size(), best_shared, best_quads / best_shared);
+	return 0;
+}
 
+// The pole and its foot at decreasing segment counts, appended to vertices and indexes.
+// Levels are built as jobs and appended in order.
+void createPoleLod(lodmesh &lod, std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indexes, glm::vec3 center, jobsystem *jobs = NULL) {
+	TRACE_ZONE("create pole");
+	const unsigned int segments[] = { POLE_SEGMENTS, 96, 32, 12 };
+	const size_t level_count = sizeof(segments) / sizeof(segments[0]);
+	glm::vec3 color(0.0f, 0.0f, 1.0f);
+	size_t first = vertices.size();
+
+	std::vector<glm::vec3> level_vertices[level_count];
+	std::vector<unsigned int> level_indexes[level_count];
+	parallelFor(jobs, 0, level_count, 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			meshcounts counts = cylinderCounts(segments[i], false);
+			counts.vertices *= 2;
+			counts.indexes *= 2;
+			reserveMesh(level_vertices[i], level_indexes[i], counts);
+
+			generateCylinder(level_vertices[i], level_indexes[i], center, 0.05f, -1.1f, 0.0f, segments[i], false, color);
+			generateCylinder(level_vertices[i], level_indexes[i], center, 0.02f, -1.3f, -1.1f, segments[i], false, color);
+			optimizeLodLevel(level_vertices[i], level_indexes[i]);
+		}
+	});
+	for (size_t i = 0; i < level_count; ++i) {
+		appendLodLevel(lod, vertices, indexes, level_vertices[i], level_indexes[i], cylinderError(0.05f, segments[i]));
+	}
 
-	// Vertex Buffer Object (VBO)
-	GLuint vbo = 0;
+	boundLodMesh(lod, &vertices[first], (vertices.size() - first) / 2, 0.0f);
+}
 
-	// Element Buffer Object (EBO)
-	GLuint ebo = 0;
+// Sphere levels, appended to vertices and indexes. Levels are built as jobs and appended in order.
+void createSphereLod(lodmesh &lod, std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indexes, glm::vec3 center, float radius,
+	jobsystem *jobs = NULL) {
+	TRACE_ZONE("create sphere");
+	const unsigned int sectors[] = { 36, 24, 16, 10 };
+	const size_t level_count = sizeof(sectors) / sizeof(sectors[0]);
+	glm::vec3 color(0.0f, 1.0f, 0.0f);
+	size_t first = vertices.size();
+
+	std::vector<glm::vec3> level_vertices[level_count];
+	std::vector<unsigned int> level_indexes[level_count];
+	parallelFor(jobs, 0, level_count, 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			unsigned int stacks = sectors[i] / 2;
+			reserveMesh(level_vertices[i], level_indexes[i], sphereCounts(sectors[i], stacks));
+
+			generateSphere(level_vertices[i], level_indexes[i], center, radius, sectors[i], stacks, color);
+			optimizeLodLevel(level_vertices[i], level_indexes[i]);
+		}
+	});
+	for (size_t i = 0; i < level_count; ++i) {
+		unsigned int stacks = sectors[i] / 2;
+		appendLodLevel(lod, vertices, indexes, level_vertices[i], level_indexes[i], sphereError(radius, sectors[i], stacks));
+	}
 
-	glGenBuffers(1, &vbo);
-	glGenBuffers(1, &ebo);
+	boundLodMesh(lod, &vertices[first], (vertices.size() - first) / 2, 0.0f);
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+// Simplified index lists for the flag, every level uses the mesh's own vertices.
+// The levels are kept in the mesh cache, so only a cold start simplifies.
+void createFlagLod(lodmesh &lod, std::vector<unsigned int> &indexes, const cachedmesh &mesh) {
+	TRACE_ZONE("create flag lod");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t vertex_count = mesh.vertex_count / 2;
+	std::vector<unsigned int> full(mesh.indexes, mesh.indexes + mesh.index_count);
+	addLodIndexes(lod, indexes, full, 0.0f);
+
+	// The flag is simplified against several phases of its wave so a level holds up while it moves
+	flagwave wave;
+	initFlagWave(wave, mesh.vertices, mesh.vertex_count);
+	float amplitude = 0.0f;
+	for (size_t v = 0; v < vertex_count; ++v) amplitude = std::max(amplitude, fabsf(0.5f * wave.x[v]));
+
+	if (mesh.simplified) {
+		const unsigned int *level = mesh.lod_indexes;
+		for (size_t l = 0; l < mesh.lod_count; ++l) {
+			addLodIndexes(lod, indexes, std::vector<unsigned int>(level, level + mesh.lods[l].index_count), mesh.lods[l].error);
+			level += mesh.lods[l].index_count;
+		}
+	}
+	else {
+		std::vector<std::vector<glm::vec3> > poses(4);
+		for (size_t p = 0; p < poses.size(); ++p) {
+			poses[p] = wave.positions;
+			flagWaveScalar(&wave.x[0], &poses[p][0].x, vertex_count, float(p) * 0.5f * float(M_PI));
+		}
 
-	// Load Vertex Data
-	//glBufferData(GL_ARRAY_BUFFER, sizeof(buffer) * sizeof(GLfloat), buffer, GL_STATIC_DRAW);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
+		// One run cut at each target, a level that barely shrinks is not worth keeping
+		simplifier s;
+		initSimplifier(s, full, mesh.vertices, vertex_count, poses);
+		const unsigned int ratios[] = { 4, 16, 64 };
+		std::vector<meshcachelod> levels;
+		std::vector<unsigned int> level_indexes;
+		for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); ++i) {
+			float error = simplifyTo(s, full.size() / ratios[i], 1e30f);
+			if (s.indexes.size() * 5 > lod.levels.back().index_count * 4) break;
+			std::vector<unsigned int> level = s.indexes;
+			optimizeVertexCache(level, vertex_count);
+			addLodIndexes(lod, indexes, level, error);
+			meshcachelod cached = { (uint32_t)level.size(), error };
+			levels.push_back(cached);
+			level_indexes.insert(level_indexes.end(), level.begin(), level.end());
+		}
 
-	// Load Element Data
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexes.size() * sizeof(unsigned int), &indexes[0], GL_STATIC_DRAW);
+		// Write the cache again with the levels for the next run, also when none was kept
+		if (!mesh.source.empty() &&
+			!writeMeshCache(mesh.source.c_str(), mesh.vertices, mesh.vertex_count, mesh.indexes, mesh.index_count,
+				levels.empty() ? NULL : &levels[0], levels.size(), level_indexes.empty() ? NULL : &level_indexes[0], level_indexes.size(), true)) {
+			std::cerr << "Warning: could not write " << meshCachePath(mesh.source.c_str()) << std::endl;
+		}
+	}
 
+	boundLodMesh(lod, mesh.vertices, vertex_count, amplitude);
 
-	// Set Vertex Attribute Pointers
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), NULL);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(float)));
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("%s flag: %.2f ms\n", mesh.simplified ? "Cached simplified" : "Simplified", ms);
+}
 
-	// Enable Vertex Attribute Arrays
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
+// Triangles drawn with and without LOD over a range of camera distances
+int benchmarkLOD(const char *path) {
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indexes;
+	lodmesh pole, sphere, flag;
+	cachedmesh flag_mesh;
+	if (!loadOBJCached(path, flag_mesh)) return -1;
+
+	createPoleLod(pole, vertices, indexes, glm::vec3(0.0f));
+	createSphereLod(sphere, vertices, indexes, glm::vec3(0.0f, 0.08f, 0.0f), 0.08f);
+	createFlagLod(flag, indexes, flag_mesh);
+	printLodMesh("pole", pole);
+	printLodMesh("sphere", sphere);
+	printLodMesh("flag", flag);
+
+	const lodmesh *meshes[3] = { &pole, &sphere, &flag };
+	const float distances[] = { 1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 32.0f, 64.0f, 100.0f };
+	float scale = lodProjectionScale(glm::radians(45.0f), 768.0f);
+
+	printf("distance   levels   triangles full    lod  saved\n");
+	for (size_t d = 0; d < sizeof(distances) / sizeof(distances[0]); ++d) {
+		glm::vec3 camera(0.0f, 1.0f, distances[d]);
+		unsigned int full = 4, drawn = 4;	// ground
+		char levels[16];
+		for (int m = 0; m < 3; ++m) {
+			unsigned int level = selectLod(*meshes[m], 0, lodDistance(*meshes[m], camera), scale);
+			full += meshes[m]->levels[0].index_count / 3;
+			drawn += meshes[m]->levels[level].index_count / 3;
+			levels[2 * m] = char('0' + level);
+			levels[2 * m + 1] = m < 2 ? '/' : '\0';
+		}
+		printf("%8g   %s   %14u %6u  %4.1f%%\n", distances[d], levels, full, drawn, 100.0 * (full - drawn) / full);
+	}
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	releaseMesh(flag_mesh);
+	return 0;
+}
 
-		
-	//draw a sphere
+// Initialise GLFW and GLEW and open a window with a 3.3 core context, NULL on failure
+GLFWwindow* openWindow(bool visible) {
+	// Initialise GLFW
+	if( !glfwInit() )
+	{
+		fprintf( stderr, "Failed to initialize GLFW\n" );
+		return NULL;
+	}
 
-	std::vector<glm::vec3> sphere_vertices;
-	std::vector<unsigned int> sphere_indexes;
-	float radius = 0.08f;
-	center.y = 0.08f;
+	glfwWindowHint(GLFW_SAMPLES, 4);
+	glfwWindowHint(GLFW_RESIZABLE,GL_FALSE);
+	glfwWindowHint(GLFW_VISIBLE, visible ? GL_TRUE : GL_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-	createSphere(sphere_vertices, sphere_indexes, center, radius);
-	
-	// Vertex Array Objects
-	GLuint v_sphere_oject = 0;
-	glGenVertexArrays(1, &v_sphere_oject);
-	glBindVertexArray(v_sphere_oject);
+	// Open a window and create its OpenGL context
+	GLFWwindow* result = glfwCreateWindow( 1024, 768, "Playground", NULL, NULL);
+	if( result == NULL ){
+		fprintf( stderr, "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials.\n" );
+		glfwTerminate();
+		return NULL;
+	}
+	glfwMakeContextCurrent(result);
 
+	// Initialize GLEW
+	if (glewInit() != GLEW_OK) {
+		fprintf(stderr, "Failed to initialize GLEW\n");
+		glfwTerminate();
+		return NULL;
+	}
 
-	// Vertex Buffer Object (VBO)
-	GLuint vbo2 = 0;
+	return result;
+}
 
-	// Element Buffer Object (EBO)
-	GLuint ebo2 = 0;
+// Render the flag offscreen with the CPU and the vertex shader animation and compare the images
+int testFlagWaveGPU() {
+	window = openWindow(false);
+	if (window == NULL) return -1;
 
-	glGenBuffers(1, &vbo2);
-	glGenBuffers(1, &ebo2);
+	shaderprogram programs[2];
+	cachedmesh mesh;
+	if (!loadShaderProgram(programs[0], "vert.glsl", "frag.glsl") ||
+		!loadShaderProgram(programs[1], "flagvert.glsl", "flagfrag.glsl") ||
+		!loadOBJCached("vertexstore.obj", mesh)) {
+		glfwTerminate();
+		return -1;
+	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo2);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo2);
+	flagwave wave;
+	initFlagWave(wave, mesh.vertices, mesh.vertex_count);
+	flagwaveentry kernel = selectFlagWaveKernel();
 
-	// Load Vertex Data
-	//glBufferData(GL_ARRAY_BUFFER, sizeof(buffer) * sizeof(GLfloat), buffer, GL_STATIC_DRAW);
-	glBufferData(GL_ARRAY_BUFFER, sphere_vertices.size() * sizeof(glm::vec3), &sphere_vertices[0], GL_STATIC_DRAW);
+	// A single copy, the vertex arrays below have no instance buffer
+	setIdentityInstance();
 
-	// Load Element Data
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sphere_indexes.size() * sizeof(unsigned int), &sphere_indexes[0], GL_STATIC_DRAW);
+	// Interleaved static buffer for the shader path, separate positions for the CPU path
+	GLuint vao[2], vbo[2], ebo;
+	glGenVertexArrays(2, vao);
+	glGenBuffers(2, vbo);
+	glGenBuffers(1, &ebo);
 
+	cachedBindVertexArray(vao[0]);
+	cachedBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.index_count * sizeof(unsigned int), mesh.indexes, GL_STATIC_DRAW);
+	cachedBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+	glBufferData(GL_ARRAY_BUFFER, mesh.vertex_count * sizeof(glm::vec3), mesh.vertices, GL_STATIC_DRAW);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(float)));
+	cachedBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+	glBufferData(GL_ARRAY_BUFFER, wave.positions.size() * sizeof(glm::vec3), &wave.positions[0], GL_DYNAMIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), NULL);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
 
-	// Set Vertex Attribute Pointers
+	cachedBindVertexArray(vao[1]);
+	cachedBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	cachedBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), NULL);
 	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(float)));
-
-	// Enable Vertex Attribute Arrays
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
+	cachedBindVertexArray(0);
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	
+	offscreen target;
+	if (!createOffscreen(target, 512, 512)) {
+		glfwTerminate();
+		return -1;
+	}
+	cachedEnable(GL_DEPTH_TEST);
+	glClearColor(0.0f, 0.0f, 0.2f, 0.0f);
 
-	
+	// Look at the flag from the side so the wave is visible
+	glm::mat4 model = glm::mat4(1.0f);
+	glm::mat4 view = glm::lookAt(glm::vec3(2.0f, 0.5f, 2.0f), glm::vec3(0.3f, -0.1f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 100.0f);
+	frameuniforms frame;
+	createFrameUniforms(frame, 1);
+
+	const double times[] = { 0.0, 1.3, 7.7, 3600.25 };
+	std::vector<unsigned char> images[2];
+	int failures = 0;
+
+	for (size_t j = 0; j < sizeof(times) / sizeof(times[0]); ++j) {
+		// CPU animation
+		updateFlagWave(wave, kernel.kernel, times[j], &wave.positions[0]);
+		cachedBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, wave.positions.size() * sizeof(glm::vec3), &wave.positions[0]);
+
+		// Vertex shader animation
+		setObject(frame, 0, model, flagWaveTime(times[j]));
+		uploadFrameUniforms(frame, view, projection);
+
+		for (int i = 0; i < 2; ++i) {
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			useShaderProgram(programs[i], frame);
+			bindObject(programs[i], frame, 0);
+			cachedBindVertexArray(vao[i]);
+			glDrawElements(GL_TRIANGLES, (GLsizei)mesh.index_count, GL_UNSIGNED_INT, NULL);
+			readOffscreen(target, images[i]);
+		}
 
-	// Read our .obj file to get the vertices and colors for the flag including the indexes of the triangle
-	std::vector<glm::vec3> flag_vertices;
-	std::vector<unsigned int> flag_indexes;
-	bool res = loadOBJ("vertexstore.obj", flag_vertices, flag_indexes);
+		// Edges may land on different pixels, interiors must agree
+		size_t different = 0;
+		for (size_t p = 0; p < images[0].size(); p += 4) {
+			int diff = 0;
+			for (int c = 0; c < 3; ++c) diff = std::max(diff, abs(int(images[0][p + c]) - int(images[1][p + c])));
+			if (diff > 16) ++different;
+		}
+		double fraction = double(different) / double(images[0].size() / 4);
+		bool ok = fraction < 0.002;
+		printf("flag wave gpu t=%-8g %6u pixels differ (%.3f%%) %s\n", times[j], (unsigned int)different, fraction * 100.0, ok ? "ok" : "FAILED");
+		if (!ok) ++failures;
+	}
 
-	if (res == false)
-	{
-		fprintf(stderr, "Failed to load flag object file\n");
-		getchar();
+	cachedBindVertexArray(0);
+	destroyOffscreen(target);
+	cachedDeleteVertexArrays(2, vao);
+	cachedDeleteBuffers(2, vbo);
+	cachedDeleteBuffers(1, &ebo);
+	destroyFrameUniforms(frame);
+	destroyShaderProgram(programs[0]);
+	destroyShaderProgram(programs[1]);
+	releaseMesh(mesh);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+
+	return failures == 0 ? 0 : -1;
+}
+
+// Add and remove random meshes at runtime, check every live mesh survives the
+// repacks and that multi draw indirect and the base vertex loop draw the same image
+int testGeometryArena(int iterations) {
+	window = openWindow(false);
+	if (window == NULL) return -1;
+
+	shaderprogram program;
+	offscreen target;
+	if (!loadShaderProgram(program, "vert.glsl", "frag.glsl") || !createOffscreen(target, 512, 512)) {
 		glfwTerminate();
 		return -1;
 	}
 
-	// Vertex Array Objects
-	GLuint v_flag_object = 0;
-	glGenVertexArrays(1, &v_flag_object);
-	glBindVertexArray(v_flag_object);
+	// Start small so the churn has to compact and grow
+	geometryarena arena;
+	createGeometryArena(arena, 4096, 16384);
+
+	struct sourcemesh {
+		unsigned int handle;
+		std::vector<glm::vec3> vertices;
+		std::vector<unsigned int> indexes;
+	};
+	std::vector<sourcemesh> live;
+	unsigned int seed = 12345;
+	double add_ms = 0.0, remove_ms = 0.0;
+	int adds = 0, removes = 0, failures = 0;
+
+	for (int i = 0; i < iterations; ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		if (live.size() < 8 || (seed >> 16) % 3 != 0) {
+			// A sphere or cylinder somewhere in the view, at a random tessellation
+			sourcemesh mesh;
+			unsigned int segments = 6 + (seed >> 8) % 90;
+			glm::vec3 position(float(int(seed % 17) - 8) * 0.1f, float(int((seed >> 4) % 13) - 6) * 0.1f, 0.0f);
+			glm::vec3 color(float(seed & 1), float((seed >> 1) & 1), 1.0f);
+			if ((seed >> 12) & 1) generateSphere(mesh.vertices, mesh.indexes, position, 0.08f, segments, segments / 2 + 2, color);
+			else generateCylinder(mesh.vertices, mesh.indexes, position, 0.05f, position.y - 0.2f, position.y + 0.2f, segments, true, color);
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			mesh.handle = addArenaMesh(arena, mesh.vertices, mesh.indexes);
+			add_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			++adds;
+			live.push_back(mesh);
+		}
+		else {
+			size_t victim = (seed >> 20) % live.size();
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			removeArenaMesh(arena, live[victim].handle);
+			remove_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			++removes;
+			live[victim] = live.back();
+			live.pop_back();
+		}
+	}
 
+	// Read every live mesh back from where the arena says it is
+	for (size_t m = 0; m < live.size(); ++m) {
+		const arenamesh &mesh = arena.meshes[live[m].handle];
+		std::vector<glm::vec3> vertices(mesh.vertex_count * 2);
+		std::vector<unsigned int> indexes(mesh.index_count);
+		cachedBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+		glGetBufferSubData(GL_ARRAY_BUFFER, (GLintptr)mesh.base_vertex * 2 * sizeof(glm::vec3), vertices.size() * sizeof(glm::vec3), &vertices[0]);
+		cachedBindBuffer(GL_ARRAY_BUFFER, arena.ebo);
+		glGetBufferSubData(GL_ARRAY_BUFFER, (GLintptr)mesh.first_index * sizeof(unsigned int), indexes.size() * sizeof(unsigned int), &indexes[0]);
+		if (memcmp(&vertices[0], &live[m].vertices[0], vertices.size() * sizeof(glm::vec3)) != 0 ||
+			memcmp(&indexes[0], &live[m].indexes[0], indexes.size() * sizeof(unsigned int)) != 0) ++failures;
+	}
+	cachedBindBuffer(GL_ARRAY_BUFFER, 0);
+	printf("arena churn: %d adds %.3f ms, %d removes %.3f ms, %u live meshes, %d corrupted %s\n", adds, add_ms, removes, remove_ms,
+		(unsigned int)live.size(), failures, failures == 0 ? "ok" : "FAILED");
+	printGeometryArena(arena);
 
-	// Vertex Buffer Object (VBO)
-	GLuint vbo3 = 0;
+	// Draw everything both ways
+	cachedEnable(GL_DEPTH_TEST);
+	glClearColor(0.0f, 0.0f, 0.2f, 0.0f);
+	frameuniforms frame;
+	createFrameUniforms(frame, 1);
+	setObject(frame, 0, glm::mat4(1.0f), 0.0f);
+	uploadFrameUniforms(frame, glm::lookAt(glm::vec3(0.0f, 0.0f, 2.5f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+		glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 100.0f));
+
+	bool multi_draw = arena.multi_draw;
+	std::vector<unsigned char> images[2];
+	unsigned int calls[2];
+	for (int i = 0; i < 2; ++i) {
+		arena.multi_draw = multi_draw && i == 0;
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		useShaderProgram(program, frame);
+		bindObject(program, frame, 0);
+		for (size_t m = 0; m < live.size(); ++m) addArenaDraw(arena, live[m].handle);
+		calls[i] = submitGeometryArena(arena);
+		readOffscreen(target, images[i]);
+	}
+	arena.multi_draw = multi_draw;
+	bool same = images[0] == images[1];
+	printf("arena draw: %u calls %s, %u calls base vertex, images %s\n", calls[0], multi_draw ? "multi draw indirect" : "base vertex",
+		calls[1], same ? "match ok" : "differ FAILED");
+	if (!same) ++failures;
+
+	destroyFrameUniforms(frame);
+	destroyGeometryArena(arena);
+	destroyOffscreen(target);
+	destroyShaderProgram(program);
+	glfwDestroyWindow(window);
+	glfwTerminate();
 
-	// Element Buffer Object (EBO)
-	GLuint ebo3 = 0;
+	return failures == 0 ? 0 : -1;
+}
+
+// Frustum culling of count copies through the BVH against testing every box,
+// with 1% of the copies moving and refit every frame
+int benchmarkCulling(unsigned int count, int frames) {
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indexes;
+	lodmesh pole, sphere, flag;
+	cachedmesh flag_mesh;
+	if (!loadOBJCached("vertexstore.obj", flag_mesh)) return -1;
+	createPoleLod(pole, vertices, indexes, glm::vec3(0.0f));
+	createSphereLod(sphere, vertices, indexes, glm::vec3(0.0f, 0.08f, 0.0f), 0.08f);
+	createFlagLod(flag, indexes, flag_mesh);
+	releaseMesh(flag_mesh);
+	glm::vec3 low = glm::min(glm::min(pole.low, sphere.low), flag.low);
+	glm::vec3 high = glm::max(glm::max(pole.high, sphere.high), flag.high);
+
+	std::vector<instancedata> instances;
+	layoutInstances(instances, count, INSTANCE_SPACING);
+	std::vector<glm::vec3> lows, highs;
+	instanceBoxes(instances, low, high, lows, highs);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bvh tree;
+	buildBvh(tree, lows, highs);
+	double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("BVH: %u copies, %u nodes, built in %.2f ms\n", count, (unsigned int)tree.nodes.size(), build_ms);
+
+	// Walk around inside the grid, most of it behind or beside the camera
+	float extent = instanceLayoutExtent(count, INSTANCE_SPACING);
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, std::max(100.0f, extent * 4.0f));
+	std::vector<unsigned int> visible, reference;
+	cullstats stats;
+	double bvh_ms = 0.0, brute_ms = 0.0, refit_ms = 0.0;
+	uint64_t visible_total = 0, nodes_total = 0, refit_total = 0;
+	unsigned int seed = 1, mismatches = 0, moving = std::max(1u, count / 100);
+
+	for (int f = 0; f < frames; ++f) {
+		float angle = 2.0f * float(M_PI) * f / frames;
+		glm::vec3 camera(sinf(angle) * extent * 0.5f, 2.0f, cosf(angle) * extent * 0.5f);
+		glm::vec3 target = camera + glm::vec3(cosf(angle), -0.2f, -sinf(angle));
+		frustum view = extractFrustum(projection * glm::lookAt(camera, target, glm::vec3(0.0f, 1.0f, 0.0f)));
+
+		// Nudge some copies and refit the nodes above them
+		for (unsigned int m = 0; m < moving; ++m) {
+			seed = seed * 1664525u + 1013904223u;
+			unsigned int id = (seed >> 8) % count;
+			instances[id].position_scale.x += ((seed & 0xff) / 255.0f - 0.5f) * 0.1f;
+			instanceBounds(instances[id], low, high, lows[id], highs[id]);
+			updateBvhItem(tree, id, lows[id], highs[id]);
+		}
+		start = std::chrono::steady_clock::now();
+		refit_total += refitBvh(tree);
+		refit_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		cullBvh(tree, view, visible, stats);
+		bvh_ms += stats.ms;
+		visible_total += stats.visible;
+		nodes_total += stats.nodes_visited;
+
+		start = std::chrono::steady_clock::now();
+		reference.clear();
+		for (unsigned int i = 0; i < count; ++i) {
+			if (boxInFrustum(view, lows[i], highs[i])) reference.push_back(i);
+		}
+		brute_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-	glGenBuffers(1, &vbo3);
-	glGenBuffers(1, &ebo3);
+		std::sort(visible.begin(), visible.end());
+		if (visible != reference) ++mismatches;
+	}
+
+	printf("visible %.1f of %u (%.1f%% culled), %.1f of %u nodes visited\n", double(visible_total) / frames, count,
+		100.0 - 100.0 * double(visible_total) / frames / count, double(nodes_total) / frames, (unsigned int)tree.nodes.size());
+	printf("bvh cull %.3f ms, every box %.3f ms (%.1fx), refit of %u moved copies %.3f ms over %.1f nodes\n",
+		bvh_ms / frames, brute_ms / frames, brute_ms / bvh_ms, moving, refit_ms / frames, double(refit_total) / frames);
+	printf("%d frames, %u with a different visible set %s\n", frames, mismatches, mismatches == 0 ? "ok" : "FAILED");
+	return mismatches == 0 ? 0 : -1;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo3);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo3);
+// Headless stress test of the instanced flagpoles, from 1 copy up to max_count.
+// Up to 10k copies the same frame is also drawn with one draw call per copy.
+int benchmarkInstances(unsigned int max_count, int frames) {
+	headlesscontext context;
+	offscreen target;
+	if (!createHeadlessContext(context) || !createOffscreen(target, 1024, 768)) {
+		destroyHeadlessContext(context);
+		return -1;
+	}
 
-	// Load Vertex Data
-	//glBufferData(GL_ARRAY_BUFFER, sizeof(buffer) * sizeof(GLfloat), buffer, GL_STATIC_DRAW);
-	glBufferData(GL_ARRAY_BUFFER, flag_vertices.size() * sizeof(glm::vec3), &flag_vertices[0], GL_STATIC_DRAW);
+	shaderprogram program, flag_program;
+	cachedmesh flag_mesh;
+	if (!loadShaderProgram(program, "instancevert.glsl", "frag.glsl") ||
+		!loadShaderProgram(flag_program, "flagvert.glsl", "flagfrag.glsl") ||
+		!loadOBJCached("vertexstore.obj", flag_mesh)) {
+		destroyOffscreen(target);
+		destroyHeadlessContext(context);
+		return -1;
+	}
 
-	// Load Element Data
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, flag_indexes.size() * sizeof(unsigned int), &flag_indexes[0], GL_STATIC_DRAW);
+	geometryarena arena;
+	createGeometryArena(arena, 1 << 16, 1 << 18);
+	instancebuffer instance_buffer;
+	createInstanceBuffer(instance_buffer);
+	attachArenaInstances(arena, instance_buffer.buffer);
 
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indexes;
+	lodmesh lods[3];
+	unsigned int meshes[3];
+	createPoleLod(lods[0], vertices, indexes, glm::vec3(0.0f));
+	meshes[0] = addArenaMesh(arena, vertices, indexes);
+	vertices.clear();
+	indexes.clear();
+	createSphereLod(lods[1], vertices, indexes, glm::vec3(0.0f, 0.08f, 0.0f), 0.08f);
+	meshes[1] = addArenaMesh(arena, vertices, indexes);
+	indexes.clear();
+	createFlagLod(lods[2], indexes, flag_mesh);
+	meshes[2] = addArenaMesh(arena, flag_mesh.vertices, flag_mesh.vertex_count / 2, &indexes[0], indexes.size());
+	printGeometryArena(arena);
+
+	cachedEnable(GL_DEPTH_TEST);
+	glClearColor(0.0f, 0.0f, 0.2f, 0.0f);
+	frameuniforms frame;
+	createFrameUniforms(frame, 2);
+	float lod_scale = lodProjectionScale(glm::radians(45.0f), 768.0f);
+
+	std::vector<instancedata> assemblies, staging;
+	std::vector<unsigned int> visible;
+	std::vector<unsigned char> levels[3];
+	std::vector<lodbatch> batches[3];
+
+	printf("%9s %-9s %6s %12s %10s %10s %12s\n", "instances", "draws", "calls", "triangles", "cpu ms", "frame ms", "instances/ms");
+	for (unsigned int count = 1; count <= max_count; count *= 10) {
+		// Look down on the whole grid from one side
+		layoutInstances(assemblies, count, INSTANCE_SPACING);
+		float extent = instanceLayoutExtent(count, INSTANCE_SPACING);
+		glm::vec3 camera(0.0f, 1.0f + extent * 0.6f, 4.0f + extent * 1.2f);
+		glm::mat4 view = glm::lookAt(camera, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 4.0f + extent * 4.0f);
+		for (int i = 0; i < 3; ++i) levels[i].clear();
+		visible.resize(count);
+		for (unsigned int i = 0; i < count; ++i) visible[i] = i;
+
+		for (int per_copy = 0; per_copy < 2; ++per_copy) {
+			if (per_copy && count > 10000) break;
+			double cpu_ms = 0.0, frame_ms = 0.0;
+			unsigned int calls = 0;
+			uint64_t triangles = 0;
+
+			for (int f = 0; f < frames + 1; ++f) {
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				setObject(frame, 0, glm::mat4(1.0f), 0.0f);
+				setObject(frame, 1, glm::mat4(1.0f), flagWaveTime(f / 60.0));
+				uploadFrameUniforms(frame, view, projection);
+
+				staging.clear();
+				for (int i = 0; i < 3; ++i) batchLodInstances(lods[i], assemblies, visible, levels[i], camera, lod_scale, staging, batches[i]);
+				uploadInstances(instance_buffer, staging);
+
+				// Instanced: one command per mesh and level. Per copy: one draw call each.
+				unsigned int frame_calls = 0;
+				uint64_t frame_triangles = 0;
+				bool multi_draw = arena.multi_draw;
+				arena.multi_draw = multi_draw && !per_copy;
+				for (int i = 0; i < 3; ++i) {
+					if (i == 0) {
+						useShaderProgram(program, frame);
+						bindObject(program, frame, 0);
+					}
+					else if (i == 2) {
+						frame_calls += submitGeometryArena(arena);
+						useShaderProgram(flag_program, frame);
+						bindObject(flag_program, frame, 1);
+					}
+					for (size_t b = 0; b < batches[i].size(); ++b) {
+						const lodbatch &batch = batches[i][b];
+						const lodlevel &level = lods[i].levels[batch.level];
+						frame_triangles += (uint64_t)batch.instance_count * (level.index_count / 3);
+						if (!per_copy) {
+							addArenaInstances(arena, meshes[i], level.first_index, level.index_count, batch.first_instance, batch.instance_count);
+							continue;
+						}
+						for (unsigned int k = 0; k < batch.instance_count; ++k) {
+							addArenaInstances(arena, meshes[i], level.first_index, level.index_count, batch.first_instance + k, 1);
+						}
+					}
+				}
+				frame_calls += submitGeometryArena(arena);
+				arena.multi_draw = multi_draw;
+				std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+				glFinish();
+				std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+				// The first frame warms up the buffers and is not counted
+				if (f == 0) continue;
+				cpu_ms += std::chrono::duration<double, std::milli>(submitted - start).count();
+				frame_ms += std::chrono::duration<double, std::milli>(end - start).count();
+				calls = frame_calls;
+				triangles = frame_triangles;
+			}
+			cpu_ms /= frames;
+			frame_ms /= frames;
+			printf("%9u %-9s %6u %12llu %10.3f %10.3f %12.1f\n", count, per_copy ? "per copy" : "instanced", calls,
+				(unsigned long long)triangles, cpu_ms, frame_ms, count / frame_ms);
+		}
+	}
 
-	// Set Vertex Attribute Pointers
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), NULL);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(float)));
+	destroyFrameUniforms(frame);
+	destroyInstanceBuffer(instance_buffer);
+	destroyGeometryArena(arena);
+	destroyShaderProgram(program);
+	destroyShaderProgram(flag_program);
+	releaseMesh(flag_mesh);
+	destroyOffscreen(target);
+	destroyHeadlessContext(context);
+	return 0;
+}
 
-	// Enable Vertex Attribute Arrays
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
+// Grid of count flagpoles split into cells, as scene code walking its groups
+// would hand them over, drawn in three orders through the render queue: mesh by
+// mesh like the render loop used to, cell by cell as submitted, and sorted by
+// key. Counts the state changes and the fragments that passed the depth test.
+int benchmarkRenderQueue(unsigned int count, int frames) {
+	headlesscontext context;
+	offscreen target;
+	if (!createHeadlessContext(context) || !createOffscreen(target, 1024, 768)) {
+		destroyHeadlessContext(context);
+		return -1;
+	}
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	shaderprogram program, flag_program;
+	cachedmesh flag_mesh;
+	if (!loadShaderProgram(program, "instancevert.glsl", "frag.glsl") ||
+		!loadShaderProgram(flag_program, "flagvert.glsl", "flagfrag.glsl") ||
+		!loadOBJCached("vertexstore.obj", flag_mesh)) {
+		destroyOffscreen(target);
+		destroyHeadlessContext(context);
+		return -1;
+	}
 
-	// use the program
-	glUseProgram(programID);
+	geometryarena arena;
+	createGeometryArena(arena, 1 << 16, 1 << 18);
+	instancebuffer instance_buffer;
+	createInstanceBuffer(instance_buffer);
+	attachArenaInstances(arena, instance_buffer.buffer);
 
-	// retrieve the matrix uniform locations
-	GLuint projectionLoc = glGetUniformLocation(programID, "u_Projection");
-		
-	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f);
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indexes;
+	lodmesh lods[3];
+	unsigned int meshes[3];
+	createPoleLod(lods[0], vertices, indexes, glm::vec3(0.0f));
+	meshes[0] = addArenaMesh(arena, vertices, indexes);
+	vertices.clear();
+	indexes.clear();
+	createSphereLod(lods[1], vertices, indexes, glm::vec3(0.0f, 0.08f, 0.0f), 0.08f);
+	meshes[1] = addArenaMesh(arena, vertices, indexes);
+	indexes.clear();
+	createFlagLod(lods[2], indexes, flag_mesh);
+	meshes[2] = addArenaMesh(arena, flag_mesh.vertices, flag_mesh.vertex_count / 2, &indexes[0], indexes.size());
+	const shaderprogram *programs[3] = { &program, &program, &flag_program };
+	const unsigned int objects[3] = { 0, 0, 1 };
+
+	cachedEnable(GL_DEPTH_TEST);
+	glClearColor(0.0f, 0.0f, 0.2f, 0.0f);
+	frameuniforms frame;
+	createFrameUniforms(frame, 2);
+	float lod_scale = lodProjectionScale(glm::radians(45.0f), 768.0f);
+	GLuint samples_query = 0;
+	glGenQueries(1, &samples_query);
+
+	// Look along the grid from just outside it at flag height, so the near copies hide the far ones
+	std::vector<instancedata> assemblies, staging;
+	layoutInstances(assemblies, count, INSTANCE_SPACING);
+	float extent = instanceLayoutExtent(count, INSTANCE_SPACING);
+	glm::vec3 camera(0.0f, -0.2f, extent + 1.0f);
+	glm::mat4 view = glm::lookAt(camera, glm::vec3(0.0f, -0.4f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 4.0f + extent * 4.0f);
+
+	const unsigned int side = 8, cell_count = side * side;
+	std::vector<std::vector<unsigned int> > cells(cell_count);
+	for (unsigned int i = 0; i < count; ++i) {
+		const glm::vec4 &p = assemblies[i].position_scale;
+		int x = std::min(std::max(int((p.x + extent) / (2.0f * extent) * side), 0), int(side) - 1);
+		int z = std::min(std::max(int((p.z + extent) / (2.0f * extent) * side), 0), int(side) - 1);
+		cells[z * side + x].push_back(i);
+	}
+	std::vector<unsigned char> levels[3];
+	std::vector<std::vector<lodbatch> > batches(cell_count * 3);
+	renderqueue queue;
+	std::vector<unsigned char> images[3];
+
+	const char *names[3] = { "by mesh", "by cell", "sorted" };
+	printf("%u flagpoles in %u cells, %s\n", count, cell_count, arena.multi_draw ? "multi draw indirect" : "base vertex");
+	printf("%-8s %7s %9s %6s %9s %6s %10s %10s %10s %10s\n", "order", "packets", "programs", "vaos", "gl calls", "draws",
+		"sort ms", "cpu ms", "frame ms", "frags/px");
+	for (int order = 0; order < 3; ++order) {
+		double sort_ms = 0.0, cpu_ms = 0.0, frame_ms = 0.0, fragments = 0.0;
+		uint64_t state_calls = 0;
+		for (int f = 0; f < frames + 1; ++f) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			beginGLStateFrame();
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			setObject(frame, 0, glm::mat4(1.0f), 0.0f);
+			setObject(frame, 1, glm::mat4(1.0f), flagWaveTime(f / 60.0));
+			uploadFrameUniforms(frame, view, projection);
+
+			staging.clear();
+			for (unsigned int c = 0; c < cell_count; ++c) {
+				for (int m = 0; m < 3; ++m) batchLodInstances(lods[m], assemblies, cells[c], levels[m], camera, lod_scale, staging, batches[c * 3 + m]);
+			}
+			uploadInstances(instance_buffer, staging);
+
+			clearRenderQueue(queue);
+			for (unsigned int i = 0; i < cell_count * 3; ++i) {
+				// Mesh by mesh walks the cells once per mesh, the others cell by cell
+				unsigned int c = order == 0 ? i % cell_count : i / 3, m = order == 0 ? i / cell_count : i % 3;
+				submitArenaLodBatches(queue, RENDER_PASS_OPAQUE, *programs[m], objects[m], arena, meshes[m], lods[m], batches[c * 3 + m], staging, camera);
+			}
+			std::chrono::steady_clock::time_point sort_start = std::chrono::steady_clock::now();
+			if (order == 2) sortRenderQueue(queue);
+			std::chrono::steady_clock::time_point sorted = std::chrono::steady_clock::now();
+
+			glBeginQuery(GL_SAMPLES_PASSED, samples_query);
+			executeRenderQueue(queue, frame);
+			glEndQuery(GL_SAMPLES_PASSED);
+			std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+			glFinish();
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+			// The first frame warms up the buffers and is not counted
+			if (f == 0) {
+				readOffscreen(target, images[order]);
+				continue;
+			}
+			GLuint64 samples = 0;
+			glGetQueryObjectui64v(samples_query, GL_QUERY_RESULT, &samples);
+			fragments += double(samples) / (1024.0 * 768.0);
+			sort_ms += std::chrono::duration<double, std::milli>(sorted - sort_start).count();
+			cpu_ms += std::chrono::duration<double, std::milli>(submitted - start).count();
+			frame_ms += std::chrono::duration<double, std::milli>(end - start).count();
+			state_calls += glState().frame_issued;
+		}
+		printf("%-8s %7u %9u %6u %9.1f %6u %10.3f %10.3f %10.3f %10.3f\n", names[order], (unsigned int)queue.packets.size(),
+			queue.program_changes, queue.vertex_array_changes, double(state_calls) / frames, queue.calls,
+			sort_ms / frames, cpu_ms / frames, frame_ms / frames, fragments / frames);
+	}
+
+	// Opaque geometry comes out the same in any order, up to ties in depth
+	size_t different = 0;
+	for (size_t i = 0; i < images[0].size(); i += 4) {
+		if (memcmp(&images[0][i], &images[2][i], 3) != 0 || memcmp(&images[1][i], &images[2][i], 3) != 0) ++different;
+	}
+	bool ok = different * 1000 <= images[0].size() / 4;
+	printf("sorted image: %zu pixels differ (%.3f%%) %s\n", different, 100.0 * different / (images[0].size() / 4), ok ? "ok" : "FAILED");
+
+	glDeleteQueries(1, &samples_query);
+	destroyFrameUniforms(frame);
+	destroyInstanceBuffer(instance_buffer);
+	destroyGeometryArena(arena);
+	destroyShaderProgram(program);
+	destroyShaderProgram(flag_program);
+	releaseMesh(flag_mesh);
+	destroyOffscreen(target);
+	destroyHeadlessContext(context);
+	return ok ? 0 : -1;
+}
+
+// Vertex fetch cost of every vertex format without a window: spheres of about
+// vertex_count vertices in all are drawn with rasterization off, so the frame
+// time is the vertex work alone, next to the memory and position error of each
+int benchmarkVertexFormats(unsigned int vertex_count, int frames) {
+	headlesscontext context;
+	offscreen target;
+	if (!createHeadlessContext(context) || !createOffscreen(target, 1024, 768)) {
+		destroyHeadlessContext(context);
+		return -1;
+	}
+
+	shaderprogram float_program, quantized_program;
+	if (!loadShaderProgram(float_program, "instancevert.glsl", "frag.glsl") ||
+		!loadShaderProgram(quantized_program, "quantizedvert.glsl", "frag.glsl")) {
+		destroyOffscreen(target);
+		destroyHeadlessContext(context);
+		return -1;
+	}
+
+	// A grid of unit spheres, each mesh its own bounds slot
+	const unsigned int mesh_count = 16;
+	unsigned int side = std::max(4u, (unsigned int)sqrt((double)vertex_count / mesh_count));
+	std::vector<glm::vec3> vertices[mesh_count];
+	std::vector<unsigned int> indexes[mesh_count];
+	unsigned int total_vertices = 0, total_indexes = 0;
+	for (unsigned int m = 0; m < mesh_count; ++m) {
+		glm::vec3 center((m % 4) * 2.5f, (m / 4) * 2.5f, 0.0f);
+		generateSphere(vertices[m], indexes[m], center, 1.0f, side, side, glm::vec3(0.8f, 0.5f, 0.2f));
+		total_vertices += (unsigned int)vertices[m].size() / 2;
+		total_indexes += (unsigned int)indexes[m].size();
+	}
+
+	// A single copy, the arenas below have no instance buffer
+	setIdentityInstance();
+	frameuniforms frame;
+	createFrameUniforms(frame, 1);
+	setObject(frame, 0, glm::mat4(1.0f), 0.0f);
+	glm::mat4 view = glm::lookAt(glm::vec3(3.75f, 3.75f, 12.0f), glm::vec3(3.75f, 3.75f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	uploadFrameUniforms(frame, view, glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f));
+	cachedEnable(GL_RASTERIZER_DISCARD);
+
+	printf("%u meshes, %u vertices, %u indexes\n", mesh_count, total_vertices, total_indexes);
+	printf("%-16s %6s %12s %12s %12s %10s %10s\n", "format", "bytes", "mesh bytes", "total bytes", "max error", "frame ms", "Mverts/s");
+	for (int encoding = POSITION_FLOAT; encoding <= POSITION_SNORM16; ++encoding) {
+		for (int normals = 0; normals < 2; ++normals) {
+			vertexformat format = makeVertexFormat((positionencoding)encoding, normals != 0);
+			geometryarena arena;
+			createGeometryArena(arena, total_vertices, total_indexes, format);
+			unsigned int handles[mesh_count];
+			size_t total_bytes = 0;
+			float max_error = 0.0f;
+			for (unsigned int m = 0; m < mesh_count; ++m) {
+				size_t count = vertices[m].size() / 2;
+				handles[m] = addArenaMesh(arena, vertices[m], indexes[m]);
+				total_bytes += arenaMeshBytes(arena, handles[m]);
+
+				// What the shader will see against what went in
+				std::vector<unsigned char> packed;
+				glm::vec4 center, extent;
+				packVertices(format, &vertices[m][0], count, &indexes[m][0], indexes[m].size(), handles[m], packed, center, extent);
+				for (size_t v = 0; v < count; ++v) {
+					glm::vec3 position = unpackPosition(format, &packed[v * format.stride], center, extent);
+					max_error = std::max(max_error, glm::length(position - vertices[m][v * 2]));
+				}
+			}
+
+			const shaderprogram &prog = format.quantized ? quantized_program : float_program;
+			useShaderProgram(prog, frame);
+			bindObject(prog, frame, 0);
+			double frame_ms = 0.0;
+			for (int f = 0; f < frames + 1; ++f) {
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				for (unsigned int m = 0; m < mesh_count; ++m) addArenaDraw(arena, handles[m]);
+				submitGeometryArena(arena);
+				glFinish();
+				// The first frame warms up the buffers and is not counted
+				if (f == 0) continue;
+				frame_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+			frame_ms /= frames;
+			printf("%-16s %6d %12u %12u %12.2e %10.3f %10.1f\n", format.name.c_str(), (int)format.stride,
+				(unsigned int)arenaMeshBytes(arena, handles[0]), (unsigned int)total_bytes, max_error, frame_ms, total_vertices / frame_ms / 1000.0);
+			destroyGeometryArena(arena);
+		}
+	}
+
+	cachedDisable(GL_RASTERIZER_DISCARD);
+	destroyFrameUniforms(frame);
+	destroyShaderProgram(float_program);
+	destroyShaderProgram(quantized_program);
+	destroyOffscreen(target);
+	destroyHeadlessContext(context);
+	return 0;
+}
+
+// One flagpole per layout entry: the pole at the root, its flag and the finial sphere on top of it
+void addFlagpoles(scene &s, const std::vector<instancedata> &layout) {
+	for (size_t i = 0; i < layout.size(); ++i) {
+		const instancedata &place = layout[i];
+		glm::vec3 position(place.position_scale.x, place.position_scale.y, place.position_scale.z);
+		unsigned int pole = createEntity(s, SCENE_NO_PARENT, MESH_POLE, position, place.yaw_phase.x, place.position_scale.w);
+		unsigned int flag = createEntity(s, pole, MESH_FLAG, glm::vec3(0.0f), 0.0f, 1.0f);
+		setEntityAnimation(s, flag, 0.0f, place.yaw_phase.y);
+		createEntity(s, pole, MESH_SPHERE, glm::vec3(0.0f, FINIAL_HEIGHT, 0.0f), 0.0f, 1.0f);
+	}
+}
+
+// A scene graph as it is often written, one heap object per entity holding its matrices
+struct scenenode {
+	glm::mat4 local;
+	glm::mat4 world;
+	scenenode *parent;
+	glm::vec3 position;
+	float yaw, scale, spin, phase;
+	unsigned int mesh;
+};
+
+// World transforms of count entities, a third each of poles, flags and finials, with every
+// pole turning. The arrays are updated on one and on threads threads, against scenenode objects.
+int benchmarkScene(unsigned int count, int frames, unsigned int threads) {
+	jobsystem jobs;
+	createJobSystem(jobs, threads);
+	threads = jobs.thread_count;
+	std::vector<instancedata> layout;
+	layoutInstances(layout, (count + 2) / 3, INSTANCE_SPACING);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	scene s;
+	reserveScene(s, 3 * layout.size());
+	addFlagpoles(s, layout);
+	for (unsigned int e = 0; e < sceneSize(s); ++e) {
+		if (s.parent[e] == SCENE_NO_PARENT) s.spin[e] = 0.1f + 0.05f * float(e % 7);
+	}
+	double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// The objects are made in creation order, before the arrays are sorted by depth
+	std::vector<scenenode*> nodes(sceneSize(s));
+	for (unsigned int e = 0; e < sceneSize(s); ++e) {
+		scenenode *node = new scenenode;
+		node->parent = s.parent[e] == SCENE_NO_PARENT ? NULL : nodes[s.parent[e]];
+		node->position = s.position[e];
+		node->yaw = s.yaw[e];
+		node->scale = s.scale[e];
+		node->spin = s.spin[e];
+		node->phase = s.phase[e];
+		node->mesh = s.mesh[e];
+		nodes[e] = node;
+	}
+
+	start = std::chrono::steady_clock::now();
+	std::vector<unsigned int> remap;
+	sortScene(s, remap);
+	double sort_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Scene: %u entities, %u depths, built in %.2f ms, sorted in %.2f ms\n", sceneSize(s),
+		(unsigned int)s.depth_first.size() - 1, build_ms, sort_ms);
+
+	printf("%-24s %10s %14s\n", "update", "ms", "entities/us");
+	double serial_ms = 0.0;
+	std::vector<instancedata> serial;
+	for (int pass = 0; pass < 3; ++pass) {
+		double ms = 0.0;
+		for (int f = 0; f < frames; ++f) {
+			double time = f / 60.0;
+			start = std::chrono::steady_clock::now();
+			if (pass == 0) {
+				for (size_t n = 0; n < nodes.size(); ++n) {
+					scenenode *node = nodes[n];
+					float yaw = node->yaw + (float)fmod(node->spin * time, 2.0 * M_PI);
+					node->local = glm::translate(glm::mat4(1.0f), node->position);
+					node->local = glm::rotate(node->local, yaw, glm::vec3(0.0f, 1.0f, 0.0f));
+					node->local = glm::scale(node->local, glm::vec3(node->scale));
+					node->world = node->parent != NULL ? node->parent->world * node->local : node->local;
+				}
+			}
+			else {
+				updateScene(s, time, pass == 1 ? NULL : &jobs);
+			}
+			ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+		ms /= frames;
+		char label[64];
+		if (pass == 0) snprintf(label, sizeof(label), "objects, 1 thread");
+		else snprintf(label, sizeof(label), "arrays, %u thread%s", pass == 1 ? 1 : threads, pass == 1 || threads == 1 ? "" : "s");
+		printf("%-24s %10.3f %14.1f", label, ms, sceneSize(s) / (ms * 1000.0));
+		if (pass == 1) serial_ms = ms;
+		if (pass == 2) printf("  %.2fx", serial_ms / ms);
+		printf("\n");
+		if (pass == 1) serial = s.world;
+	}
+
+	// Every pass ends on the same frame: the threads match one thread exactly, the matrices closely
+	bool same = memcmp(&serial[0], &s.world[0], serial.size() * sizeof(instancedata)) == 0;
+	float error = 0.0f;
+	for (size_t n = 0; n < nodes.size(); ++n) {
+		glm::vec4 p = s.world[remap[n]].position_scale;
+		glm::vec4 q = nodes[n]->world[3];
+		error = std::max(error, std::max(fabsf(p.x - q.x), std::max(fabsf(p.y - q.y), fabsf(p.z - q.z))));
+		delete nodes[n];
+	}
+	bool ok = same && error < 1e-3f;
+	printf("threaded %s, largest difference to the matrices %g %s\n", same ? "identical" : "DIFFERENT", error, ok ? "ok" : "FAILED");
+	return ok ? 0 : -1;
+}
+
+// Seconds since the first call, the same clock with and without a window
+double getTime() {
+	static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Camera circling the origin at radius, t seconds into the animation
+glm::vec3 orbitCamera(float t, float radius) {
+	float camX = sin(0.1*t) * radius;
+	float camZ = cos(0.1*t) * radius;
+	return glm::vec3(camX, 1.0f, camZ);
+}
+
+// Print frames per second and frame time percentiles
+void printFrameTimes(std::vector<double> frame_times, const char *label) {
+	if (frame_times.empty()) return;
+
+	double total = 0.0;
+	for (size_t i = 0; i < frame_times.size(); ++i) total += frame_times[i];
+	std::sort(frame_times.begin(), frame_times.end());
+
+	// Nearest rank percentile
+	size_t n = frame_times.size();
+	double p50 = frame_times[(n * 50 + 99) / 100 - 1];
+	double p95 = frame_times[(n * 95 + 99) / 100 - 1];
+	double p99 = frame_times[(n * 99 + 99) / 100 - 1];
+
+	printf("Frames: %u, %.1f fps, frame time mean %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms (%s)\n",
+		(unsigned int)n, 1000.0 * n / total, total / n, p50, p95, p99, label);
+}
+
+// Vertex and index bytes of the first count arena meshes, next to what float vertices would take
+void printArenaMeshBytes(const geometryarena &arena, const unsigned int *handles, unsigned int count) {
+	static const char *names[MESH_COUNT] = { "ground", "pole", "sphere", "flag" };
+	const GLsizei float_stride = makeVertexFormat(POSITION_FLOAT, false).stride;
+	printf("Mesh memory (%s, %d bytes per vertex):\n", arena.format.name.c_str(), (int)arena.format.stride);
+	for (unsigned int m = 0; m < count; ++m) {
+		if (handles[m] == ARENA_INVALID_MESH) continue;
+		const arenamesh &mesh = arena.meshes[handles[m]];
+		printf("  %-6s %6u vertices %8u bytes, %6u indexes %8u bytes, float vertices %8u bytes\n", names[m],
+			mesh.vertex_count, mesh.vertex_count * (unsigned int)arena.format.stride, mesh.index_count,
+			mesh.index_count * (unsigned int)sizeof(unsigned int), mesh.vertex_count * (unsigned int)float_stride);
+	}
+}
+
+// Value following a command line option, NULL if the option is not present
+const char *getOption(int argc, char *argv[], const char *name) {
+	for (int i = 1; i + 1 < argc; ++i) {
+		if (strcmp(argv[i], name) == 0) return argv[i + 1];
+	}
+	return NULL;
+}
+
+
+int main( int argc, char *argv[] )
+{
+	std::chrono::steady_clock::time_point startup = std::chrono::steady_clock::now();
+	bool startup_reported = false;
+
+	// Loader benchmark: --bench-obj [file] [iterations]
+	if (argc > 1 && strcmp(argv[1], "--bench-obj") == 0) {
+		return benchmarkOBJ(argc > 2 ? argv[2] : "vertexstore.obj", argc > 3 ? atoi(argv[3]) : 5);
+	}
+
+	// Float parsing against strtof: --test-obj [values]
+	if (argc > 1 && strcmp(argv[1], "--test-obj") == 0) {
+		return testOBJFloat(argc > 2 ? atoi(argv[2]) : 1000000);
+	}
+
+	// Flag wave kernels: --test-flagwave, --bench-flagwave [vertices] [frames]
+	if (argc > 1 && strcmp(argv[1], "--test-flagwave") == 0) {
+		return testFlagWave();
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-flagwave") == 0) {
+		return benchmarkFlagWave(argc > 2 ? (size_t)atol(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100);
+	}
+
+	// Flagpole generation: --bench-meshgen [iterations]
+	if (argc > 1 && strcmp(argv[1], "--bench-meshgen") == 0) {
+		return benchmarkMeshGen(argc > 2 ? atoi(argv[2]) : 100);
+	}
+
+	// Triangles saved by LOD at typical camera distances: --bench-lod [file]
+	if (argc > 1 && strcmp(argv[1], "--bench-lod") == 0) {
+		return benchmarkLOD(argc > 2 ? argv[2] : "vertexstore.obj");
+	}
+
+	// Runtime add and remove in the geometry arena: --test-arena [iterations]
+	if (argc > 1 && strcmp(argv[1], "--test-arena") == 0) {
+		return testGeometryArena(argc > 2 ? atoi(argv[2]) : 2000);
+	}
+
+	// BVH frustum culling against testing every copy: --bench-cull [copies] [frames]
+	if (argc > 1 && strcmp(argv[1], "--bench-cull") == 0) {
+		return benchmarkCulling(argc > 2 ? (unsigned int)atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 200);
+	}
+
+	// Instanced flagpoles without a window: --bench-instances [max] [frames]
+	if (argc > 1 && strcmp(argv[1], "--bench-instances") == 0) {
+		return benchmarkInstances(argc > 2 ? (unsigned int)atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 10);
+	}
+
+	// Draw order of a grid of flagpoles, fixed against sorted by key: --bench-render-queue [count] [frames]
+	if (argc > 1 && strcmp(argv[1], "--bench-render-queue") == 0) {
+		return benchmarkRenderQueue(argc > 2 ? (unsigned int)atoi(argv[2]) : 2000, argc > 3 ? atoi(argv[3]) : 5);
+	}
+
+	// Vertex formats drawn without rasterization: --bench-vertex-formats [vertices] [frames]
+	if (argc > 1 && strcmp(argv[1], "--bench-vertex-formats") == 0) {
+		return benchmarkVertexFormats(argc > 2 ? (unsigned int)atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 20);
+	}
+
+	// Job graphs on 1 to 4 threads: --test-jobs [graphs]
+	if (argc > 1 && strcmp(argv[1], "--test-jobs") == 0) {
+		return testJobSystem(argc > 2 ? atoi(argv[2]) : 2000);
+	}
+
+	// Flag animation split between 1 to n threads: --bench-jobs [vertices] [frames] [threads]
+	if (argc > 1 && strcmp(argv[1], "--bench-jobs") == 0) {
+		return benchmarkFlagWaveThreads(argc > 2 ? (size_t)atol(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100, argc > 4 ? (unsigned int)atoi(argv[4]) : 0);
+	}
+
+	// World transforms of a large scene: --bench-scene [entities] [frames] [threads]
+	if (argc > 1 && strcmp(argv[1], "--bench-scene") == 0) {
+		return benchmarkScene(argc > 2 ? (unsigned int)atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 20, argc > 4 ? (unsigned int)atoi(argv[4]) : 0);
+	}
+
+	// Cloth solver on a flag shaped grid: --bench-cloth [particles] [steps] [threads]
+	if (argc > 1 && strcmp(argv[1], "--bench-cloth") == 0) {
+		return benchmarkCloth(argc > 2 ? (unsigned int)atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 60, argc > 4 ? (unsigned int)atoi(argv[4]) : 0);
+	}
+
+	// Copies of the flag, pole and sphere on a grid: --instances n
+	unsigned int instance_count = 1;
+	const char *instances_option = getOption(argc, argv, "--instances");
+	if (instances_option != NULL && atoi(instances_option) > 0) instance_count = (unsigned int)atoi(instances_option);
+
+	// Draw every copy instead of culling them against the view: --no-cull
+	bool cull_enabled = true;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--no-cull") == 0) cull_enabled = false;
+	}
+
+	// Orbit radius of the camera: --camera-distance d
+	float camera_distance = 4.0f;
+	const char *distance_option = getOption(argc, argv, "--camera-distance");
+	if (distance_option != NULL && atof(distance_option) > 0.0) camera_distance = (float)atof(distance_option);
+
+	// Cost of the pass instrumentation: --bench-profiler [iterations]
+	if (argc > 1 && strcmp(argv[1], "--bench-profiler") == 0) {
+		return benchmarkProfiler(argc > 2 ? atoi(argv[2]) : 100000000);
+	}
+
+	// Cost of a trace zone: --bench-trace [iterations]
+	if (argc > 1 && strcmp(argv[1], "--bench-trace") == 0) {
+		return benchmarkTrace(argc > 2 ? atoi(argv[2]) : 100000000);
+	}
+
+	// Flag animation on the CPU, in the vertex shader or simulated as cloth: --flag-wave cpu|gpu|cloth
+	bool flag_gpu = false;
+	bool flag_cloth = false;
+	const char *wave_option = getOption(argc, argv, "--flag-wave");
+	if (wave_option != NULL) {
+		if (strcmp(wave_option, "gpu") == 0) flag_gpu = true;
+		else if (strcmp(wave_option, "cloth") == 0) flag_cloth = true;
+		else if (strcmp(wave_option, "cpu") != 0) {
+			fprintf(stderr, "Unknown flag wave mode %s\n", wave_option);
+			return -1;
+		}
+	}
+	if (argc > 1 && strcmp(argv[1], "--test-flagwave-gpu") == 0) {
+		return testFlagWaveGPU();
+	}
+
+	// Flag vertex upload for the CPU animation: --flag-upload subdata|orphan|persistent
+	streammode flag_upload = STREAM_PERSISTENT;
+	const char *upload_option = getOption(argc, argv, "--flag-upload");
+	if (upload_option != NULL) {
+		if (strcmp(upload_option, "subdata") == 0) flag_upload = STREAM_SUBDATA;
+		else if (strcmp(upload_option, "orphan") == 0) flag_upload = STREAM_ORPHAN;
+		else if (strcmp(upload_option, "persistent") != 0) {
+			fprintf(stderr, "Unknown flag upload mode %s\n", upload_option);
+			return -1;
+		}
+	}
+
+	// Vertex encoding of the static meshes, with octahedral normals: --vertex-format float|half|snorm16, --vertex-normals
+	positionencoding vertex_encoding = POSITION_FLOAT;
+	bool vertex_normals = false;
+	const char *format_option = getOption(argc, argv, "--vertex-format");
+	if (format_option != NULL && !parsePositionEncoding(format_option, vertex_encoding)) {
+		fprintf(stderr, "Unknown vertex format %s\n", format_option);
+		return -1;
+	}
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--vertex-normals") == 0) vertex_normals = true;
+	}
+	vertexformat vertex_format = makeVertexFormat(vertex_encoding, vertex_normals);
+
+	// Threads for the mesh builds and the flag animation, counting this one: --threads n
+	unsigned int thread_count = 0;
+	const char *threads_option = getOption(argc, argv, "--threads");
+	if (threads_option != NULL && atoi(threads_option) > 0) thread_count = (unsigned int)atoi(threads_option);
+	jobsystem jobs;
+	createJobSystem(jobs, thread_count);
+	printf("Jobs: %u threads\n", jobs.thread_count);
+
+	// Step the flag and the camera in the draw loop instead of at a fixed rate on their own thread: --no-sim-thread
+	bool sim_enabled = true;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--no-sim-thread") == 0) sim_enabled = false;
+	}
+
+	// Send every binding to the driver, still counting the ones the cache would skip: --no-state-cache
+	// Check the cached bindings against glGet before each skipped call and after each frame: --check-state
+	bool state_cache = true;
+	bool state_check = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--no-state-cache") == 0) state_cache = false;
+		if (strcmp(argv[i], "--check-state") == 0) state_check = true;
+	}
+	configureGLStateCache(state_cache, state_check);
+
+	// Render a fixed number of frames into an FBO without a window: --headless [frames]
+	bool headless = false;
+	unsigned int headless_frames = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+			headless_frames = (i + 1 < argc && atoi(argv[i + 1]) > 0) ? (unsigned int)atoi(argv[i + 1]) : 1000;
+		}
+	}
+
+	// Render frames at a fixed step without a window and write them to a Y4M file or a
+	// PPM sequence such as frame%05d.ppm: --record file [frames], --record-fps n
+	const char *record_path = NULL;
+	unsigned int record_fps = 60;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_path = argv[i + 1];
+			headless = true;
+			headless_frames = (i + 2 < argc && atoi(argv[i + 2]) > 0) ? (unsigned int)atoi(argv[i + 2]) : 600;
+		}
+	}
+	const char *fps_option = getOption(argc, argv, "--record-fps");
+	if (fps_option != NULL && atoi(fps_option) > 0) record_fps = (unsigned int)atoi(fps_option);
+	// The simulation thread steps on the wall clock, a recording only on its frames
+	if (record_path != NULL) sim_enabled = false;
+
+	// Time each render pass and write the histograms to a CSV file: --profile [file]
+	const char *profile_csv = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--profile") == 0) {
+			profile_csv = (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) ? argv[i + 1] : "profile.csv";
+		}
+	}
+
+	// Record zones and counters of every thread into a Chrome trace, written on
+	// exit and with F10 while running: --trace [file]
+	const char *trace_json = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--trace") == 0) {
+			trace_json = (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) ? argv[i + 1] : "trace.json";
+		}
+	}
+	if (trace_json != NULL) {
+		enableTracing(true);
+		traceThreadName("main");
+	}
+
+	// Render the first frame only once every asset is resident, not just the ground, pole and sphere: --wait-for-assets
+	bool wait_for_assets = record_path != NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--wait-for-assets") == 0) wait_for_assets = true;
+	}
+
+	// Level and bounds of every mesh the entities refer to
+	lodmesh lods[MESH_COUNT];
+
+	// Ground plane, the pole and its foot, every ring vertex is shared by its neighbours
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indexes;
+	std::vector<glm::vec3> pole_vertices;
+	std::vector<unsigned int> pole_indexes;
+
+	// give the center point of the cylinder
+	centerstruct center;
+	glm::vec3 pole_center(center.x, center.y, center.z);
+
+	//draw a sphere
+	std::vector<glm::vec3> sphere_vertices;
+	std::vector<unsigned int> sphere_indexes;
+	float radius = 0.08f;
+
+	// Read our .obj file to get the vertices and colors for the flag including the indexes of the triangle
+	cachedmesh flag_mesh;
+	bool res = false;
+
+	// Index levels for the flag, every level after the other
+	std::vector<unsigned int> flag_indexes;
+	lodmesh &flag_lod = lods[MESH_FLAG];
+
+	// Animated positions live apart from the static colors
+	flagwave flag_wave;
+	flagwaveentry flag_kernel = selectFlagWaveKernel();
+
+	// The cloth is built from the full detail flag and pinned along the pole. It
+	// can swing anywhere its tethers reach, so that box replaces the flag's bounds.
+	cloth flag_sim;
+	clothparams cloth_params;
+	bool cloth_built = false;
+
+	// Every mesh is built on the job system from a thread of its own, so the
+	// context is created meanwhile. The flag is simplified once it is loaded.
+	static const char *asset_names[MESH_COUNT] = { "ground", "pole", "sphere", "flag" };
+	assetloader assets;
+	createAssetLoader(assets, startup, asset_names, MESH_COUNT);
+	addAssetJob(assets, MESH_GROUND, [&] {
+		// The ground is always drawn in full, the pole in one of its levels
+		reserveMesh(vertices, indexes, planeCounts(1, 2));
+		generatePlane(vertices, indexes, glm::vec3(0.0f, -1.3f, 0.0f), 3.0f, 1.6f, 1, 2, glm::vec3(0.8f, 0.8f, 0.8f));
+		lodlevel ground_level = { 0, (unsigned int)indexes.size(), 0.0f };
+		lods[MESH_GROUND].levels.push_back(ground_level);
+		boundLodMesh(lods[MESH_GROUND], &vertices[0], vertices.size() / 2, 0.0f);
+	});
+	addAssetJob(assets, MESH_POLE, [&] { createPoleLod(lods[MESH_POLE], pole_vertices, pole_indexes, pole_center, &jobs); });
+	// Around its own origin, the entity sets it on top of the pole
+	addAssetJob(assets, MESH_SPHERE, [&] {
+		createSphereLod(lods[MESH_SPHERE], sphere_vertices, sphere_indexes, glm::vec3(center.x, center.y, center.z), radius, &jobs);
+	});
+	unsigned int load_job = addJob(assets.graph, [&] { res = loadOBJCached("vertexstore.obj", flag_mesh, &jobs); });
+	unsigned int flag_job = addAssetJob(assets, MESH_FLAG, [&] {
+		if (!res) return;
+		createFlagLod(flag_lod, flag_indexes, flag_mesh);
+		if (!flag_gpu) initFlagWave(flag_wave, flag_mesh.vertices, flag_mesh.vertex_count);
+		if (flag_cloth) {
+			const lodlevel &full = flag_lod.levels[0];
+			cloth_built = buildCloth(flag_sim, flag_mesh.vertices, flag_mesh.vertex_count, &flag_indexes[full.first_index], full.index_count, cloth_params);
+			if (cloth_built) {
+				clothBounds(flag_sim, flag_lod.low, flag_lod.high);
+				flag_lod.center = (flag_lod.low + flag_lod.high) * 0.5f;
+				flag_lod.radius = glm::length(flag_lod.high - flag_lod.low) * 0.5f;
+			}
+		}
+	});
+	addJobDependency(assets.graph, load_job, flag_job);
+	startAssetLoader(assets, &jobs);
+
+	headlesscontext headless_context;
+	offscreen headless_target;
+	if (headless) {
+		if (!createHeadlessContext(headless_context) || !createOffscreen(headless_target, 1024, 768)) {
+			destroyHeadlessContext(headless_context);
+			return -1;
+		}
+	}
+	else {
+		// Open the window and initialise GLEW
+		window = openWindow(true);
+		if (window == NULL) {
+			getchar();
+			return -1;
+		}
+
+		// Ensure we can capture the escape key being pressed below
+		glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
+	}
+	double context_ms = assetClock(assets);
+
+	// Release the headless target and context or the window when setup fails
+	auto closeContext = [&]() {
+		if (headless) {
+			destroyOffscreen(headless_target);
+			destroyHeadlessContext(headless_context);
+		}
+		else {
+			glfwTerminate();
+		}
+	};
+
+	// Dark blue background
+	glClearColor(0.0f, 0.0f, 0.2f, 0.0f);
+
+	//enable depth test
+	cachedEnable(GL_DEPTH_TEST);
+
+	// Create and compile our GLSL program from the shaders, every static mesh is drawn instanced.
+	// Quantized vertices are read by their own variants, the streamed flag positions stay float.
+	shaderprogram program, static_program;
+	if (!loadShaderProgram(program, "instancevert.glsl", "frag.glsl")) {
+		closeContext();
+		return -1;
+	}
+	if (vertex_format.quantized) {
+		if (!loadShaderProgram(static_program, "quantizedvert.glsl", "frag.glsl")) {
+			closeContext();
+			return -1;
+		}
+	}
+	const shaderprogram &arena_program = vertex_format.quantized ? static_program : program;
+
+	// The vertex shader animation has its own program
+	shaderprogram flag_program;
+	if (flag_gpu) {
+		if (!loadShaderProgram(flag_program, vertex_format.quantized ? "flagquantizedvert.glsl" : "flagvert.glsl", "flagfrag.glsl")) {
+			closeContext();
+			return -1;
+		}
+	}
+
+	
+	// Every static mesh is suballocated from one vertex and one index buffer,
+	// the copies are described by an instance buffer rewritten every frame
+	geometryarena arena;
+	createGeometryArena(arena, 1 << 16, 1 << 18, vertex_format);
+	instancebuffer instance_buffer;
+	createInstanceBuffer(instance_buffer);
+	attachArenaInstances(arena, instance_buffer.buffer);
+
+	// Where every mesh lives in the arena
+	unsigned int arena_meshes[MESH_COUNT] = { 0 };
+
+	// The vertex shader animation draws the flag straight from the arena,
+	// the CPU animation streams positions next to a buffer of static colors
+	GLuint v_flag_object = 0;
+	GLuint vbo3 = 0;
+	GLuint ebo3 = 0;
+	streambuffer flag_stream;
+	bool flag_resident = false;
+
+	// GL side of the flag once it is built, false if it is drawn without one
+	auto uploadFlag = [&]() -> bool {
+		if (res == false) {
+			fprintf(stderr, "Failed to load flag object file, drawing without the flag\n");
+			return false;
+		}
+		printLodMesh("flag", flag_lod);
+		if (flag_cloth && !cloth_built) {
+			fprintf(stderr, "Failed to build the flag cloth, drawing without the flag\n");
+			return false;
+		}
+		if (flag_cloth) {
+			printf("Flag cloth: %u particles, %u constraints in %u colors\n", clothParticleCount(flag_sim),
+				(unsigned int)flag_sim.ca.size(), (unsigned int)flag_sim.color_first.size() - 1);
+		}
+		else if (!flag_gpu) {
+			printf("Flag wave kernel: %s\n", flag_kernel.name);
+		}
+
+		if (flag_gpu) {
+			arena_meshes[MESH_FLAG] = addArenaMesh(arena, flag_mesh.vertices, flag_mesh.vertex_count / 2, &flag_indexes[0], flag_indexes.size());
+			if (arena_meshes[MESH_FLAG] == ARENA_INVALID_MESH) {
+				fprintf(stderr, "Failed to add the flag to the geometry arena, drawing without the flag\n");
+				return false;
+			}
+			printf("Flag wave: vertex shader\n");
+			return true;
+		}
+
+		// Vertex Array Objects
+		glGenVertexArrays(1, &v_flag_object);
+		cachedBindVertexArray(v_flag_object);
+
+		// Vertex Buffer Object (VBO) and Element Buffer Object (EBO)
+		glGenBuffers(1, &vbo3);
+		glGenBuffers(1, &ebo3);
+
+		cachedBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo3);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, flag_indexes.size() * sizeof(unsigned int), &flag_indexes[0], GL_STATIC_DRAW);
+
+		// Only the colors are static, in the color encoding of the vertex format. The base
+		// vertex of a later stream region applies to the colors too, so every region gets a copy.
+		vertexformat color_format = makeColorFormat(vertex_format);
+		std::vector<unsigned char> flag_colors;
+		glm::vec4 color_center, color_extent;
+		packVertices(color_format, flag_mesh.vertices, flag_mesh.vertex_count / 2, NULL, 0, 0, flag_colors, color_center, color_extent);
+		GLsizeiptr flag_size = (GLsizeiptr)flag_colors.size();
+		cachedBindBuffer(GL_ARRAY_BUFFER, vbo3);
+		glBufferData(GL_ARRAY_BUFFER, flag_size * STREAMBUFFER_REGIONS, NULL, GL_STATIC_DRAW);
+		for (unsigned int r = 0; r < STREAMBUFFER_REGIONS; ++r) {
+			glBufferSubData(GL_ARRAY_BUFFER, flag_size * r, flag_size, &flag_colors[0]);
+		}
+		bindVertexFormat(color_format, 0);
+
+		bool streamed = createStreamBuffer(flag_stream, flag_wave.positions.size() * sizeof(glm::vec3), &flag_wave.positions[0], flag_upload);
+		if (streamed) {
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), NULL);
+			printf("Flag upload: %s\n", streamModeName(flag_stream.mode));
+
+			// Every copy shares the one animated flag, only its placement differs
+			setInstanceAttributes(instance_buffer.buffer, 0);
+
+			// Enable Vertex Attribute Arrays
+			glEnableVertexAttribArray(0);
+			glEnableVertexAttribArray(1);
+		}
+
+		cachedBindVertexArray(0);
+		cachedBindBuffer(GL_ARRAY_BUFFER, 0);
+		cachedBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		return streamed;
+	};
+	if (instance_count > 1) printf("Instances: %u\n", instance_count);
 
 	// normally the projection don't change in the main loop, therefore, put it outside the main loop
-	glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, &projection[0][0]);
+	float far_plane = std::max(100.0f, 2.0f * (camera_distance + instanceLayoutExtent(instance_count, INSTANCE_SPACING)));
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, far_plane);
+
+	// Camera and per object uniform buffers, the static meshes share one slot
+	enum { OBJECT_STATIC, OBJECT_FLAG, OBJECT_COUNT };
+	frameuniforms frame;
+	createFrameUniforms(frame, OBJECT_COUNT);
+
+	// Frame time statistics, printed on exit
+	std::vector<double> frame_times;
+	frame_times.reserve(headless ? headless_frames : 4096);
+
+	// Level of detail per copy, chosen every frame from the projected error,
+	// copies at the same level of a mesh are drawn together
+	float lod_scale = lodProjectionScale(glm::radians(45.0f), 768.0f);
+	std::vector<unsigned char> levels;
+	std::vector<lodbatch> batches[MESH_COUNT];
+	std::vector<std::vector<unsigned int> > mesh_visible(MESH_COUNT);
+	std::vector<instancedata> staging;
+	renderqueue render_queue;
+
+	// The ground and, for every copy, a pole carrying its flag and the finial sphere
+	std::vector<instancedata> layout;
+	layoutInstances(layout, instance_count, INSTANCE_SPACING);
+	scene entities;
+	reserveScene(entities, 1 + 3 * layout.size());
+	createEntity(entities, SCENE_NO_PARENT, MESH_GROUND, glm::vec3(0.0f), 0.0f, 1.0f);
+	addFlagpoles(entities, layout);
+	std::vector<unsigned int> remap;
+	sortScene(entities, remap);
+
+	// Nothing moves once placed, so the world transforms and the BVH are computed
+	// once, and again when the flag's bounds arrive
+	updateScene(entities, 0.0);
+	unsigned int entity_count = sceneSize(entities);
+	std::vector<glm::vec3> entity_lows(entity_count), entity_highs(entity_count);
+	bvh entity_bvh;
+	auto boundEntities = [&] {
+		for (unsigned int e = 0; e < entity_count; ++e) {
+			const lodmesh &lod = lods[entities.mesh[e]];
+			instanceBounds(entities.world[e], lod.low, lod.high, entity_lows[e], entity_highs[e]);
+		}
+		buildBvh(entity_bvh, entity_lows, entity_highs);
+	};
+	boundEntities();
+	std::vector<unsigned int> visible;
+	cullstats cull;
+	double cull_ms = 0.0;
+	uint64_t cull_visible = 0, cull_nodes = 0;
+	if (!cull_enabled) {
+		visible.resize(entity_count);
+		for (unsigned int i = 0; i < entity_count; ++i) visible[i] = i;
+	}
 
+	// Upload an asset the loader has built, on this thread since it owns the context
+	auto makeResident = [&](unsigned int asset) {
+		TRACE_ZONE("make resident");
+		if (asset == MESH_FLAG) {
+			flag_resident = uploadFlag();
+			if (flag_resident) boundEntities();
+		}
+		else {
+			const std::vector<glm::vec3> &mesh_vertices = asset == MESH_GROUND ? vertices : asset == MESH_POLE ? pole_vertices : sphere_vertices;
+			const std::vector<unsigned int> &mesh_indexes = asset == MESH_GROUND ? indexes : asset == MESH_POLE ? pole_indexes : sphere_indexes;
+			if (asset != MESH_GROUND) printLodMesh(asset_names[asset], lods[asset]);
+			arena_meshes[asset] = addArenaMesh(arena, mesh_vertices, mesh_indexes);
+		}
+		markAssetResident(assets, asset);
+		if (allAssetsResident(assets)) {
+			printGeometryArena(arena);
+			printArenaMeshBytes(arena, arena_meshes, flag_gpu && flag_resident ? MESH_COUNT : MESH_FLAG);
+		}
+	};
+
+	// The first frame needs the ground, the pole and the sphere, the flags join
+	// the scene in a later frame once theirs is resident
+	unsigned int asset = 0;
+	while (!assetResident(assets, MESH_GROUND) || !assetResident(assets, MESH_POLE) || !assetResident(assets, MESH_SPHERE) ||
+		(wait_for_assets && !allAssetsResident(assets))) {
+		if (!nextAsset(assets, true, asset)) break;
+		makeResident(asset);
+	}
+
+	// Per pass CPU and GPU timings, F9 writes the CSV while running
+	profiler prof;
+	initProfiler(prof, profile_csv != NULL, true);
+	bool dump_key_down = false;
+	bool trace_key_down = false;
+	double last_frame_time = 0.0;
+	double first_frame_ms = 0.0;
+
+	// The simulation thread publishes every step through a triple buffer, the
+	// frames draw whichever step is newest without waiting for the next one. It
+	// starts once the flag is resident, until then the frames step in lock step
+	// and the simulation carries on from their clock.
+	simthread sim;
+	samplering render_latency;
+	bool sim_started = false;
+	double sim_epoch = 0.0;
+	auto startSimulation = [&](double epoch) {
+		sim_epoch = epoch;
+		resetSampleRing(render_latency);
+		startSimThread(sim, flag_gpu || !flag_resident ? std::vector<glm::vec3>() : flag_wave.positions, [&](simsnapshot &s, double time) {
+			s.camera[1] = orbitCamera(float(sim_epoch + time), camera_distance);
+			if (!flag_resident) return;
+			if (flag_cloth) {
+				stepCloth(flag_sim, cloth_params, (float)SIM_TIMESTEP, &jobs);
+				writeClothPositions(flag_sim, &s.positions[1][0], &jobs);
+			}
+			else if (!flag_gpu) {
+				updateFlagWave(flag_wave, flag_kernel.kernel, sim_epoch + time, &s.positions[1][0], &jobs);
+			}
+		});
+		// Only the first frame after the start waits, for the first step
+		while (!acquireTripleBuffer(sim.snapshots)) std::this_thread::yield();
+		sim_started = true;
+	};
+	if (sim_enabled && assetResident(assets, MESH_FLAG)) startSimulation(0.0);
+
+	framerecorder recorder;
+	if (record_path != NULL && !createRecorder(recorder, record_path, headless_target.width, headless_target.height, record_fps)) {
+		closeContext();
+		return -1;
+	}
+	std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
 
 	do{
+		TRACE_ZONE("frame");
+		beginProfilerFrame(prof);
+		beginGLStateFrame();
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-				
 
-		// Use Program
-		glUseProgram(programID);
+		// Make whatever the loader finished since the last frame resident, the
+		// simulation waited for the flag
+		while (nextAsset(assets, false, asset)) makeResident(asset);
+		// Draw calls and vertices sent this frame, for the trace
+		unsigned int frame_draws = 0;
+		size_t frame_vertices = 0;
+		if (sim_enabled && !sim_started && assetResident(assets, MESH_FLAG)) startSimulation(getTime());
+				
 
-		// retrieve the matrix uniform locations
-		GLuint modelLoc = glGetUniformLocation(programID, "u_Model");
-		GLuint viewLoc = glGetUniformLocation(programID, "u_View");
-		
-		// generate the number with time change
-		float t = float(glfwGetTime());
+		// generate the number with time change, from the newest simulation step
+		// blended with the one before it, or from the clock in lock step
+		double now;
+		glm::vec3 camera;
+		const simsnapshot *snapshot = NULL;
+		float blend = 0.0f;
+		if (sim_started) {
+			acquireTripleBuffer(sim.snapshots);
+			snapshot = &tripleBufferFront(sim.snapshots);
+			blend = snapshotBlend(sim, *snapshot);
+			now = sim_epoch + std::max(0.0, snapshot->time - SIM_TIMESTEP * (1.0 - blend));
+			camera = glm::mix(snapshot->camera[0], snapshot->camera[1], blend);
+		}
+		else {
+			now = record_path != NULL ? double(frame_times.size()) / record_fps : getTime();
+			camera = orbitCamera(float(now), camera_distance);
+		}
+		double elapsed = frame_times.empty() ? 0.0 : now - last_frame_time;
+		last_frame_time = now;
 
 		// create transformations
 		glm::mat4 model = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
 		glm::mat4 view = glm::mat4(1.0f);
 
-		// rotate the camera in a circle looking at the vertex (0.0f, 0.0f, 0.0f)
-		float radius = 4.0f;
-		float camX = sin(0.1*t) * radius;
-		float camZ = cos(0.1*t) * radius;
-		view = glm::lookAt(glm::vec3(camX, 1.0f, camZ), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		// the camera circles looking at the vertex (0.0f, 0.0f, 0.0f)
+		view = glm::lookAt(camera, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+		// keep the entities in view, pick each one's level from its distance and upload
+		// them grouped by mesh and level
+		{
+			PROFILE_PASS(prof, PASS_INSTANCES);
+			TRACE_ZONE("update");
+			if (cull_enabled) {
+				cullBvh(entity_bvh, extractFrustum(projection * view), visible, cull);
+				cull_ms += cull.ms;
+				cull_visible += cull.visible;
+				cull_nodes += cull.nodes_visited;
+			}
+
+			groupSceneMeshes(entities, visible, mesh_visible);
+			staging.clear();
+			for (unsigned int m = 0; m < MESH_COUNT; ++m) {
+				if (m == MESH_FLAG && !flag_resident) continue;
+				batchLodInstances(lods[m], entities.world, mesh_visible[m], levels, camera, lod_scale, staging, batches[m]);
+			}
+			uploadInstances(instance_buffer, staging);
+		}
 		
 		//view = glm::translate(view, glm::vec3(0.0f, 0.0f, 3.0f));
 		//view = glm::lookAt(
@@ -910,67 +2409,162 @@ int main( void )
 		//	glm::vec3(0, 1, 0)  // Head is up (set to 0,-1,0 to look upside-down)
 		//);
 				
-		// pass them to the shaders
-		glUniformMatrix4fv(modelLoc, 1, GL_FALSE, &model[0][0]);
-		glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &view[0][0]);
-				
+		// pass them to the shaders, all blocks in two uploads
+		setObject(frame, OBJECT_STATIC, model, 0.0f);
+		setObject(frame, OBJECT_FLAG, model, flagWaveTime(now));
+		uploadFrameUniforms(frame, view, projection);
+
+		//make the z coordinate change to implement simple sine wave animation
+		//a persistently mapped region is written directly, otherwise it is uploaded here
+		if (flag_resident && !flag_gpu) {
+			PROFILE_PASS(prof, PASS_FLAG_UPLOAD);
+			TRACE_ZONE("upload flag");
+			glm::vec3 *flag_positions = (glm::vec3*)mapStreamRegion(flag_stream);
+			if (flag_positions == NULL) flag_positions = &flag_wave.positions[0];
+			if (sim_started) {
+				blendSnapshotPositions(*snapshot, blend, flag_positions);
+			}
+			else if (flag_cloth) {
+				// fixed steps catch up with the frame, the render mesh shows the latest one
+				advanceCloth(flag_sim, cloth_params, elapsed, &jobs);
+				writeClothPositions(flag_sim, flag_positions, &jobs);
+			}
+			else {
+				updateFlagWave(flag_wave, flag_kernel.kernel, now, flag_positions, &jobs);
+			}
 
-		for (n = 0; n < flag_vertices.size(); n=n+2)
-		{
-			//make the z coordinate change to implement simple sine wave animation
-			flag_vertices[n].z = flag_vertices[n].x * 0.5 *(sin(0.8*t + 3* flag_vertices[n].x));
-			
-			//printf("%s%f", "z point value", flag_vertices[n].z);
+			if (flag_stream.mode != STREAM_PERSISTENT) {
+				cachedBindBuffer(GL_ARRAY_BUFFER, flag_stream.buffer);
+				uploadStreamRegion(flag_stream, flag_positions);
+			}
+			frame_vertices += flag_wave.positions.size();
 		}
-		
-		// bind the first vertex array object to draw the triangles
-		glBindVertexArray(vao);
-		glDrawElements(GL_TRIANGLES, indexes.size(), GL_UNSIGNED_INT, NULL);
-
-		glBindVertexArray(0);
 
-		// bind the second vertex array object to draw the triangles
-		glBindVertexArray(v_sphere_oject);
-		glDrawElements(GL_TRIANGLES, sphere_indexes.size() , GL_UNSIGNED_INT, NULL);
+		// Every draw of the frame goes through the queue, sorted by program, vertex
+		// array and distance so state changes least and the nearest copies go first
+		{
+			PROFILE_PASS(prof, PASS_QUEUE);
+			TRACE_ZONE("queue");
+			clearRenderQueue(render_queue);
+			for (unsigned int m = MESH_GROUND; m <= MESH_SPHERE; ++m) {
+				submitArenaLodBatches(render_queue, RENDER_PASS_OPAQUE, arena_program, OBJECT_STATIC, arena, arena_meshes[m], lods[m], batches[m], staging, camera);
+			}
+			if (flag_resident && flag_gpu) {
+				// the vertex shader animates the static vertices in the arena
+				submitArenaLodBatches(render_queue, RENDER_PASS_OPAQUE, flag_program, OBJECT_FLAG, arena, arena_meshes[MESH_FLAG], flag_lod,
+					batches[MESH_FLAG], staging, camera);
+			}
+			else if (flag_resident) {
+				submitVertexArrayLodBatches(render_queue, RENDER_PASS_OPAQUE, program, OBJECT_FLAG, v_flag_object,
+					streamBaseVertex(flag_stream, sizeof(glm::vec3)), instance_buffer.buffer, flag_lod, batches[MESH_FLAG], staging, camera);
+			}
+			sortRenderQueue(render_queue);
+		}
+		{
+			PROFILE_PASS(prof, PASS_DRAW);
+			TRACE_ZONE("draw");
+			frame_draws += executeRenderQueue(render_queue, frame);
+			if (flag_resident && !flag_gpu) fenceStreamRegion(flag_stream);
+		}
 
-		glBindVertexArray(0);
+		// Dump the pass timings on demand
+		if (!headless && prof.enabled) {
+			bool dump_key = glfwGetKey(window, GLFW_KEY_F9) == GLFW_PRESS;
+			if (dump_key && !dump_key_down) writeProfileCSV(prof, profile_csv);
+			dump_key_down = dump_key;
+		}
+		if (!headless && trace_json != NULL) {
+			bool trace_key = glfwGetKey(window, GLFW_KEY_F10) == GLFW_PRESS;
+			if (trace_key && !trace_key_down) writeChromeTrace(trace_json);
+			trace_key_down = trace_key;
+		}
+		TRACE_COUNTER("draw calls", frame_draws);
+		TRACE_COUNTER("vertices uploaded", frame_vertices);
+		TRACE_COUNTER("instances uploaded", staging.size());
+		TRACE_COUNTER("state calls issued", glState().frame_issued);
+		TRACE_COUNTER("state calls elided", glState().frame_elided);
+		if (state_check) checkGLState("end of frame");
 
-		// bind the third vertex array object to draw the triangles
-		glBindVertexArray(v_flag_object);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo3);
-		//glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo3);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, flag_vertices.size() * sizeof(glm::vec3), &flag_vertices[0]);
-		//glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, flag_indexes.size() * sizeof(unsigned int), &flag_indexes[0]);
 		
-		glDrawElements(GL_TRIANGLES, flag_indexes.size(), GL_UNSIGNED_INT, NULL);
+		// Swap buffers, headless frames are timed until the GPU has finished them,
+		// recorded frames only until their readback is queued
+		{
+			TRACE_ZONE("swap");
+			if (record_path != NULL) {
+				captureFrame(recorder);
+			}
+			else if (headless) {
+				glFinish();
+			}
+			else {
+				glfwSwapBuffers(window);
+				glfwPollEvents();
+			}
+		}
 
-		glBindVertexArray(0);
+		// Report how long it took to get the first frame out, once the last asset is in too
+		if (frame_times.empty()) first_frame_ms = assetClock(assets);
+		if (!startup_reported && allAssetsResident(assets)) {
+			printAssetTimes(assets, context_ms, first_frame_ms);
+			printf("Mesh cache: %s\n", flag_mesh.warm ? "warm" : "cold");
+			startup_reported = true;
+		}
 
-		
-		// Swap buffers
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		std::chrono::steady_clock::time_point frame_end = std::chrono::steady_clock::now();
+		if (sim_started) addRingSample(render_latency, 1000.0 * (simClock(sim) - snapshot->published));
+		frame_times.push_back(std::chrono::duration<double, std::milli>(frame_end - frame_start).count());
+		frame_start = frame_end;
 
-	} // Check if the ESC key was pressed or the window was closed
-	while( glfwGetKey(window, GLFW_KEY_ESCAPE ) != GLFW_PRESS &&
+	} // Check if the ESC key was pressed or the window was closed, or all headless frames are done
+	while( headless ? frame_times.size() < headless_frames :
+		   glfwGetKey(window, GLFW_KEY_ESCAPE ) != GLFW_PRESS &&
 		   glfwWindowShouldClose(window) == 0 );
 
+	stopSimThread(sim);
+	joinAssetLoader(assets);
+	if (record_path != NULL) {
+		if (!finishRecorder(recorder)) fprintf(stderr, "Failed to write the recording to %s\n", record_path);
+		printRecorder(recorder);
+	}
+	if (!startup_reported) printAssetTimes(assets, context_ms, first_frame_ms);
+	printFrameTimes(frame_times, !flag_resident ? "no flag" : flag_gpu ? "flag vertex shader" : flag_cloth ? "cloth" : streamModeName(flag_stream.mode));
+	if (sim_started) printSimStats(sim, render_latency);
+	if (cull_enabled && !frame_times.empty()) {
+		double frames = double(frame_times.size());
+		printf("Culling: %.1f of %u entities visible, %.1f of %u nodes visited, %.3f ms per frame\n", cull_visible / frames,
+			entity_count, cull_nodes / frames, (unsigned int)entity_bvh.nodes.size(), cull_ms / frames);
+	}
+	printGLState();
+	if (prof.enabled) {
+		printProfile(prof);
+		writeProfileCSV(prof, profile_csv);
+	}
+	destroyProfiler(prof);
+	if (trace_json != NULL) writeChromeTrace(trace_json);
 
-	// Delete VAO, VBO & EBO
-	glDeleteVertexArrays(1, &vao);
-	glDeleteBuffers(1, &vbo);
-	glDeleteBuffers(1, &ebo);
+	// Delete the arena, VAO, VBO & EBO
+	destroyGeometryArena(arena);
+	destroyInstanceBuffer(instance_buffer);
 
-	glDeleteVertexArrays(1, &v_sphere_oject);
-	glDeleteBuffers(1, &vbo2);
-	glDeleteBuffers(1, &ebo2);
+	cachedDeleteVertexArrays(1, &v_flag_object);
+	cachedDeleteBuffers(1, &vbo3);
+	destroyStreamBuffer(flag_stream);
+	cachedDeleteBuffers(1, &ebo3);
 
-	glDeleteVertexArrays(1, &v_flag_object);
-	glDeleteBuffers(1, &vbo3);
-	glDeleteBuffers(1, &ebo3);
+	releaseMesh(flag_mesh);
+	destroyJobSystem(jobs);
 
 	// Delete Programs
-	glDeleteProgram(programID);
+	destroyFrameUniforms(frame);
+	destroyShaderProgram(program);
+	destroyShaderProgram(static_program);
+	destroyShaderProgram(flag_program);
+
+	if (headless) {
+		destroyOffscreen(headless_target);
+		destroyHeadlessContext(headless_context);
+		return 0;
+	}
 	
 	// Stop receiving events for the window and free resources; this must be
 	// called from the main thread and should not be invoked from a callback
@@ -0,0 +1,119 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+#include "jobs.h"
+#include "trace.h"
+
+// Startup assets built by a job graph on a loader thread while the main
+// thread creates the context and compiles the programs. Every built asset is
+// queued for the main thread, which makes it resident with its GL upload, so
+// the first frame only waits for the assets it cannot do without.
+struct assetloader {
+	jobgraph graph;
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable built;
+	std::deque<unsigned int> completed;
+	unsigned int handed_out = 0;
+	std::chrono::steady_clock::time_point start;
+	// Per asset, milliseconds from start until it was built and until it was resident, -1 before
+	std::vector<const char*> names;
+	std::vector<double> built_ms;
+	std::vector<double> resident_ms;
+	~assetloader();
+};
+
+// Milliseconds since startup began
+inline double assetClock(const assetloader &loader) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loader.start).count();
+}
+
+// Assets are numbered from 0 in the order of names
+inline void createAssetLoader(assetloader &loader, std::chrono::steady_clock::time_point start, const char *const *names, unsigned int count) {
+	loader.start = start;
+	loader.names.assign(names, names + count);
+	loader.built_ms.assign(count, -1.0);
+	loader.resident_ms.assign(count, -1.0);
+	loader.completed.clear();
+	loader.handed_out = 0;
+}
+
+// Job that builds an asset, which is queued for the main thread once build returns
+inline unsigned int addAssetJob(assetloader &loader, unsigned int asset, std::function<void()> build) {
+	return addJob(loader.graph, [&loader, asset, build] {
+		build();
+		std::lock_guard<std::mutex> guard(loader.lock);
+		loader.built_ms[asset] = assetClock(loader);
+		loader.completed.push_back(asset);
+		loader.built.notify_one();
+	});
+}
+
+// Run the graph on its own thread, its jobs share the job system with everything else
+inline void startAssetLoader(assetloader &loader, jobsystem *js) {
+	loader.thread = std::thread([&loader, js] {
+		traceThreadName("asset loader");
+		runJobGraph(js, loader.graph);
+	});
+}
+
+// Next built asset, waiting for one if wait is set. False if none is ready,
+// or once every asset has been handed out.
+inline bool nextAsset(assetloader &loader, bool wait, unsigned int &asset) {
+	std::unique_lock<std::mutex> guard(loader.lock);
+	if (loader.handed_out == loader.names.size()) return false;
+	if (wait) loader.built.wait(guard, [&loader] { return !loader.completed.empty(); });
+	if (loader.completed.empty()) return false;
+	asset = loader.completed.front();
+	loader.completed.pop_front();
+	loader.handed_out++;
+	return true;
+}
+
+// Called on the main thread once the upload of an asset is done
+inline void markAssetResident(assetloader &loader, unsigned int asset) {
+	loader.resident_ms[asset] = assetClock(loader);
+}
+
+inline bool assetResident(const assetloader &loader, unsigned int asset) {
+	return loader.resident_ms[asset] >= 0.0;
+}
+
+inline bool allAssetsResident(const assetloader &loader) {
+	for (size_t a = 0; a < loader.resident_ms.size(); ++a) {
+		if (loader.resident_ms[a] < 0.0) return false;
+	}
+	return true;
+}
+
+inline void joinAssetLoader(assetloader &loader) {
+	if (loader.thread.joinable()) loader.thread.join();
+}
+
+// Jobs write into the caller's variables, so they must finish before those go away
+inline assetloader::~assetloader() {
+	joinAssetLoader(*this);
+}
+
+// When each asset was built and made resident, against the context and the first frame
+inline void printAssetTimes(const assetloader &loader, double context_ms, double first_frame_ms) {
+	double last = 0.0;
+	for (size_t a = 0; a < loader.resident_ms.size(); ++a) last = std::max(last, loader.resident_ms[a]);
+	if (allAssetsResident(loader)) printf("Startup: context %.2f ms, first frame %.2f ms, all assets %.2f ms\n", context_ms, first_frame_ms, last);
+	else printf("Startup: context %.2f ms, first frame %.2f ms, not every asset was resident\n", context_ms, first_frame_ms);
+	for (size_t a = 0; a < loader.names.size(); ++a) {
+		printf("  %-8s built %8.2f ms, resident %8.2f ms\n", loader.names[a], loader.built_ms[a], loader.resident_ms[a]);
+	}
+}
+
+#endif
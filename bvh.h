@@ -0,0 +1,314 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Four children per node so one SSE register tests all of them against a plane
+#define BVH_WIDTH 4
+// Largest number of items a leaf slot holds
+#define BVH_LEAF_SIZE 4
+// Bounds of an empty slot, outside every plane
+#define BVH_EMPTY 1e30f
+
+// Culling planes, ax + by + cz + d >= 0 inside, pointing into the frustum
+struct frustum {
+	glm::vec4 planes[6];
+};
+
+// Planes of a projection * view matrix (Gribb and Hartmann)
+inline frustum extractFrustum(const glm::mat4 &m) {
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; ++i) row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+	frustum f;
+	for (int i = 0; i < 3; ++i) {
+		f.planes[2 * i] = row[3] + row[i];
+		f.planes[2 * i + 1] = row[3] - row[i];
+	}
+	return f;
+}
+
+// False if the box is entirely on the outer side of any plane
+inline bool boxInFrustum(const frustum &f, glm::vec3 low, glm::vec3 high) {
+	for (int p = 0; p < 6; ++p) {
+		const glm::vec4 &n = f.planes[p];
+		float d = std::max(n.x * low.x, n.x * high.x) + std::max(n.y * low.y, n.y * high.y) + std::max(n.z * low.z, n.z * high.z) + n.w;
+		if (d < 0.0f) return false;
+	}
+	return true;
+}
+
+// Child bounds stored per axis so four boxes load as one register each
+struct bvhnode {
+	alignas(16) float min_x[BVH_WIDTH];
+	alignas(16) float min_y[BVH_WIDTH];
+	alignas(16) float min_z[BVH_WIDTH];
+	alignas(16) float max_x[BVH_WIDTH];
+	alignas(16) float max_y[BVH_WIDTH];
+	alignas(16) float max_z[BVH_WIDTH];
+	// A child node when count is 0, otherwise the first of count entries in items, -1 when empty
+	int child[BVH_WIDTH];
+	unsigned int count[BVH_WIDTH];
+	int parent;
+	unsigned int parent_slot;
+};
+
+// Item boxes are kept so a moved item only dirties the leaf that holds it
+struct bvh {
+	std::vector<bvhnode> nodes;
+	std::vector<unsigned int> items;	// item ids in leaf order
+	std::vector<glm::vec3> low;	// per item id
+	std::vector<glm::vec3> high;
+	std::vector<unsigned int> leaf;	// node holding each item id
+	std::vector<char> dirty;	// per node
+	int first_dirty = -1;	// highest dirty node index, -1 when clean
+};
+
+// Work done by the last cull
+struct cullstats {
+	unsigned int nodes_visited = 0;
+	unsigned int visible = 0;
+	unsigned int culled = 0;
+	double ms = 0.0;
+};
+
+inline void setBvhSlot(bvhnode &node, int slot, glm::vec3 low, glm::vec3 high) {
+	node.min_x[slot] = low.x;
+	node.min_y[slot] = low.y;
+	node.min_z[slot] = low.z;
+	node.max_x[slot] = high.x;
+	node.max_y[slot] = high.y;
+	node.max_z[slot] = high.z;
+}
+
+// Union of the occupied slots of a node
+inline void boundBvhNode(const bvhnode &node, glm::vec3 &low, glm::vec3 &high) {
+	low = glm::vec3(BVH_EMPTY);
+	high = glm::vec3(-BVH_EMPTY);
+	for (int s = 0; s < BVH_WIDTH; ++s) {
+		if (node.child[s] < 0) continue;
+		low = glm::min(low, glm::vec3(node.min_x[s], node.min_y[s], node.min_z[s]));
+		high = glm::max(high, glm::vec3(node.max_x[s], node.max_y[s], node.max_z[s]));
+	}
+}
+
+inline void boundBvhItems(const bvh &tree, unsigned int first, unsigned int count, glm::vec3 &low, glm::vec3 &high) {
+	low = glm::vec3(BVH_EMPTY);
+	high = glm::vec3(-BVH_EMPTY);
+	for (unsigned int i = first; i < first + count; ++i) {
+		low = glm::min(low, tree.low[tree.items[i]]);
+		high = glm::max(high, tree.high[tree.items[i]]);
+	}
+}
+
+// Split items[first, first + count) at the median centroid along the longest axis
+inline unsigned int splitBvhItems(bvh &tree, unsigned int first, unsigned int count) {
+	glm::vec3 low(BVH_EMPTY), high(-BVH_EMPTY);
+	for (unsigned int i = first; i < first + count; ++i) {
+		glm::vec3 c = tree.low[tree.items[i]] + tree.high[tree.items[i]];
+		low = glm::min(low, c);
+		high = glm::max(high, c);
+	}
+	glm::vec3 size = high - low;
+	int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+	unsigned int half = count / 2;
+	std::nth_element(tree.items.begin() + first, tree.items.begin() + first + half, tree.items.begin() + first + count,
+		[&](unsigned int a, unsigned int b) { return tree.low[a][axis] + tree.high[a][axis] < tree.low[b][axis] + tree.high[b][axis]; });
+	return half;
+}
+
+// Build the node over items[first, first + count), children are always allocated after their parent
+inline int buildBvhNode(bvh &tree, unsigned int first, unsigned int count, int parent, unsigned int parent_slot) {
+	int index = (int)tree.nodes.size();
+	tree.nodes.push_back(bvhnode());
+	tree.nodes[index].parent = parent;
+	tree.nodes[index].parent_slot = parent_slot;
+
+	// Two median splits give up to four parts
+	unsigned int part_first[BVH_WIDTH], part_count[BVH_WIDTH];
+	unsigned int half = splitBvhItems(tree, first, count);
+	unsigned int quarter = half > 1 ? splitBvhItems(tree, first, half) : half;
+	unsigned int three = count - half > 1 ? splitBvhItems(tree, first + half, count - half) : count - half;
+	part_first[0] = first;
+	part_count[0] = quarter;
+	part_first[1] = first + quarter;
+	part_count[1] = half - quarter;
+	part_first[2] = first + half;
+	part_count[2] = three;
+	part_first[3] = first + half + three;
+	part_count[3] = count - half - three;
+
+	for (int s = 0; s < BVH_WIDTH; ++s) {
+		glm::vec3 low(BVH_EMPTY), high(-BVH_EMPTY);
+		int child = -1;
+		unsigned int leaf_count = 0;
+		if (part_count[s] > BVH_LEAF_SIZE) {
+			child = buildBvhNode(tree, part_first[s], part_count[s], index, s);
+			boundBvhNode(tree.nodes[child], low, high);
+		}
+		else if (part_count[s] > 0) {
+			child = (int)part_first[s];
+			leaf_count = part_count[s];
+			boundBvhItems(tree, part_first[s], part_count[s], low, high);
+			for (unsigned int i = part_first[s]; i < part_first[s] + part_count[s]; ++i) tree.leaf[tree.items[i]] = index;
+		}
+		bvhnode &node = tree.nodes[index];
+		node.child[s] = child;
+		node.count[s] = leaf_count;
+		setBvhSlot(node, s, low, high);
+	}
+	return index;
+}
+
+// Build over count item boxes, item ids are their positions in low and high
+inline void buildBvh(bvh &tree, const std::vector<glm::vec3> &low, const std::vector<glm::vec3> &high) {
+	tree = bvh();
+	tree.low = low;
+	tree.high = high;
+	unsigned int count = (unsigned int)low.size();
+	tree.items.resize(count);
+	tree.leaf.resize(count);
+	for (unsigned int i = 0; i < count; ++i) tree.items[i] = i;
+	tree.nodes.reserve(count / 2 + 1);
+	buildBvhNode(tree, 0, count, -1, 0);
+	tree.dirty.assign(tree.nodes.size(), 0);
+}
+
+// Move an item, its leaf and the nodes above it are refit by the next refitBvh
+inline void updateBvhItem(bvh &tree, unsigned int id, glm::vec3 low, glm::vec3 high) {
+	tree.low[id] = low;
+	tree.high[id] = high;
+	unsigned int node = tree.leaf[id];
+	tree.dirty[node] = 1;
+	tree.first_dirty = std::max(tree.first_dirty, (int)node);
+}
+
+// Recompute the bounds of dirty nodes bottom up, returns the number of nodes touched.
+// Children always come after their parent, so walking down the indexes visits
+// every child before its parent.
+inline unsigned int refitBvh(bvh &tree) {
+	unsigned int refit = 0;
+	for (int index = tree.first_dirty; index >= 0; --index) {
+		if (!tree.dirty[index]) continue;
+		tree.dirty[index] = 0;
+		++refit;
+
+		bvhnode &node = tree.nodes[index];
+		for (int s = 0; s < BVH_WIDTH; ++s) {
+			if (node.count[s] == 0) continue;
+			glm::vec3 low, high;
+			boundBvhItems(tree, (unsigned int)node.child[s], node.count[s], low, high);
+			setBvhSlot(node, s, low, high);
+		}
+		if (node.parent < 0) continue;
+
+		glm::vec3 low, high;
+		boundBvhNode(node, low, high);
+		setBvhSlot(tree.nodes[node.parent], node.parent_slot, low, high);
+		tree.dirty[node.parent] = 1;
+	}
+	tree.first_dirty = -1;
+	return refit;
+}
+
+// Every item under a slot, without testing
+inline void gatherBvh(const bvh &tree, int index, int slot, std::vector<unsigned int> &visible) {
+	const bvhnode &node = tree.nodes[index];
+	if (node.count[slot] > 0) {
+		visible.insert(visible.end(), tree.items.begin() + node.child[slot], tree.items.begin() + node.child[slot] + node.count[slot]);
+		return;
+	}
+	for (int s = 0; s < BVH_WIDTH; ++s) {
+		if (tree.nodes[node.child[slot]].child[s] >= 0) gatherBvh(tree, node.child[slot], s, visible);
+	}
+}
+
+// Test the four slots of a node against every plane, outside and inside get one bit per slot
+inline void testBvhNode(const bvhnode &node, const frustum &f, int &outside, int &inside) {
+#ifdef BVH_SSE
+	__m128 min_x = _mm_load_ps(node.min_x), min_y = _mm_load_ps(node.min_y), min_z = _mm_load_ps(node.min_z);
+	__m128 max_x = _mm_load_ps(node.max_x), max_y = _mm_load_ps(node.max_y), max_z = _mm_load_ps(node.max_z);
+	__m128 out = _mm_setzero_ps(), crossing = _mm_setzero_ps(), zero = _mm_setzero_ps();
+	for (int p = 0; p < 6; ++p) {
+		const glm::vec4 &n = f.planes[p];
+		__m128 nx = _mm_set1_ps(n.x), ny = _mm_set1_ps(n.y), nz = _mm_set1_ps(n.z), nw = _mm_set1_ps(n.w);
+		__m128 ax = _mm_mul_ps(nx, min_x), bx = _mm_mul_ps(nx, max_x);
+		__m128 ay = _mm_mul_ps(ny, min_y), by = _mm_mul_ps(ny, max_y);
+		__m128 az = _mm_mul_ps(nz, min_z), bz = _mm_mul_ps(nz, max_z);
+		// Farthest and nearest corner along the plane normal
+		__m128 far_d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_max_ps(ax, bx), _mm_max_ps(ay, by)), _mm_max_ps(az, bz)), nw);
+		__m128 near_d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_min_ps(ax, bx), _mm_min_ps(ay, by)), _mm_min_ps(az, bz)), nw);
+		out = _mm_or_ps(out, _mm_cmplt_ps(far_d, zero));
+		crossing = _mm_or_ps(crossing, _mm_cmplt_ps(near_d, zero));
+	}
+	outside = _mm_movemask_ps(out);
+	inside = ~_mm_movemask_ps(crossing) & 0xf;
+#else
+	outside = 0;
+	inside = 0;
+	for (int s = 0; s < BVH_WIDTH; ++s) {
+		bool out = false, crossing = false;
+		for (int p = 0; p < 6; ++p) {
+			const glm::vec4 &n = f.planes[p];
+			float ax = n.x * node.min_x[s], bx = n.x * node.max_x[s];
+			float ay = n.y * node.min_y[s], by = n.y * node.max_y[s];
+			float az = n.z * node.min_z[s], bz = n.z * node.max_z[s];
+			if (std::max(ax, bx) + std::max(ay, by) + std::max(az, bz) + n.w < 0.0f) out = true;
+			if (std::min(ax, bx) + std::min(ay, by) + std::min(az, bz) + n.w < 0.0f) crossing = true;
+		}
+		if (out) outside |= 1 << s;
+		if (!crossing) inside |= 1 << s;
+	}
+#endif
+}
+
+// Ids of the items whose boxes touch the frustum, in no particular order
+inline void cullBvh(const bvh &tree, const frustum &f, std::vector<unsigned int> &visible, cullstats &stats) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	visible.clear();
+	stats.nodes_visited = 0;
+
+	int stack[64];
+	int top = 0;
+	if (!tree.nodes.empty()) stack[top++] = 0;
+	while (top > 0) {
+		int index = stack[--top];
+		const bvhnode &node = tree.nodes[index];
+		++stats.nodes_visited;
+
+		int outside, inside;
+		testBvhNode(node, f, outside, inside);
+		for (int s = 0; s < BVH_WIDTH; ++s) {
+			if (node.child[s] < 0 || (outside & (1 << s))) continue;
+			if (inside & (1 << s)) {
+				gatherBvh(tree, index, s, visible);
+			}
+			else if (node.count[s] > 0) {
+				// A leaf crossing a plane, test its items one by one
+				for (unsigned int i = node.child[s]; i < node.child[s] + node.count[s]; ++i) {
+					unsigned int id = tree.items[i];
+					if (boxInFrustum(f, tree.low[id], tree.high[id])) visible.push_back(id);
+				}
+			}
+			else {
+				stack[top++] = node.child[s];
+			}
+		}
+	}
+
+	stats.visible = (unsigned int)visible.size();
+	stats.culled = (unsigned int)tree.low.size() - stats.visible;
+	stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif
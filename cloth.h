@@ -0,0 +1,567 @@
+#ifndef CLOTH_H
+#define CLOTH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "jobs.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLOTH_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Fixed simulation step and the most steps one frame catches up on
+#define CLOTH_TIMESTEP (1.0f / 60.0f)
+#define CLOTH_MAX_STEPS 4
+// Constraint colors, one bit each in the masks of a particle
+#define CLOTH_MAX_COLORS 128
+// Tethers per particle: the nearest pinned particle and both ends of the pinned edge
+#define CLOTH_TETHERS 3
+// Most an edge may stretch over its rest length in --bench-cloth, as a fraction.
+// This is a regression ceiling, not a quality target: the solver measures 23% at
+// 100k particles after 120 steps and 6% at 20k. Finer grids stretch more because
+// the edges only converge with more substeps, which the frame budget does not allow.
+#define CLOTH_STRETCH_LIMIT 0.25f
+// Fewest particles, triangles or constraints in one job
+#define CLOTH_MIN_RANGE 2048
+
+struct clothparams {
+	glm::vec3 gravity = glm::vec3(0.0f, -9.81f, 0.0f);
+	// Air speed, the force follows the normal and the speed of the cloth across the wind
+	glm::vec3 wind = glm::vec3(6.0f, 0.0f, 1.5f);
+	float drag = 8.0f;
+	// Pull of the air along the cloth, against the push across it
+	float friction = 0.3f;
+	// How much the wind varies along the cloth and over time, 0 for a steady wind
+	float gust = 0.5f;
+	// Share of the velocity lost every step
+	float damping = 0.01f;
+	float stretch_stiffness = 1.0f;
+	float bend_stiffness = 0.2f;
+	// Short substeps converge much better than more iterations on one long step.
+	// The edges of a 100k particle flag need them all to stay within CLOTH_STRETCH_LIMIT,
+	// bending is only solved on every bend_interval-th substep.
+	int substeps = 32;
+	int iterations = 1;
+	int bend_interval = 4;
+};
+
+// Position based dynamics cloth. Particles are arrays per coordinate, the
+// previous position holds the velocity. Distance constraints are sorted by
+// color: no two constraints of one color move the same particle, so a color
+// is solved four at a time in SSE and split between threads without locks.
+struct cloth {
+	std::vector<float> x, y, z;
+	std::vector<float> px, py, pz;
+	// 0 for the particles pinned to the pole
+	std::vector<float> inv_mass;
+	// CLOTH_TETHERS pinned particles per particle, the nearest first, and the rest
+	// distances to them, never exceeded. The ends keep the cloth from sagging
+	// about the pole however soft the edges get on a fine mesh.
+	std::vector<unsigned int> tether;
+	std::vector<float> tether_length;
+
+	// Distance constraints, color c is first..first of c + 1. The edges are in
+	// the first stretch_colors colors, the bending pairs in the rest.
+	std::vector<unsigned int> ca, cb;
+	std::vector<float> rest, stiffness;
+	std::vector<unsigned int> color_first;
+	unsigned int stretch_count = 0;
+	unsigned int stretch_colors = 0;
+
+	// Triangles, the wind on each and the triangles around every particle
+	std::vector<unsigned int> triangles;
+	std::vector<glm::vec3> triangle_force;
+	std::vector<float> triangle_weight;
+	std::vector<unsigned int> particle_triangles_first;
+	std::vector<unsigned int> particle_triangles;
+
+	// Particle shown by every vertex of the render mesh
+	std::vector<unsigned int> vertex_particle;
+
+	double time = 0.0;
+	double accumulator = 0.0;
+	uint64_t steps = 0;
+	bool simd = true;
+};
+
+inline unsigned int clothParticleCount(const cloth &c) {
+	return (unsigned int)c.x.size();
+}
+
+inline glm::vec3 clothParticle(const cloth &c, unsigned int p) {
+	return glm::vec3(c.x[p], c.y[p], c.z[p]);
+}
+
+// Build the particles and constraints from a mesh of interleaved position/color
+// vertices. Vertices at the same position become one particle, the column at the
+// smallest x is pinned. Edges hold the cloth together, the far corners of two
+// triangles sharing an edge keep it from folding.
+inline bool buildCloth(cloth &c, const glm::vec3 *vertices, size_t vertex_count, const unsigned int *indexes, size_t index_count,
+	const clothparams &params) {
+	c = cloth();
+	size_t count = vertex_count / 2;
+	if (count == 0 || index_count < 3) return false;
+
+	// Weld by position, a particle keeps the place of its first vertex
+	std::vector<unsigned int> order(count);
+	for (size_t v = 0; v < count; ++v) order[v] = (unsigned int)v;
+	auto position = [vertices](unsigned int v) { return vertices[2 * v]; };
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		glm::vec3 pa = position(a), pb = position(b);
+		if (pa.x != pb.x) return pa.x < pb.x;
+		if (pa.y != pb.y) return pa.y < pb.y;
+		if (pa.z != pb.z) return pa.z < pb.z;
+		return a < b;
+	});
+	std::vector<unsigned int> first_vertex(count);
+	for (size_t i = 0; i < count; ++i) {
+		bool same = i > 0 && position(order[i]) == position(order[i - 1]);
+		first_vertex[order[i]] = same ? first_vertex[order[i - 1]] : order[i];
+	}
+	c.vertex_particle.resize(count);
+	for (size_t v = 0; v < count; ++v) {
+		if (first_vertex[v] != v) {
+			c.vertex_particle[v] = c.vertex_particle[first_vertex[v]];
+			continue;
+		}
+		c.vertex_particle[v] = (unsigned int)c.x.size();
+		c.x.push_back(vertices[2 * v].x);
+		c.y.push_back(vertices[2 * v].y);
+		c.z.push_back(vertices[2 * v].z);
+	}
+	unsigned int particles = clothParticleCount(c);
+	c.px = c.x;
+	c.py = c.y;
+	c.pz = c.z;
+
+	// Pin the edge along the pole
+	float min_x = *std::min_element(c.x.begin(), c.x.end());
+	float max_x = *std::max_element(c.x.begin(), c.x.end());
+	float pin_x = min_x + (max_x - min_x) * 1e-4f;
+	std::vector<unsigned int> pinned;
+	c.inv_mass.resize(particles);
+	for (unsigned int p = 0; p < particles; ++p) {
+		c.inv_mass[p] = c.x[p] <= pin_x ? 0.0f : 1.0f;
+		if (c.inv_mass[p] == 0.0f) pinned.push_back(p);
+	}
+	// Ends of the pinned edge, the pinned particle farthest from another and the one farthest from that
+	auto farthest = [&](unsigned int from) {
+		unsigned int far = from;
+		for (size_t k = 0; k < pinned.size(); ++k) {
+			if (glm::distance(clothParticle(c, from), clothParticle(c, pinned[k])) > glm::distance(clothParticle(c, from), clothParticle(c, far))) far = pinned[k];
+		}
+		return far;
+	};
+	unsigned int end_a = pinned.empty() ? 0 : farthest(pinned[0]);
+	unsigned int end_b = pinned.empty() ? 0 : farthest(end_a);
+	c.tether.resize(CLOTH_TETHERS * particles);
+	c.tether_length.resize(CLOTH_TETHERS * particles);
+	for (unsigned int p = 0; p < particles; ++p) {
+		float best = 1e30f;
+		unsigned int anchor = p;
+		for (size_t k = 0; k < pinned.size(); ++k) {
+			float d = glm::distance(clothParticle(c, p), clothParticle(c, pinned[k]));
+			if (d < best) {
+				best = d;
+				anchor = pinned[k];
+			}
+		}
+		unsigned int anchors[CLOTH_TETHERS] = { anchor, end_a, end_b };
+		for (int k = 0; k < CLOTH_TETHERS; ++k) {
+			c.tether[CLOTH_TETHERS * p + k] = pinned.empty() ? p : anchors[k];
+			c.tether_length[CLOTH_TETHERS * p + k] = pinned.empty() ? 0.0f : glm::distance(clothParticle(c, p), clothParticle(c, anchors[k]));
+		}
+	}
+
+	// Triangles between distinct particles
+	for (size_t i = 0; i + 2 < index_count; i += 3) {
+		unsigned int a = c.vertex_particle[indexes[i]], b = c.vertex_particle[indexes[i + 1]], d = c.vertex_particle[indexes[i + 2]];
+		if (a == b || b == d || a == d) continue;
+		c.triangles.push_back(a);
+		c.triangles.push_back(b);
+		c.triangles.push_back(d);
+	}
+	size_t triangle_count = c.triangles.size() / 3;
+	c.triangle_force.resize(triangle_count);
+	c.triangle_weight.resize(triangle_count);
+
+	c.particle_triangles_first.assign(particles + 1, 0);
+	for (size_t i = 0; i < c.triangles.size(); ++i) c.particle_triangles_first[c.triangles[i] + 1]++;
+	for (unsigned int p = 0; p < particles; ++p) c.particle_triangles_first[p + 1] += c.particle_triangles_first[p];
+	c.particle_triangles.resize(c.triangles.size());
+	std::vector<unsigned int> fill(c.particle_triangles_first.begin(), c.particle_triangles_first.end() - 1);
+	for (size_t i = 0; i < c.triangles.size(); ++i) c.particle_triangles[fill[c.triangles[i]]++] = (unsigned int)(i / 3);
+
+	// Every edge with the corner opposite to it
+	struct edge {
+		unsigned int a, b, opposite;
+	};
+	std::vector<edge> edges;
+	edges.reserve(c.triangles.size());
+	for (size_t t = 0; t < triangle_count; ++t) {
+		const unsigned int *v = &c.triangles[3 * t];
+		for (int k = 0; k < 3; ++k) {
+			edge e = { std::min(v[k], v[(k + 1) % 3]), std::max(v[k], v[(k + 1) % 3]), v[(k + 2) % 3] };
+			edges.push_back(e);
+		}
+	}
+	std::sort(edges.begin(), edges.end(), [](const edge &l, const edge &r) {
+		return l.a != r.a ? l.a < r.a : l.b != r.b ? l.b < r.b : l.opposite < r.opposite;
+	});
+	std::vector<std::pair<unsigned int, unsigned int> > stretch, bend;
+	for (size_t i = 0; i < edges.size(); ++i) {
+		bool first = i == 0 || edges[i].a != edges[i - 1].a || edges[i].b != edges[i - 1].b;
+		if (first) {
+			stretch.push_back(std::make_pair(edges[i].a, edges[i].b));
+		}
+		else if (edges[i].opposite != edges[i - 1].opposite) {
+			bend.push_back(std::make_pair(std::min(edges[i].opposite, edges[i - 1].opposite), std::max(edges[i].opposite, edges[i - 1].opposite)));
+		}
+	}
+	std::sort(bend.begin(), bend.end());
+	bend.erase(std::unique(bend.begin(), bend.end()), bend.end());
+	c.stretch_count = (unsigned int)stretch.size();
+
+	// Greedy coloring, a constraint takes the first color neither of its particles has yet.
+	// The edges are colored first and the bending pairs after them in colors of their own,
+	// so a substep can solve the edges alone.
+	std::vector<std::pair<unsigned int, unsigned int> > pairs(stretch);
+	pairs.insert(pairs.end(), bend.begin(), bend.end());
+	const unsigned int words = CLOTH_MAX_COLORS / 64;
+	std::vector<uint64_t> used(particles * words, 0);
+	std::vector<unsigned int> colors(pairs.size());
+	unsigned int color_count = 0;
+	for (size_t i = 0; i < pairs.size(); ++i) {
+		if (i == stretch.size()) {
+			std::fill(used.begin(), used.end(), 0);
+			c.stretch_colors = color_count;
+		}
+		const uint64_t *ua = &used[pairs[i].first * words];
+		const uint64_t *ub = &used[pairs[i].second * words];
+		unsigned int color = CLOTH_MAX_COLORS;
+		for (unsigned int w = 0; w < words && color == CLOTH_MAX_COLORS; ++w) {
+			uint64_t free_bits = ~(ua[w] | ub[w]);
+			if (free_bits == 0) continue;
+			unsigned int bit = 0;
+			while (((free_bits >> bit) & 1) == 0) ++bit;
+			color = w * 64 + bit;
+		}
+		if (i >= stretch.size()) color += c.stretch_colors;
+		if (color >= CLOTH_MAX_COLORS) {
+			fprintf(stderr, "Cloth needs more than %d constraint colors\n", CLOTH_MAX_COLORS);
+			return false;
+		}
+		unsigned int bit = i >= stretch.size() ? color - c.stretch_colors : color;
+		used[pairs[i].first * words + bit / 64] |= 1ull << (bit % 64);
+		used[pairs[i].second * words + bit / 64] |= 1ull << (bit % 64);
+		colors[i] = color;
+		color_count = std::max(color_count, color + 1);
+	}
+	if (bend.empty()) c.stretch_colors = color_count;
+
+	// Counting sort by color, in each color the constraints stay in particle order
+	c.color_first.assign(color_count + 1, 0);
+	for (size_t i = 0; i < pairs.size(); ++i) c.color_first[colors[i] + 1]++;
+	for (unsigned int k = 0; k < color_count; ++k) c.color_first[k + 1] += c.color_first[k];
+	std::vector<unsigned int> next(c.color_first.begin(), c.color_first.end() - 1);
+	c.ca.resize(pairs.size());
+	c.cb.resize(pairs.size());
+	c.rest.resize(pairs.size());
+	c.stiffness.resize(pairs.size());
+	for (size_t i = 0; i < pairs.size(); ++i) {
+		unsigned int slot = next[colors[i]]++;
+		c.ca[slot] = pairs[i].first;
+		c.cb[slot] = pairs[i].second;
+		c.rest[slot] = glm::distance(clothParticle(c, pairs[i].first), clothParticle(c, pairs[i].second));
+		c.stiffness[slot] = i < stretch.size() ? params.stretch_stiffness : params.bend_stiffness;
+	}
+	return true;
+}
+
+// Wind on triangles first..last, weighted by their area: pressure along the normal
+// from the air speed across the triangle, and friction from the air speed along it.
+inline void clothWindRange(cloth &c, const clothparams &params, size_t first, size_t last, float dt) {
+	float gust_time = (float)fmod(c.time, 1000.0);
+	for (size_t t = first; t < last; ++t) {
+		unsigned int a = c.triangles[3 * t], b = c.triangles[3 * t + 1], d = c.triangles[3 * t + 2];
+		glm::vec3 pa = clothParticle(c, a), pb = clothParticle(c, b), pd = clothParticle(c, d);
+		glm::vec3 n = glm::cross(pb - pa, pd - pa);
+		float area = glm::length(n);
+		if (area <= 0.0f) {
+			c.triangle_force[t] = glm::vec3(0.0f);
+			c.triangle_weight[t] = 0.0f;
+			continue;
+		}
+		glm::vec3 previous = glm::vec3(c.px[a] + c.px[b] + c.px[d], c.py[a] + c.py[b] + c.py[d], c.pz[a] + c.pz[b] + c.pz[d]);
+		glm::vec3 velocity = (pa + pb + pd - previous) / (3.0f * dt);
+		float center_x = (pa.x + pb.x + pd.x) / 3.0f;
+		float gust = 1.0f + params.gust * sinf(1.7f * gust_time + 9.0f * center_x) * sinf(0.6f * gust_time);
+		glm::vec3 air = params.wind * gust - velocity;
+		glm::vec3 across = n * (glm::dot(n, air) / (area * area));
+		c.triangle_force[t] = (across + params.friction * (air - across)) * area;
+		c.triangle_weight[t] = area;
+	}
+}
+
+// Verlet step of particles first..last under gravity and the wind on the triangles around them
+inline void clothPredictRange(cloth &c, const clothparams &params, size_t first, size_t last, float dt) {
+	float keep = 1.0f - params.damping;
+	for (size_t p = first; p < last; ++p) {
+		if (c.inv_mass[p] == 0.0f) continue;
+		glm::vec3 force(0.0f);
+		float weight = 0.0f;
+		for (unsigned int k = c.particle_triangles_first[p]; k < c.particle_triangles_first[p + 1]; ++k) {
+			unsigned int t = c.particle_triangles[k];
+			force += c.triangle_force[t];
+			weight += c.triangle_weight[t];
+		}
+		glm::vec3 acceleration = params.gravity;
+		if (weight > 0.0f) acceleration += force * (params.drag / weight);
+
+		float vx = (c.x[p] - c.px[p]) * keep, vy = (c.y[p] - c.py[p]) * keep, vz = (c.z[p] - c.pz[p]) * keep;
+		c.px[p] = c.x[p];
+		c.py[p] = c.y[p];
+		c.pz[p] = c.z[p];
+		c.x[p] += vx + acceleration.x * dt * dt;
+		c.y[p] += vy + acceleration.y * dt * dt;
+		c.z[p] += vz + acceleration.z * dt * dt;
+	}
+}
+
+inline void solveClothConstraint(cloth &c, size_t i) {
+	unsigned int a = c.ca[i], b = c.cb[i];
+	float wa = c.inv_mass[a], wb = c.inv_mass[b];
+	float dx = c.x[b] - c.x[a], dy = c.y[b] - c.y[a], dz = c.z[b] - c.z[a];
+	float len = sqrtf(dx * dx + dy * dy + dz * dz);
+	float denom = (wa + wb) * len;
+	if (denom <= 1e-12f) return;
+	float s = (len - c.rest[i]) * c.stiffness[i] / denom;
+	c.x[a] += wa * s * dx;
+	c.y[a] += wa * s * dy;
+	c.z[a] += wa * s * dz;
+	c.x[b] -= wb * s * dx;
+	c.y[b] -= wb * s * dy;
+	c.z[b] -= wb * s * dz;
+}
+
+// Constraints first..last of one color, four at a time. The particles are gathered
+// into registers and scattered back, no two lanes touch the same particle.
+inline void solveClothRange(cloth &c, size_t first, size_t last) {
+	size_t i = first;
+#ifdef CLOTH_SSE
+	if (c.simd) {
+		float *X = &c.x[0], *Y = &c.y[0], *Z = &c.z[0];
+		const float *W = &c.inv_mass[0];
+		const __m128 tiny = _mm_set1_ps(1e-12f);
+		alignas(16) float out[6][4];
+		for (; i + 4 <= last; i += 4) {
+			const unsigned int *a = &c.ca[i], *b = &c.cb[i];
+			__m128 ax = _mm_set_ps(X[a[3]], X[a[2]], X[a[1]], X[a[0]]);
+			__m128 ay = _mm_set_ps(Y[a[3]], Y[a[2]], Y[a[1]], Y[a[0]]);
+			__m128 az = _mm_set_ps(Z[a[3]], Z[a[2]], Z[a[1]], Z[a[0]]);
+			__m128 bx = _mm_set_ps(X[b[3]], X[b[2]], X[b[1]], X[b[0]]);
+			__m128 by = _mm_set_ps(Y[b[3]], Y[b[2]], Y[b[1]], Y[b[0]]);
+			__m128 bz = _mm_set_ps(Z[b[3]], Z[b[2]], Z[b[1]], Z[b[0]]);
+			__m128 wa = _mm_set_ps(W[a[3]], W[a[2]], W[a[1]], W[a[0]]);
+			__m128 wb = _mm_set_ps(W[b[3]], W[b[2]], W[b[1]], W[b[0]]);
+
+			__m128 dx = _mm_sub_ps(bx, ax), dy = _mm_sub_ps(by, ay), dz = _mm_sub_ps(bz, az);
+			__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+			__m128 denom = _mm_mul_ps(_mm_add_ps(wa, wb), len);
+			__m128 valid = _mm_cmpgt_ps(denom, tiny);
+			__m128 s = _mm_div_ps(_mm_mul_ps(_mm_sub_ps(len, _mm_loadu_ps(&c.rest[i])), _mm_loadu_ps(&c.stiffness[i])), _mm_max_ps(denom, tiny));
+			s = _mm_and_ps(valid, s);
+			__m128 sa = _mm_mul_ps(wa, s), sb = _mm_mul_ps(wb, s);
+
+			_mm_store_ps(out[0], _mm_add_ps(ax, _mm_mul_ps(sa, dx)));
+			_mm_store_ps(out[1], _mm_add_ps(ay, _mm_mul_ps(sa, dy)));
+			_mm_store_ps(out[2], _mm_add_ps(az, _mm_mul_ps(sa, dz)));
+			_mm_store_ps(out[3], _mm_sub_ps(bx, _mm_mul_ps(sb, dx)));
+			_mm_store_ps(out[4], _mm_sub_ps(by, _mm_mul_ps(sb, dy)));
+			_mm_store_ps(out[5], _mm_sub_ps(bz, _mm_mul_ps(sb, dz)));
+			for (int k = 0; k < 4; ++k) {
+				X[a[k]] = out[0][k];
+				Y[a[k]] = out[1][k];
+				Z[a[k]] = out[2][k];
+				X[b[k]] = out[3][k];
+				Y[b[k]] = out[4][k];
+				Z[b[k]] = out[5][k];
+			}
+		}
+	}
+#endif
+	for (; i < last; ++i) solveClothConstraint(c, i);
+}
+
+// Pull particles first..last back within reach of their pinned particles
+inline void clothTetherRange(cloth &c, size_t first, size_t last) {
+	for (size_t p = first; p < last; ++p) {
+		if (c.inv_mass[p] == 0.0f) continue;
+		for (size_t k = CLOTH_TETHERS * p; k < CLOTH_TETHERS * (p + 1); ++k) {
+			unsigned int anchor = c.tether[k];
+			float dx = c.x[p] - c.x[anchor], dy = c.y[p] - c.y[anchor], dz = c.z[p] - c.z[anchor];
+			float len = sqrtf(dx * dx + dy * dy + dz * dz);
+			if (len <= c.tether_length[k]) continue;
+			float s = c.tether_length[k] / len;
+			c.x[p] = c.x[anchor] + dx * s;
+			c.y[p] = c.y[anchor] + dy * s;
+			c.z[p] = c.z[anchor] + dz * s;
+		}
+	}
+}
+
+// One step of dt seconds: the wind, then per substep a prediction and the constraints
+// color by color. Every phase is split between the threads of jobs, the result does not depend on how.
+inline void stepCloth(cloth &c, const clothparams &params, float dt, jobsystem *jobs = NULL) {
+	size_t particles = clothParticleCount(c);
+	float h = dt / float(std::max(1, params.substeps));
+	parallelFor(jobs, 0, c.triangle_weight.size(), CLOTH_MIN_RANGE, [&](size_t first, size_t last) {
+		clothWindRange(c, params, first, last, h);
+	});
+	int bend_interval = std::max(1, params.bend_interval);
+	for (int sub = 0; sub < std::max(1, params.substeps); ++sub) {
+		parallelFor(jobs, 0, particles, CLOTH_MIN_RANGE, [&](size_t first, size_t last) {
+			clothPredictRange(c, params, first, last, h);
+		});
+		size_t colors = sub % bend_interval == bend_interval - 1 ? c.color_first.size() - 1 : c.stretch_colors;
+		for (int it = 0; it < params.iterations; ++it) {
+			for (size_t k = 0; k < colors; ++k) {
+				parallelFor(jobs, c.color_first[k], c.color_first[k + 1], CLOTH_MIN_RANGE, [&c](size_t first, size_t last) {
+					solveClothRange(c, first, last);
+				});
+			}
+		}
+		parallelFor(jobs, 0, particles, CLOTH_MIN_RANGE, [&c](size_t first, size_t last) {
+			clothTetherRange(c, first, last);
+		});
+	}
+	c.time += dt;
+	c.steps++;
+}
+
+// Run as many fixed steps as fit in elapsed seconds plus what was left over, at
+// most CLOTH_MAX_STEPS so a slow frame does not make the next one slower. Returns the steps run.
+inline int advanceCloth(cloth &c, const clothparams &params, double elapsed, jobsystem *jobs = NULL) {
+	c.accumulator = std::min(c.accumulator + std::max(elapsed, 0.0), double(CLOTH_MAX_STEPS * CLOTH_TIMESTEP));
+	int steps = 0;
+	while (c.accumulator >= CLOTH_TIMESTEP) {
+		stepCloth(c, params, CLOTH_TIMESTEP, jobs);
+		c.accumulator -= CLOTH_TIMESTEP;
+		++steps;
+	}
+	return steps;
+}
+
+// Particle positions into the vertices of the render mesh
+inline void writeClothPositions(const cloth &c, glm::vec3 *positions, jobsystem *jobs = NULL) {
+	parallelFor(jobs, 0, c.vertex_particle.size(), CLOTH_MIN_RANGE * 4, [&c, positions](size_t first, size_t last) {
+		for (size_t v = first; v < last; ++v) positions[v] = clothParticle(c, c.vertex_particle[v]);
+	});
+}
+
+// Box the cloth never leaves: the pinned particles grown by the longest reach to the nearest one
+inline void clothBounds(const cloth &c, glm::vec3 &low, glm::vec3 &high) {
+	low = glm::vec3(1e30f);
+	high = glm::vec3(-1e30f);
+	float reach = 0.0f;
+	for (unsigned int p = 0; p < clothParticleCount(c); ++p) {
+		reach = std::max(reach, c.tether_length[CLOTH_TETHERS * p]);
+		if (c.inv_mass[p] != 0.0f) continue;
+		low = glm::min(low, clothParticle(c, p));
+		high = glm::max(high, clothParticle(c, p));
+	}
+	low -= glm::vec3(reach);
+	high += glm::vec3(reach);
+}
+
+// Largest stretch of an edge over its rest length, as a fraction
+inline float clothStretch(const cloth &c) {
+	float worst = 0.0f;
+	for (size_t i = 0; i < c.color_first[c.stretch_colors]; ++i) {
+		float len = glm::distance(clothParticle(c, c.ca[i]), clothParticle(c, c.cb[i]));
+		worst = std::max(worst, len / c.rest[i] - 1.0f);
+	}
+	return worst;
+}
+
+// A flag shaped grid of about count particles, stepped on one thread without and
+// with SSE and on threads threads, against the 60 Hz budget
+inline int benchmarkCloth(unsigned int count, int steps, unsigned int threads) {
+	typedef std::chrono::steady_clock clock;
+	unsigned int rows = std::max(2u, (unsigned int)sqrt(count / 2.0));
+	unsigned int columns = std::max(2u, count / rows);
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> indexes;
+	vertices.reserve(2 * rows * columns);
+	for (unsigned int r = 0; r < rows; ++r) {
+		for (unsigned int k = 0; k < columns; ++k) {
+			vertices.push_back(glm::vec3(0.8f * k / (columns - 1), -0.3f + 0.3f * r / (rows - 1), 0.0f));
+			vertices.push_back(glm::vec3(1.0f));
+		}
+	}
+	for (unsigned int r = 0; r + 1 < rows; ++r) {
+		for (unsigned int k = 0; k + 1 < columns; ++k) {
+			unsigned int v = r * columns + k;
+			unsigned int quad[6] = { v, v + 1, v + columns, v + 1, v + columns + 1, v + columns };
+			indexes.insert(indexes.end(), quad, quad + 6);
+		}
+	}
+
+	clothparams params;
+	cloth start;
+	clock::time_point begin = clock::now();
+	if (!buildCloth(start, &vertices[0], vertices.size(), &indexes[0], indexes.size(), params)) return -1;
+	double build_ms = std::chrono::duration<double, std::milli>(clock::now() - begin).count();
+	printf("cloth: %u particles, %u triangles, %u constraints (%u edges) in %u colors (%u for the edges), built in %.1f ms\n", clothParticleCount(start),
+		(unsigned int)start.triangle_weight.size(), (unsigned int)start.ca.size(), start.stretch_count, (unsigned int)start.color_first.size() - 1,
+		start.stretch_colors, build_ms);
+
+	jobsystem jobs;
+	createJobSystem(jobs, threads);
+	printf("  %-22s %10s %10s\n", "", "ms/step", "60 Hz");
+	cloth runs[3];
+	const char *labels[3] = { "scalar, 1 thread", "sse, 1 thread", "sse, threads" };
+	for (int run = 0; run < 3; ++run) {
+		cloth &c = runs[run];
+		c = start;
+		c.simd = run > 0;
+		begin = clock::now();
+		for (int s = 0; s < steps; ++s) stepCloth(c, params, CLOTH_TIMESTEP, run == 2 ? &jobs : NULL);
+		double ms = std::chrono::duration<double, std::milli>(clock::now() - begin).count() / steps;
+		char label[64];
+		if (run == 2) snprintf(label, sizeof(label), "sse, %u threads", jobs.thread_count);
+		else snprintf(label, sizeof(label), "%s", labels[run]);
+		printf("  %-22s %10.3f %9.0f%%\n", label, ms, 100.0 * ms / (1000.0 / 60.0));
+	}
+
+	// The threads must not change a thing, SSE only the rounding
+	const cloth &threaded = runs[2];
+	bool same = memcmp(&runs[1].x[0], &threaded.x[0], threaded.x.size() * sizeof(float)) == 0 &&
+		memcmp(&runs[1].y[0], &threaded.y[0], threaded.y.size() * sizeof(float)) == 0 &&
+		memcmp(&runs[1].z[0], &threaded.z[0], threaded.z.size() * sizeof(float)) == 0;
+	float scalar_difference = 0.0f;
+	bool finite = true, pinned = true;
+	for (unsigned int p = 0; p < clothParticleCount(threaded); ++p) {
+		scalar_difference = std::max(scalar_difference, glm::distance(clothParticle(runs[0], p), clothParticle(threaded, p)));
+		if (!std::isfinite(threaded.x[p]) || !std::isfinite(threaded.y[p]) || !std::isfinite(threaded.z[p])) finite = false;
+		if (threaded.inv_mass[p] == 0.0f && clothParticle(threaded, p) != clothParticle(start, p)) pinned = false;
+	}
+	float stretch = clothStretch(threaded);
+	bool ok = same && finite && pinned && stretch <= CLOTH_STRETCH_LIMIT;
+	printf("  after %d steps: threads %s, sse to scalar %.3g, largest stretch %.1f%% (limit %.0f%%), pinned edge %s %s\n", steps,
+		same ? "identical" : "DIFFERENT", scalar_difference, 100.0f * stretch, 100.0f * CLOTH_STRETCH_LIMIT, pinned ? "held" : "MOVED", ok ? "ok" : "FAILED");
+	destroyJobSystem(jobs);
+	return ok ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,9 @@
+#version 330 core
+
+in vec3 frag_Color;
+
+out vec4 out_Color;
+
+void main() {
+	out_Color = vec4(frag_Color, 1.0);
+}
@@ -0,0 +1,46 @@
+#version 330 core
+
+// Relative to the box of the mesh, w is the mesh's slot in MeshBounds
+layout(location = 0) in vec4 vert_Position;
+layout(location = 1) in vec4 vert_Color;
+
+// One copy per instance, see instancing.h
+layout(location = 2) in vec4 inst_PositionScale;
+layout(location = 3) in vec2 inst_YawPhase;
+
+// Shared by every program, rewritten once per frame
+layout(std140) uniform Camera {
+	mat4 u_View;
+	mat4 u_Projection;
+};
+
+layout(std140) uniform Object {
+	mat4 u_Model;
+	// Seconds, reduced modulo the wave period on the CPU so float keeps its precision
+	float u_Time;
+};
+
+// Box of every mesh in the arena, see vertexformat.h
+layout(std140) uniform MeshBounds {
+	vec4 u_BoundsCenter[256];
+	vec4 u_BoundsExtent[256];
+};
+
+out vec3 frag_Color;
+
+void main() {
+	int slot = int(vert_Position.w);
+	vec3 local = u_BoundsCenter[slot].xyz + vert_Position.xyz * u_BoundsExtent[slot].xyz;
+
+	// Same sine wave as the CPU animation, shifted by the phase of this copy
+	vec3 position = local;
+	position.z = position.x * 0.5 * sin(0.8 * u_Time + inst_YawPhase.y + 3.0 * position.x);
+
+	// Turn about y, scale, then move into place
+	float c = cos(inst_YawPhase.x);
+	float s = sin(inst_YawPhase.x);
+	position = inst_PositionScale.xyz + vec3(c * position.x + s * position.z, position.y, c * position.z - s * position.x) * inst_PositionScale.w;
+
+	frag_Color = vert_Color.rgb;
+	gl_Position = u_Projection * u_View * u_Model * vec4(position, 1.0);
+}
@@ -0,0 +1,36 @@
+#version 330 core
+
+layout(location = 0) in vec3 vert_Position;
+layout(location = 1) in vec3 vert_Color;
+
+// One copy per instance, see instancing.h
+layout(location = 2) in vec4 inst_PositionScale;
+layout(location = 3) in vec2 inst_YawPhase;
+
+// Shared by every program, rewritten once per frame
+layout(std140) uniform Camera {
+	mat4 u_View;
+	mat4 u_Projection;
+};
+
+layout(std140) uniform Object {
+	mat4 u_Model;
+	// Seconds, reduced modulo the wave period on the CPU so float keeps its precision
+	float u_Time;
+};
+
+out vec3 frag_Color;
+
+void main() {
+	// Same sine wave as the CPU animation, shifted by the phase of this copy
+	vec3 position = vert_Position;
+	position.z = position.x * 0.5 * sin(0.8 * u_Time + inst_YawPhase.y + 3.0 * position.x);
+
+	// Turn about y, scale, then move into place
+	float c = cos(inst_YawPhase.x);
+	float s = sin(inst_YawPhase.x);
+	position = inst_PositionScale.xyz + vec3(c * position.x + s * position.z, position.y, c * position.z - s * position.x) * inst_PositionScale.w;
+
+	frag_Color = vert_Color;
+	gl_Position = u_Projection * u_View * u_Model * vec4(position, 1.0);
+}
@@ -0,0 +1,325 @@
+#ifndef FLAGWAVE_H
+#define FLAGWAVE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "jobs.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLAGWAVE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FLAGWAVE_AVX2
+#else
+#define FLAGWAVE_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Vertices per job when the animation is split between threads, and the
+// granularity of the split so every vertex goes through the same kernel path
+#define FLAGWAVE_MIN_RANGE 4096
+#define FLAGWAVE_BLOCK 8
+
+// The flag animation: z = x * 0.5 * sin(0.8 t + 3 x), evaluated per vertex.
+// The rest pose x is kept as its own array and the kernels only write z
+// into the packed position buffer that goes to the GPU.
+struct flagwave {
+	std::vector<float> x;
+	std::vector<glm::vec3> positions;
+};
+
+// Kernel signature: x[i] in, positions[3 i + 2] out
+typedef void (*flagwavekernel)(const float *x, float *positions, size_t count, float phase);
+
+// 0.8 t reduced in double so large t keeps its precision in float
+inline float flagWavePhase(double t) {
+	return (float)fmod(0.8 * t, 2.0 * M_PI);
+}
+
+// t reduced modulo the wave period, for the vertex shader version of the animation
+inline float flagWaveTime(double t) {
+	return (float)fmod(t, 2.0 * M_PI / 0.8);
+}
+
+// Split an interleaved position/color mesh into the animation layout
+inline void initFlagWave(flagwave &wave, const glm::vec3 *vertices, size_t vertex_count) {
+	size_t count = vertex_count / 2;
+	wave.x.resize(count);
+	wave.positions.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		wave.x[i] = vertices[2 * i].x;
+		wave.positions[i] = vertices[2 * i];
+	}
+}
+
+inline void flagWaveScalar(const float *x, float *positions, size_t count, float phase) {
+	for (size_t i = 0; i < count; ++i) {
+		positions[3 * i + 2] = x[i] * 0.5f * sinf(phase + 3.0f * x[i]);
+	}
+}
+
+#ifdef FLAGWAVE_X86
+// Polynomial sine constants: reduce by multiples of pi (Cody-Waite, two parts),
+// then an odd degree 11 polynomial on [-pi/2, pi/2]
+#define FLAGWAVE_INV_PI 0.318309886183790671538f
+#define FLAGWAVE_PI_A 3.140625f
+#define FLAGWAVE_PI_B 9.67653589793e-4f
+#define FLAGWAVE_S3 -1.66666666666666e-1f
+#define FLAGWAVE_S5 8.33333333333333e-3f
+#define FLAGWAVE_S7 -1.98412698412698e-4f
+#define FLAGWAVE_S9 2.75573192239859e-6f
+#define FLAGWAVE_S11 -2.50521083854417e-8f
+
+inline __m128 flagWaveSinSSE(__m128 a) {
+	__m128i k = _mm_cvtps_epi32(_mm_mul_ps(a, _mm_set1_ps(FLAGWAVE_INV_PI)));
+	__m128 kf = _mm_cvtepi32_ps(k);
+	__m128 r = _mm_sub_ps(a, _mm_mul_ps(kf, _mm_set1_ps(FLAGWAVE_PI_A)));
+	r = _mm_sub_ps(r, _mm_mul_ps(kf, _mm_set1_ps(FLAGWAVE_PI_B)));
+
+	__m128 r2 = _mm_mul_ps(r, r);
+	__m128 p = _mm_set1_ps(FLAGWAVE_S11);
+	p = _mm_add_ps(_mm_mul_ps(p, r2), _mm_set1_ps(FLAGWAVE_S9));
+	p = _mm_add_ps(_mm_mul_ps(p, r2), _mm_set1_ps(FLAGWAVE_S7));
+	p = _mm_add_ps(_mm_mul_ps(p, r2), _mm_set1_ps(FLAGWAVE_S5));
+	p = _mm_add_ps(_mm_mul_ps(p, r2), _mm_set1_ps(FLAGWAVE_S3));
+	p = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r2), r), r);
+
+	// sin(r + k pi) = (-1)^k sin(r)
+	__m128 sign = _mm_castsi128_ps(_mm_slli_epi32(k, 31));
+	return _mm_xor_ps(p, sign);
+}
+
+inline void flagWaveSSE(const float *x, float *positions, size_t count, float phase) {
+	size_t i = 0;
+	__m128 vphase = _mm_set1_ps(phase);
+	for (; i + 4 <= count; i += 4) {
+		__m128 vx = _mm_loadu_ps(x + i);
+		__m128 a = _mm_add_ps(vphase, _mm_mul_ps(vx, _mm_set1_ps(3.0f)));
+		__m128 z = _mm_mul_ps(_mm_mul_ps(vx, _mm_set1_ps(0.5f)), flagWaveSinSSE(a));
+
+		// Scatter into the packed xyz buffer
+		float *out = positions + 3 * i + 2;
+		_mm_store_ss(out, z);
+		_mm_store_ss(out + 3, _mm_shuffle_ps(z, z, _MM_SHUFFLE(1, 1, 1, 1)));
+		_mm_store_ss(out + 6, _mm_shuffle_ps(z, z, _MM_SHUFFLE(2, 2, 2, 2)));
+		_mm_store_ss(out + 9, _mm_shuffle_ps(z, z, _MM_SHUFFLE(3, 3, 3, 3)));
+	}
+	flagWaveScalar(x + i, positions + 3 * i, count - i, phase);
+}
+
+FLAGWAVE_AVX2 inline void flagWaveAVX2(const float *x, float *positions, size_t count, float phase) {
+	size_t i = 0;
+	__m256 vphase = _mm256_set1_ps(phase);
+	for (; i + 8 <= count; i += 8) {
+		__m256 vx = _mm256_loadu_ps(x + i);
+		__m256 a = _mm256_fmadd_ps(vx, _mm256_set1_ps(3.0f), vphase);
+
+		__m256i k = _mm256_cvtps_epi32(_mm256_mul_ps(a, _mm256_set1_ps(FLAGWAVE_INV_PI)));
+		__m256 kf = _mm256_cvtepi32_ps(k);
+		__m256 r = _mm256_fnmadd_ps(kf, _mm256_set1_ps(FLAGWAVE_PI_A), a);
+		r = _mm256_fnmadd_ps(kf, _mm256_set1_ps(FLAGWAVE_PI_B), r);
+
+		__m256 r2 = _mm256_mul_ps(r, r);
+		__m256 p = _mm256_set1_ps(FLAGWAVE_S11);
+		p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(FLAGWAVE_S9));
+		p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(FLAGWAVE_S7));
+		p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(FLAGWAVE_S5));
+		p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(FLAGWAVE_S3));
+		p = _mm256_fmadd_ps(_mm256_mul_ps(p, r2), r, r);
+		p = _mm256_xor_ps(p, _mm256_castsi256_ps(_mm256_slli_epi32(k, 31)));
+
+		__m256 z = _mm256_mul_ps(_mm256_mul_ps(vx, _mm256_set1_ps(0.5f)), p);
+
+		// Scatter into the packed xyz buffer
+		alignas(32) float lanes[8];
+		_mm256_store_ps(lanes, z);
+		float *out = positions + 3 * i + 2;
+		for (int j = 0; j < 8; ++j) out[3 * j] = lanes[j];
+	}
+	flagWaveScalar(x + i, positions + 3 * i, count - i, phase);
+}
+
+inline bool flagWaveHasAVX2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	bool fma = (info[2] & (1 << 12)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!fma || !osxsave || (_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+#endif
+
+// Kernels in order of preference, the last entry is always the scalar one
+struct flagwaveentry {
+	const char *name;
+	flagwavekernel kernel;
+};
+
+inline std::vector<flagwaveentry> flagWaveKernels() {
+	std::vector<flagwaveentry> kernels;
+#ifdef FLAGWAVE_X86
+	if (flagWaveHasAVX2()) kernels.push_back({ "avx2", flagWaveAVX2 });
+	kernels.push_back({ "sse", flagWaveSSE });
+#endif
+	kernels.push_back({ "scalar", flagWaveScalar });
+	return kernels;
+}
+
+// Best kernel for this CPU
+inline flagwaveentry selectFlagWaveKernel() {
+	return flagWaveKernels()[0];
+}
+
+// Animate x[0..count) into positions split between the threads of jobs, NULL for the calling thread
+inline void flagWaveParallel(jobsystem *jobs, flagwavekernel kernel, const float *x, float *positions, size_t count, float phase) {
+	size_t blocks = (count + FLAGWAVE_BLOCK - 1) / FLAGWAVE_BLOCK;
+	parallelFor(jobs, 0, blocks, FLAGWAVE_MIN_RANGE / FLAGWAVE_BLOCK, [=](size_t begin, size_t end) {
+		size_t first = begin * FLAGWAVE_BLOCK;
+		size_t last = std::min(count, end * FLAGWAVE_BLOCK);
+		kernel(x + first, positions + 3 * first, last - first, phase);
+	});
+}
+
+// Animate into positions, which must already hold the rest pose x and y
+inline void updateFlagWave(flagwave &wave, flagwavekernel kernel, double t, glm::vec3 *positions, jobsystem *jobs = NULL) {
+	if (wave.x.empty()) return;
+	flagWaveParallel(jobs, kernel, &wave.x[0], &positions[0].x, wave.x.size(), flagWavePhase(t));
+}
+
+// Compare every kernel against the original double precision formula
+inline int testFlagWave() {
+	const size_t count = 4099;
+	std::vector<float> x(count);
+	std::vector<glm::vec3> positions(count);
+	for (size_t i = 0; i < count; ++i) {
+		x[i] = -4.0f + 8.0f * float(i) / float(count - 1);
+	}
+
+	const double times[] = { 0.0, 0.016, 1.0, 12.345, 600.0, 3600.5, 86400.25 };
+	int failures = 0;
+
+	std::vector<flagwaveentry> kernels = flagWaveKernels();
+	for (size_t k = 0; k < kernels.size(); ++k) {
+		double max_error = 0.0;
+		for (size_t j = 0; j < sizeof(times) / sizeof(times[0]); ++j) {
+			kernels[k].kernel(&x[0], &positions[0].x, count, flagWavePhase(times[j]));
+			for (size_t i = 0; i < count; ++i) {
+				float t = float(times[j]);
+				double expected = x[i] * 0.5 * (sin(0.8 * t + 3 * x[i]));
+				max_error = std::max(max_error, fabs(positions[i].z - expected));
+			}
+		}
+
+		// |x| <= 4, so this is a few ulp of float on the largest displacement
+		bool ok = max_error < 1e-5;
+		printf("flag wave %-6s max error %.3g %s\n", kernels[k].name, max_error, ok ? "ok" : "FAILED");
+		if (!ok) ++failures;
+	}
+
+	return failures == 0 ? 0 : -1;
+}
+
+// Vertices per second for each kernel
+inline int benchmarkFlagWave(size_t count, int frames) {
+	typedef std::chrono::steady_clock clock;
+
+	std::vector<float> x(count);
+	std::vector<glm::vec3> positions(count);
+	for (size_t i = 0; i < count; ++i) {
+		x[i] = float(i % 1024) / 1024.0f;
+	}
+
+	printf("flag wave: %u vertices, %d frames\n", (unsigned int)count, frames);
+
+	// Original loop for reference: interleaved buffer, stride 2, double precision sin
+	std::vector<glm::vec3> interleaved(count * 2);
+	for (size_t i = 0; i < count; ++i) interleaved[2 * i].x = x[i];
+	clock::time_point start = clock::now();
+	for (int f = 0; f < frames; ++f) {
+		float t = f / 60.0f;
+		for (size_t n = 0; n < interleaved.size(); n = n + 2) {
+			interleaved[n].z = interleaved[n].x * 0.5 * (sin(0.8 * t + 3 * interleaved[n].x));
+		}
+	}
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+	printf("  %-8s %8.1f Mvertices/s\n", "original", double(count) * frames / seconds / 1e6);
+
+	std::vector<flagwaveentry> kernels = flagWaveKernels();
+	for (size_t k = 0; k < kernels.size(); ++k) {
+		start = clock::now();
+		for (int f = 0; f < frames; ++f) {
+			kernels[k].kernel(&x[0], &positions[0].x, count, flagWavePhase(f / 60.0));
+		}
+		seconds = std::chrono::duration<double>(clock::now() - start).count();
+		printf("  %-8s %8.1f Mvertices/s\n", kernels[k].name, double(count) * frames / seconds / 1e6);
+	}
+
+	return 0;
+}
+
+// The animation with the selected kernel on 1 to max_threads threads, 0 for every hardware thread
+inline int benchmarkFlagWaveThreads(size_t count, int frames, unsigned int max_threads) {
+	typedef std::chrono::steady_clock clock;
+	if (max_threads == 0) max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	std::vector<float> x(count);
+	std::vector<glm::vec3> reference(count, glm::vec3(0.0f)), positions(count, glm::vec3(0.0f));
+	for (size_t i = 0; i < count; ++i) {
+		x[i] = float(i % 1024) / 1024.0f;
+	}
+	flagwaveentry entry = selectFlagWaveKernel();
+	float last_phase = flagWavePhase((frames - 1) / 60.0);
+	entry.kernel(&x[0], &reference[0].x, count, last_phase);
+
+	printf("flag wave %s: %u vertices, %d frames, %u hardware threads\n", entry.name, (unsigned int)count, frames,
+		std::thread::hardware_concurrency());
+	printf("  %7s %10s %14s %8s %8s\n", "threads", "ms", "Mvertices/s", "speedup", "stolen");
+	double single = 0.0;
+	int failures = 0;
+	for (unsigned int threads = 1; threads <= max_threads; ++threads) {
+		jobsystem jobs;
+		createJobSystem(jobs, threads);
+		// One frame to wake the workers up
+		flagWaveParallel(&jobs, entry.kernel, &x[0], &positions[0].x, count, 0.0f);
+		jobs.stolen = 0;
+
+		clock::time_point start = clock::now();
+		for (int f = 0; f < frames; ++f) {
+			flagWaveParallel(&jobs, entry.kernel, &x[0], &positions[0].x, count, flagWavePhase(f / 60.0));
+		}
+		double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count() / frames;
+		if (threads == 1) single = ms;
+
+		// Every split of the vertices must give the same result as one call
+		bool same = memcmp(&positions[0], &reference[0], count * sizeof(glm::vec3)) == 0;
+		if (!same) ++failures;
+		printf("  %7u %10.3f %14.1f %7.2fx %8llu%s\n", threads, ms, double(count) / ms / 1e3, single / ms,
+			(unsigned long long)jobs.stolen, same ? "" : " DIFFERENT");
+		destroyJobSystem(jobs);
+	}
+
+	return failures == 0 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef GEOMETRYARENA_H
+#define GEOMETRYARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.h"
+#include "instancing.h"
+#include "shaderprogram.h"
+#include "vertexformat.h"
+
+// Static meshes suballocated from one vertex buffer and one index buffer in
+// one vertex format, drawn through a single vertex array.
+// Indexes stay relative to their mesh and are rebased with the base vertex, so
+// meshes can be moved around without touching their index data. Draws read
+// their per-instance data from an optional instance buffer attached to the arena.
+// With a quantized format the box of every mesh lives in a MeshBounds block,
+// at the slot of the mesh's handle.
+
+// Handle of a mesh the arena refused, drawing or removing it does nothing
+#define ARENA_INVALID_MESH 0xFFFFFFFFu
+
+// Free run of vertices or indexes
+struct arenarange {
+	unsigned int offset;
+	unsigned int count;
+};
+
+struct arenamesh {
+	unsigned int base_vertex = 0;
+	unsigned int vertex_count = 0;
+	unsigned int first_index = 0;
+	unsigned int index_count = 0;
+	bool live = false;
+};
+
+// Layout glMultiDrawElementsIndirect reads from the indirect buffer
+struct arenadrawcommand {
+	GLuint count;
+	GLuint instance_count;
+	GLuint first_index;
+	GLint base_vertex;
+	GLuint base_instance;
+};
+
+struct geometryarena {
+	GLuint vao = 0;
+	GLuint vbo = 0;
+	GLuint ebo = 0;
+	GLuint indirect = 0;
+	GLuint instance_buffer = 0;
+	GLsizeiptr indirect_size = 0;
+	bool multi_draw = false;
+	vertexformat format;
+	GLuint bounds_buffer = 0;
+
+	unsigned int vertex_capacity = 0;
+	unsigned int index_capacity = 0;
+	// Sorted by offset, neighbours are always merged
+	std::vector<arenarange> free_vertices;
+	std::vector<arenarange> free_indexes;
+
+	// A mesh handle is its position here, removed slots are reused
+	std::vector<arenamesh> meshes;
+	std::vector<arenadrawcommand> commands;
+
+	unsigned int repacks = 0;
+};
+
+// First fit, false if no free run is large enough
+inline bool arenaAllocate(std::vector<arenarange> &free_list, unsigned int count, unsigned int &offset) {
+	if (count == 0) {
+		offset = 0;
+		return true;
+	}
+	for (size_t i = 0; i < free_list.size(); ++i) {
+		if (free_list[i].count < count) continue;
+		offset = free_list[i].offset;
+		free_list[i].offset += count;
+		free_list[i].count -= count;
+		if (free_list[i].count == 0) free_list.erase(free_list.begin() + i);
+		return true;
+	}
+	return false;
+}
+
+inline void arenaRelease(std::vector<arenarange> &free_list, unsigned int offset, unsigned int count) {
+	if (count == 0) return;
+	arenarange range = { offset, count };
+	std::vector<arenarange>::iterator next = std::lower_bound(free_list.begin(), free_list.end(), range,
+		[](const arenarange &a, const arenarange &b) { return a.offset < b.offset; });
+	next = free_list.insert(next, range);
+
+	// Merge with the run after, then with the one before
+	if (next + 1 != free_list.end() && next->offset + next->count == (next + 1)->offset) {
+		next->count += (next + 1)->count;
+		free_list.erase(next + 1);
+	}
+	if (next != free_list.begin() && (next - 1)->offset + (next - 1)->count == next->offset) {
+		(next - 1)->count += next->count;
+		free_list.erase(next);
+	}
+}
+
+// Total free space and the largest run, their difference is what fragmentation costs
+inline unsigned int arenaFreeCount(const std::vector<arenarange> &free_list, unsigned int *largest) {
+	unsigned int total = 0, biggest = 0;
+	for (size_t i = 0; i < free_list.size(); ++i) {
+		total += free_list[i].count;
+		biggest = std::max(biggest, free_list[i].count);
+	}
+	if (largest != NULL) *largest = biggest;
+	return total;
+}
+
+// Point the vertex array at the current buffers
+inline void bindArenaFormat(geometryarena &arena) {
+	cachedBindVertexArray(arena.vao);
+	cachedBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+	cachedBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.ebo);
+	bindVertexFormat(arena.format, 0);
+	if (arena.instance_buffer != 0) setInstanceAttributes(arena.instance_buffer, 0);
+	cachedBindVertexArray(0);
+	cachedBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Read per-instance data from buffer, draws without it see the identity instance
+inline void attachArenaInstances(geometryarena &arena, GLuint buffer) {
+	arena.instance_buffer = buffer;
+	bindArenaFormat(arena);
+}
+
+inline void createGeometryArena(geometryarena &arena, unsigned int vertex_capacity, unsigned int index_capacity,
+	const vertexformat &format = makeVertexFormat(POSITION_FLOAT, false)) {
+	arena = geometryarena();
+	arena.format = format;
+	arena.vertex_capacity = vertex_capacity;
+	arena.index_capacity = index_capacity;
+	arenaRelease(arena.free_vertices, 0, vertex_capacity);
+	arenaRelease(arena.free_indexes, 0, index_capacity);
+	// The indirect commands start at their own first instance, which needs base instance support
+	arena.multi_draw = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+
+	glGenVertexArrays(1, &arena.vao);
+	glGenBuffers(1, &arena.vbo);
+	glGenBuffers(1, &arena.ebo);
+	cachedBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)vertex_capacity * format.stride, NULL, GL_STATIC_DRAW);
+	cachedBindBuffer(GL_ARRAY_BUFFER, arena.ebo);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)index_capacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+	if (arena.multi_draw) glGenBuffers(1, &arena.indirect);
+	if (format.quantized) {
+		glGenBuffers(1, &arena.bounds_buffer);
+		cachedBindBuffer(GL_UNIFORM_BUFFER, arena.bounds_buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(meshboundsblock), NULL, GL_STATIC_DRAW);
+		cachedBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	bindArenaFormat(arena);
+}
+
+inline void destroyGeometryArena(geometryarena &arena) {
+	cachedDeleteVertexArrays(1, &arena.vao);
+	cachedDeleteBuffers(1, &arena.vbo);
+	cachedDeleteBuffers(1, &arena.ebo);
+	if (arena.indirect != 0) cachedDeleteBuffers(1, &arena.indirect);
+	if (arena.bounds_buffer != 0) cachedDeleteBuffers(1, &arena.bounds_buffer);
+	arena = geometryarena();
+}
+
+// Copy every live mesh to the front of new buffers of the given capacity,
+// which leaves all free space in one run at the end of each buffer
+inline void repackGeometryArena(geometryarena &arena, unsigned int vertex_capacity, unsigned int index_capacity) {
+	GLuint buffers[2];
+	glGenBuffers(2, buffers);
+	cachedBindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)vertex_capacity * arena.format.stride, NULL, GL_STATIC_DRAW);
+	cachedBindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)index_capacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+
+	// Keep the relative order so the copies read the old buffers front to back
+	std::vector<unsigned int> order;
+	for (unsigned int m = 0; m < arena.meshes.size(); ++m) {
+		if (arena.meshes[m].live) order.push_back(m);
+	}
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return arena.meshes[a].base_vertex < arena.meshes[b].base_vertex; });
+
+	const GLsizeiptr vertex_size = arena.format.stride;
+	unsigned int vertex_end = 0;
+	cachedBindBuffer(GL_COPY_READ_BUFFER, arena.vbo);
+	cachedBindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+	for (size_t i = 0; i < order.size(); ++i) {
+		arenamesh &mesh = arena.meshes[order[i]];
+		if (mesh.vertex_count > 0) {
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, mesh.base_vertex * vertex_size, vertex_end * vertex_size, mesh.vertex_count * vertex_size);
+		}
+		mesh.base_vertex = vertex_end;
+		vertex_end += mesh.vertex_count;
+	}
+
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return arena.meshes[a].first_index < arena.meshes[b].first_index; });
+	unsigned int index_end = 0;
+	cachedBindBuffer(GL_COPY_READ_BUFFER, arena.ebo);
+	cachedBindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+	for (size_t i = 0; i < order.size(); ++i) {
+		arenamesh &mesh = arena.meshes[order[i]];
+		if (mesh.index_count > 0) {
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, mesh.first_index * sizeof(unsigned int), index_end * sizeof(unsigned int), mesh.index_count * sizeof(unsigned int));
+		}
+		mesh.first_index = index_end;
+		index_end += mesh.index_count;
+	}
+	cachedBindBuffer(GL_COPY_READ_BUFFER, 0);
+	cachedBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	cachedDeleteBuffers(1, &arena.vbo);
+	cachedDeleteBuffers(1, &arena.ebo);
+	arena.vbo = buffers[0];
+	arena.ebo = buffers[1];
+	arena.vertex_capacity = vertex_capacity;
+	arena.index_capacity = index_capacity;
+	arena.free_vertices.clear();
+	arena.free_indexes.clear();
+	arenaRelease(arena.free_vertices, vertex_end, vertex_capacity - vertex_end);
+	arenaRelease(arena.free_indexes, index_end, index_capacity - index_end);
+	++arena.repacks;
+	bindArenaFormat(arena);
+}
+
+// Upload a mesh of interleaved position/color vertices and indexes counted from
+// its first vertex in the arena's format, returns its handle. When the free lists are too fragmented
+// the arena is compacted, and grown if that is not enough. A quantized arena refuses a
+// mesh past its MESH_BOUNDS_SLOTS bounds and returns ARENA_INVALID_MESH.
+inline unsigned int addArenaMesh(geometryarena &arena, const glm::vec3 *vertices, size_t vertex_count, const unsigned int *indexes, size_t index_count) {
+	arenamesh mesh;
+	mesh.vertex_count = (unsigned int)vertex_count;
+	mesh.index_count = (unsigned int)index_count;
+	mesh.live = true;
+	unsigned int handle = (unsigned int)arena.meshes.size();
+	for (unsigned int m = 0; m < arena.meshes.size(); ++m) {
+		if (!arena.meshes[m].live) {
+			handle = m;
+			break;
+		}
+	}
+	if (arena.format.quantized && handle >= MESH_BOUNDS_SLOTS) {
+		fprintf(stderr, "Geometry arena: mesh %u has no bounds slot, %s vertices allow %d meshes\n", handle, arena.format.name.c_str(), MESH_BOUNDS_SLOTS);
+		return ARENA_INVALID_MESH;
+	}
+
+	unsigned int largest_vertices = 0, largest_indexes = 0;
+	unsigned int free_vertices = arenaFreeCount(arena.free_vertices, &largest_vertices);
+	unsigned int free_indexes = arenaFreeCount(arena.free_indexes, &largest_indexes);
+	if (largest_vertices < mesh.vertex_count || largest_indexes < mesh.index_count) {
+		// Compacting in place only helps if the free space adds up, otherwise double until it fits
+		unsigned int vertex_capacity = arena.vertex_capacity, index_capacity = arena.index_capacity;
+		while (vertex_capacity - arena.vertex_capacity + free_vertices < mesh.vertex_count) vertex_capacity = std::max(vertex_capacity * 2, 1024u);
+		while (index_capacity - arena.index_capacity + free_indexes < mesh.index_count) index_capacity = std::max(index_capacity * 2, 1024u);
+		repackGeometryArena(arena, vertex_capacity, index_capacity);
+	}
+	arenaAllocate(arena.free_vertices, mesh.vertex_count, mesh.base_vertex);
+	arenaAllocate(arena.free_indexes, mesh.index_count, mesh.first_index);
+
+	if (vertex_count > 0) {
+		std::vector<unsigned char> packed;
+		glm::vec4 center, extent;
+		packVertices(arena.format, vertices, vertex_count, indexes, index_count, handle, packed, center, extent);
+		cachedBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)mesh.base_vertex * arena.format.stride, packed.size(), &packed[0]);
+		if (arena.format.quantized) {
+			cachedBindBuffer(GL_UNIFORM_BUFFER, arena.bounds_buffer);
+			glBufferSubData(GL_UNIFORM_BUFFER, offsetof(meshboundsblock, center) + handle * sizeof(glm::vec4), sizeof(glm::vec4), &center);
+			glBufferSubData(GL_UNIFORM_BUFFER, offsetof(meshboundsblock, extent) + handle * sizeof(glm::vec4), sizeof(glm::vec4), &extent);
+			cachedBindBuffer(GL_UNIFORM_BUFFER, 0);
+		}
+	}
+	if (index_count > 0) {
+		cachedBindBuffer(GL_ARRAY_BUFFER, arena.ebo);
+		glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)mesh.first_index * sizeof(unsigned int), index_count * sizeof(unsigned int), indexes);
+	}
+	cachedBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (handle == arena.meshes.size()) arena.meshes.push_back(mesh);
+	else arena.meshes[handle] = mesh;
+	return handle;
+}
+
+inline unsigned int addArenaMesh(geometryarena &arena, const std::vector<glm::vec3> &vertices, const std::vector<unsigned int> &indexes) {
+	return addArenaMesh(arena, vertices.empty() ? NULL : &vertices[0], vertices.size() / 2, indexes.empty() ? NULL : &indexes[0], indexes.size());
+}
+
+inline void removeArenaMesh(geometryarena &arena, unsigned int handle) {
+	if (handle == ARENA_INVALID_MESH) return;
+	arenamesh &mesh = arena.meshes[handle];
+	if (!mesh.live) return;
+	arenaRelease(arena.free_vertices, mesh.base_vertex, mesh.vertex_count);
+	arenaRelease(arena.free_indexes, mesh.first_index, mesh.index_count);
+	mesh = arenamesh();
+}
+
+// Queue instance_count copies of index_count indexes of a mesh, first_index is counted
+// from the mesh's own first index and first_instance from the start of the instance buffer
+inline void addArenaInstances(geometryarena &arena, unsigned int handle, unsigned int first_index, unsigned int index_count,
+	unsigned int first_instance, unsigned int instance_count) {
+	if (instance_count == 0 || handle == ARENA_INVALID_MESH) return;
+	const arenamesh &mesh = arena.meshes[handle];
+	arenadrawcommand command;
+	command.count = index_count;
+	command.instance_count = instance_count;
+	command.first_index = mesh.first_index + first_index;
+	command.base_vertex = (GLint)mesh.base_vertex;
+	command.base_instance = first_instance;
+	arena.commands.push_back(command);
+}
+
+inline void addArenaDraw(geometryarena &arena, unsigned int handle, unsigned int first_index, unsigned int index_count) {
+	addArenaInstances(arena, handle, first_index, index_count, 0, 1);
+}
+
+inline void addArenaDraw(geometryarena &arena, unsigned int handle) {
+	if (handle == ARENA_INVALID_MESH) return;
+	addArenaDraw(arena, handle, 0, arena.meshes[handle].index_count);
+}
+
+// Draw everything queued since the last submit with the current program,
+// returns the number of draw calls it took. The arena's vertex array stays
+// bound, the next submit of the same arena does not bind it again.
+inline unsigned int submitGeometryArena(geometryarena &arena) {
+	if (arena.commands.empty()) return 0;
+	unsigned int calls = 0;
+	cachedBindVertexArray(arena.vao);
+	if (arena.bounds_buffer != 0) cachedBindBufferBase(GL_UNIFORM_BUFFER, BOUNDS_BINDING, arena.bounds_buffer);
+
+	if (arena.multi_draw) {
+		// Orphan the command buffer every frame instead of waiting on the last one
+		GLsizeiptr size = (GLsizeiptr)(arena.commands.size() * sizeof(arenadrawcommand));
+		cachedBindBuffer(GL_DRAW_INDIRECT_BUFFER, arena.indirect);
+		arena.indirect_size = std::max(arena.indirect_size, size);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, arena.indirect_size, NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, size, &arena.commands[0]);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, NULL, (GLsizei)arena.commands.size(), 0);
+		calls = 1;
+	}
+	else {
+		for (size_t i = 0; i < arena.commands.size(); ++i) {
+			const arenadrawcommand &command = arena.commands[i];
+			drawInstances((GLsizei)command.count, command.first_index, command.base_vertex, (GLsizei)command.instance_count, command.base_instance, arena.instance_buffer);
+		}
+		calls = (unsigned int)arena.commands.size();
+	}
+
+	arena.commands.clear();
+	return calls;
+}
+
+// Bytes of vertex and index data a mesh takes up in the arena
+inline size_t arenaMeshBytes(const geometryarena &arena, unsigned int handle) {
+	if (handle == ARENA_INVALID_MESH) return 0;
+	const arenamesh &mesh = arena.meshes[handle];
+	return (size_t)mesh.vertex_count * arena.format.stride + (size_t)mesh.index_count * sizeof(unsigned int);
+}
+
+inline void printGeometryArena(const geometryarena &arena) {
+	unsigned int live = 0;
+	for (size_t m = 0; m < arena.meshes.size(); ++m) {
+		if (arena.meshes[m].live) ++live;
+	}
+	unsigned int free_vertices = arenaFreeCount(arena.free_vertices, NULL);
+	unsigned int free_indexes = arenaFreeCount(arena.free_indexes, NULL);
+	printf("Geometry arena: %u meshes, vertices %u/%u (%s, %d bytes), indexes %u/%u, %u repacks, %s\n", live,
+		arena.vertex_capacity - free_vertices, arena.vertex_capacity, arena.format.name.c_str(), (int)arena.format.stride,
+		arena.index_capacity - free_indexes, arena.index_capacity, arena.repacks, arena.multi_draw ? "multi draw indirect" : "base vertex draws");
+}
+
+#endif
@@ -0,0 +1,341 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <GL/glew.h>
+
+// Shadow value of a binding nothing is known about, the next bind always goes to the driver
+#define GLSTATE_UNKNOWN 0xFFFFFFFFu
+// Uniform buffer binding points and texture units the cache follows
+#define GLSTATE_UNIFORM_BINDINGS 8
+#define GLSTATE_TEXTURE_UNITS 8
+
+// Buffer targets the cache follows and the queries that read them back
+static const GLenum glstate_buffer_targets[] = {
+	GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_COPY_READ_BUFFER,
+	GL_COPY_WRITE_BUFFER, GL_PIXEL_PACK_BUFFER, GL_PIXEL_UNPACK_BUFFER, GL_DRAW_INDIRECT_BUFFER
+};
+static const GLenum glstate_buffer_queries[] = {
+	GL_ARRAY_BUFFER_BINDING, GL_ELEMENT_ARRAY_BUFFER_BINDING, GL_UNIFORM_BUFFER_BINDING, GL_COPY_READ_BUFFER_BINDING,
+	GL_COPY_WRITE_BUFFER_BINDING, GL_PIXEL_PACK_BUFFER_BINDING, GL_PIXEL_UNPACK_BUFFER_BINDING, GL_DRAW_INDIRECT_BUFFER_BINDING
+};
+#define GLSTATE_BUFFER_TARGETS (sizeof(glstate_buffer_targets) / sizeof(glstate_buffer_targets[0]))
+
+// Capabilities the cache follows, all of them off in a new context
+static const GLenum glstate_capabilities[] = {
+	GL_DEPTH_TEST, GL_CULL_FACE, GL_BLEND, GL_SCISSOR_TEST, GL_STENCIL_TEST, GL_RASTERIZER_DISCARD
+};
+#define GLSTATE_CAPABILITIES (sizeof(glstate_capabilities) / sizeof(glstate_capabilities[0]))
+
+struct glindexedbinding {
+	GLuint buffer;
+	GLintptr offset;
+	GLsizeiptr size;	// -1 for the whole buffer
+};
+
+// Shadow of the bindings of the one GL context, a bind that matches it is not
+// sent to the driver. Everything that binds programs, vertex arrays, buffers or
+// textures goes through the cached calls, state changed behind the cache's back
+// has to be announced with invalidateGLState.
+struct glstatecache {
+	bool enabled = true;
+	// Check the shadow against glGet before every elided call and at checkGLState
+	bool check = false;
+
+	GLuint program = 0;
+	GLuint vertex_array = 0;
+	GLuint buffers[GLSTATE_BUFFER_TARGETS] = {};
+	glindexedbinding uniform_bindings[GLSTATE_UNIFORM_BINDINGS] = {};
+	GLenum active_texture = GL_TEXTURE0;
+	GLuint textures[GLSTATE_TEXTURE_UNITS] = {};
+	int capabilities[GLSTATE_CAPABILITIES] = {};	// 0 off, 1 on, -1 unknown
+
+	// Calls sent to the driver and calls skipped, this frame and since the start
+	uint64_t frame_issued = 0;
+	uint64_t frame_elided = 0;
+	uint64_t issued = 0;
+	uint64_t elided = 0;
+	uint64_t frames = 0;
+	uint64_t mismatches = 0;
+	// Calls made before the first frame
+	uint64_t setup_issued = 0;
+	uint64_t setup_elided = 0;
+};
+
+inline glstatecache &glState() {
+	static glstatecache cache;
+	return cache;
+}
+
+// With enabled off every call is issued, the counters still show what would have been elided
+inline void configureGLStateCache(bool enabled, bool check) {
+	glState().enabled = enabled;
+	glState().check = check;
+}
+
+// Forget every binding, for after code that changed them directly
+inline void invalidateGLState() {
+	glstatecache &s = glState();
+	s.program = GLSTATE_UNKNOWN;
+	s.vertex_array = GLSTATE_UNKNOWN;
+	for (size_t t = 0; t < GLSTATE_BUFFER_TARGETS; ++t) s.buffers[t] = GLSTATE_UNKNOWN;
+	for (int i = 0; i < GLSTATE_UNIFORM_BINDINGS; ++i) s.uniform_bindings[i].buffer = GLSTATE_UNKNOWN;
+	s.active_texture = GLSTATE_UNKNOWN;
+	for (int i = 0; i < GLSTATE_TEXTURE_UNITS; ++i) s.textures[i] = GLSTATE_UNKNOWN;
+	for (size_t c = 0; c < GLSTATE_CAPABILITIES; ++c) s.capabilities[c] = -1;
+}
+
+inline int glStateBufferSlot(GLenum target) {
+	for (size_t t = 0; t < GLSTATE_BUFFER_TARGETS; ++t) {
+		if (glstate_buffer_targets[t] == target) return (int)t;
+	}
+	return -1;
+}
+
+inline int glStateCapabilitySlot(GLenum capability) {
+	for (size_t c = 0; c < GLSTATE_CAPABILITIES; ++c) {
+		if (glstate_capabilities[c] == capability) return (int)c;
+	}
+	return -1;
+}
+
+// Compare one shadow value with what the driver reports, the driver wins
+inline void checkGLStateValue(const char *what, GLenum query, GLuint &shadow) {
+	if (shadow == GLSTATE_UNKNOWN) return;
+	// Indirect draws are optional in a 3.3 context, the arena only binds the buffer with multi draw support
+	if (query == GL_DRAW_INDIRECT_BUFFER_BINDING && !GLEW_ARB_multi_draw_indirect) return;
+	GLint actual = 0;
+	glGetIntegerv(query, &actual);
+	if ((GLuint)actual == shadow) return;
+	fprintf(stderr, "GL state cache: %s is %d, the cache had %u\n", what, actual, shadow);
+	glState().mismatches++;
+	shadow = (GLuint)actual;
+}
+
+// Count a call and tell whether it has to go to the driver
+inline bool issueGLState(bool same) {
+	glstatecache &s = glState();
+	if (same) {
+		s.frame_elided++;
+		s.elided++;
+		return !s.enabled;
+	}
+	s.frame_issued++;
+	s.issued++;
+	return true;
+}
+
+inline void cachedUseProgram(GLuint program) {
+	glstatecache &s = glState();
+	if (s.check && s.program == program) checkGLStateValue("program", GL_CURRENT_PROGRAM, s.program);
+	if (!issueGLState(s.program == program)) return;
+	glUseProgram(program);
+	s.program = program;
+}
+
+// The element buffer binding belongs to the vertex array, so it is unknown after a switch
+inline void cachedBindVertexArray(GLuint vertex_array) {
+	glstatecache &s = glState();
+	if (s.check && s.vertex_array == vertex_array) checkGLStateValue("vertex array", GL_VERTEX_ARRAY_BINDING, s.vertex_array);
+	if (!issueGLState(s.vertex_array == vertex_array)) return;
+	glBindVertexArray(vertex_array);
+	if (s.vertex_array != vertex_array) s.buffers[glStateBufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = GLSTATE_UNKNOWN;
+	s.vertex_array = vertex_array;
+}
+
+inline void cachedBindBuffer(GLenum target, GLuint buffer) {
+	glstatecache &s = glState();
+	int slot = glStateBufferSlot(target);
+	if (slot < 0) {
+		issueGLState(false);
+		glBindBuffer(target, buffer);
+		return;
+	}
+	if (s.check && s.buffers[slot] == buffer) checkGLStateValue("buffer binding", glstate_buffer_queries[slot], s.buffers[slot]);
+	if (!issueGLState(s.buffers[slot] == buffer)) return;
+	glBindBuffer(target, buffer);
+	s.buffers[slot] = buffer;
+}
+
+// Indexed uniform buffer bindings. An issued one also sets the generic
+// GL_UNIFORM_BUFFER binding, an elided one leaves it as it was.
+inline void cachedBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+	glstatecache &s = glState();
+	bool tracked = target == GL_UNIFORM_BUFFER && index < GLSTATE_UNIFORM_BINDINGS;
+	bool same = false;
+	if (tracked) {
+		const glindexedbinding &binding = s.uniform_bindings[index];
+		same = binding.buffer == buffer && binding.offset == offset && binding.size == size;
+		if (s.check && same) {
+			GLint actual = 0;
+			glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, index, &actual);
+			GLuint shadow = binding.buffer;
+			if ((GLuint)actual != shadow) {
+				fprintf(stderr, "GL state cache: uniform binding %u is %d, the cache had %u\n", index, actual, shadow);
+				s.mismatches++;
+				same = false;
+			}
+		}
+	}
+	if (!issueGLState(same)) return;
+	if (size < 0) glBindBufferBase(target, index, buffer);
+	else glBindBufferRange(target, index, buffer, offset, size);
+	int slot = glStateBufferSlot(target);
+	if (slot >= 0) s.buffers[slot] = buffer;
+	if (tracked) {
+		glindexedbinding binding = { buffer, offset, size };
+		s.uniform_bindings[index] = binding;
+	}
+}
+
+inline void cachedBindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+	cachedBindBufferRange(target, index, buffer, 0, -1);
+}
+
+inline void cachedActiveTexture(GLenum unit) {
+	glstatecache &s = glState();
+	if (s.check && s.active_texture == unit) checkGLStateValue("active texture", GL_ACTIVE_TEXTURE, s.active_texture);
+	if (!issueGLState(s.active_texture == unit)) return;
+	glActiveTexture(unit);
+	s.active_texture = unit;
+}
+
+// Only GL_TEXTURE_2D is followed, other targets always go to the driver
+inline void cachedBindTexture(GLuint unit, GLenum target, GLuint texture) {
+	glstatecache &s = glState();
+	cachedActiveTexture(GL_TEXTURE0 + unit);
+	if (target != GL_TEXTURE_2D || unit >= GLSTATE_TEXTURE_UNITS) {
+		issueGLState(false);
+		glBindTexture(target, texture);
+		return;
+	}
+	if (s.check && s.textures[unit] == texture) checkGLStateValue("texture binding", GL_TEXTURE_BINDING_2D, s.textures[unit]);
+	if (!issueGLState(s.textures[unit] == texture)) return;
+	glBindTexture(target, texture);
+	s.textures[unit] = texture;
+}
+
+inline void cachedSetCapability(GLenum capability, bool on) {
+	glstatecache &s = glState();
+	int slot = glStateCapabilitySlot(capability);
+	bool same = slot >= 0 && s.capabilities[slot] == (on ? 1 : 0);
+	if (s.check && same && (glIsEnabled(capability) == GL_TRUE) != on) {
+		fprintf(stderr, "GL state cache: capability 0x%04x is %s, the cache had it %s\n", capability, on ? "off" : "on", on ? "on" : "off");
+		s.mismatches++;
+		same = false;
+	}
+	if (!issueGLState(same)) return;
+	if (on) glEnable(capability);
+	else glDisable(capability);
+	if (slot >= 0) s.capabilities[slot] = on ? 1 : 0;
+}
+
+inline void cachedEnable(GLenum capability) {
+	cachedSetCapability(capability, true);
+}
+
+inline void cachedDisable(GLenum capability) {
+	cachedSetCapability(capability, false);
+}
+
+// Deleting a bound object reverts its bindings to 0, the shadow has to follow
+// or a new object given the same name would be taken as bound
+inline void cachedDeleteBuffers(GLsizei count, const GLuint *buffers) {
+	glstatecache &s = glState();
+	for (GLsizei i = 0; i < count; ++i) {
+		if (buffers[i] == 0) continue;
+		for (size_t t = 0; t < GLSTATE_BUFFER_TARGETS; ++t) {
+			if (s.buffers[t] == buffers[i]) s.buffers[t] = 0;
+		}
+		for (int b = 0; b < GLSTATE_UNIFORM_BINDINGS; ++b) {
+			if (s.uniform_bindings[b].buffer == buffers[i]) s.uniform_bindings[b].buffer = GLSTATE_UNKNOWN;
+		}
+	}
+	glDeleteBuffers(count, buffers);
+}
+
+inline void cachedDeleteVertexArrays(GLsizei count, const GLuint *vertex_arrays) {
+	glstatecache &s = glState();
+	for (GLsizei i = 0; i < count; ++i) {
+		if (vertex_arrays[i] != 0 && s.vertex_array == vertex_arrays[i]) {
+			s.vertex_array = 0;
+			s.buffers[glStateBufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = GLSTATE_UNKNOWN;
+		}
+	}
+	glDeleteVertexArrays(count, vertex_arrays);
+}
+
+inline void cachedDeleteTextures(GLsizei count, const GLuint *textures) {
+	glstatecache &s = glState();
+	for (GLsizei i = 0; i < count; ++i) {
+		for (int u = 0; u < GLSTATE_TEXTURE_UNITS; ++u) {
+			if (textures[i] != 0 && s.textures[u] == textures[i]) s.textures[u] = 0;
+		}
+	}
+	glDeleteTextures(count, textures);
+}
+
+// Compare the whole shadow with the driver, where names the caller in the messages
+inline void checkGLState(const char *where) {
+	glstatecache &s = glState();
+	uint64_t before = s.mismatches;
+	checkGLStateValue("program", GL_CURRENT_PROGRAM, s.program);
+	checkGLStateValue("vertex array", GL_VERTEX_ARRAY_BINDING, s.vertex_array);
+	for (size_t t = 0; t < GLSTATE_BUFFER_TARGETS; ++t) checkGLStateValue("buffer binding", glstate_buffer_queries[t], s.buffers[t]);
+	for (GLuint i = 0; i < GLSTATE_UNIFORM_BINDINGS; ++i) {
+		if (s.uniform_bindings[i].buffer == GLSTATE_UNKNOWN) continue;
+		GLint actual = 0;
+		glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, i, &actual);
+		if ((GLuint)actual != s.uniform_bindings[i].buffer) {
+			fprintf(stderr, "GL state cache: uniform binding %u is %d, the cache had %u\n", i, actual, s.uniform_bindings[i].buffer);
+			s.mismatches++;
+			s.uniform_bindings[i].buffer = GLSTATE_UNKNOWN;
+		}
+	}
+	checkGLStateValue("active texture", GL_ACTIVE_TEXTURE, s.active_texture);
+	if (s.active_texture != GLSTATE_UNKNOWN) {
+		for (int u = 0; u < GLSTATE_TEXTURE_UNITS; ++u) {
+			if (s.textures[u] == GLSTATE_UNKNOWN) continue;
+			glActiveTexture(GL_TEXTURE0 + u);
+			checkGLStateValue("texture binding", GL_TEXTURE_BINDING_2D, s.textures[u]);
+		}
+		glActiveTexture(s.active_texture);
+	}
+	for (size_t c = 0; c < GLSTATE_CAPABILITIES; ++c) {
+		if (s.capabilities[c] < 0) continue;
+		int actual = glIsEnabled(glstate_capabilities[c]) == GL_TRUE ? 1 : 0;
+		if (actual == s.capabilities[c]) continue;
+		fprintf(stderr, "GL state cache: capability 0x%04x is %s, the cache had it %s\n", glstate_capabilities[c],
+			actual ? "on" : "off", actual ? "off" : "on");
+		s.mismatches++;
+		s.capabilities[c] = actual;
+	}
+	if (s.mismatches != before) fprintf(stderr, "GL state cache: %llu mismatches at %s\n", (unsigned long long)(s.mismatches - before), where);
+}
+
+// Start counting the calls of a new frame
+inline void beginGLStateFrame() {
+	glstatecache &s = glState();
+	if (s.frames == 0) {
+		s.setup_issued = s.issued;
+		s.setup_elided = s.elided;
+	}
+	s.frame_issued = 0;
+	s.frame_elided = 0;
+	s.frames++;
+}
+
+inline void printGLState() {
+	const glstatecache &s = glState();
+	double frames = s.frames > 0 ? double(s.frames) : 1.0;
+	uint64_t issued = s.issued - s.setup_issued, elided = s.elided - s.setup_elided;
+	printf("GL state cache%s: %.1f calls issued, %.1f elided per frame (%.1f%%), %llu issued and %llu elided before the first frame",
+		s.enabled ? "" : " (off, elided calls issued anyway)", issued / frames, elided / frames,
+		issued + elided > 0 ? 100.0 * elided / (issued + elided) : 0.0, (unsigned long long)s.setup_issued, (unsigned long long)s.setup_elided);
+	if (s.check) printf(", %llu mismatches", (unsigned long long)s.mismatches);
+	printf("\n");
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <GL/glew.h>
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+#define HEADLESS_EGL 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// OpenGL 3.3 core context without a window, rendering goes to an FBO
+struct headlesscontext {
+#ifdef HEADLESS_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+	EGLSurface surface = EGL_NO_SURFACE;
+#endif
+};
+
+#ifdef HEADLESS_EGL
+inline bool eglHasExtension(const char *extensions, const char *name) {
+	if (extensions == NULL) return false;
+	size_t length = strlen(name);
+	for (const char *p = strstr(extensions, name); p != NULL; p = strstr(p + length, name)) {
+		if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) return true;
+	}
+	return false;
+}
+#endif
+
+inline void destroyHeadlessContext(headlesscontext &ctx) {
+#ifdef HEADLESS_EGL
+	if (ctx.display != EGL_NO_DISPLAY) {
+		eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (ctx.surface != EGL_NO_SURFACE) eglDestroySurface(ctx.display, ctx.surface);
+		if (ctx.context != EGL_NO_CONTEXT) eglDestroyContext(ctx.display, ctx.context);
+		eglTerminate(ctx.display);
+	}
+	ctx.display = EGL_NO_DISPLAY;
+	ctx.context = EGL_NO_CONTEXT;
+	ctx.surface = EGL_NO_SURFACE;
+#endif
+}
+
+// Create and make current a context on the Mesa surfaceless platform (llvmpipe
+// when there is no GPU), or on the default EGL display with a pbuffer otherwise
+inline bool createHeadlessContext(headlesscontext &ctx) {
+#ifdef HEADLESS_EGL
+	// Prefer the surfaceless platform, it needs neither X11 nor a DRM device
+	const char *client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay != NULL && eglHasExtension(client, "EGL_MESA_platform_surfaceless")) {
+		ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (ctx.display == EGL_NO_DISPLAY) {
+		ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	EGLint major, minor;
+	if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, &major, &minor)) {
+		fprintf(stderr, "Failed to initialize EGL\n");
+		ctx.display = EGL_NO_DISPLAY;
+		return false;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		fprintf(stderr, "EGL does not support desktop OpenGL\n");
+		destroyHeadlessContext(ctx);
+		return false;
+	}
+
+	// Any OpenGL capable config, we never draw to the surface itself
+	const char *extensions = eglQueryString(ctx.display, EGL_EXTENSIONS);
+	bool surfaceless = eglHasExtension(extensions, "EGL_KHR_surfaceless_context");
+	const EGLint config_attribs[] = {
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+		EGL_NONE
+	};
+	EGLConfig config = NULL;
+	EGLint count = 0;
+	if (!eglChooseConfig(ctx.display, config_attribs, &config, 1, &count) || count == 0) {
+		if (!surfaceless || !eglHasExtension(extensions, "EGL_KHR_no_config_context")) {
+			fprintf(stderr, "Failed to find an EGL config\n");
+			destroyHeadlessContext(ctx);
+			return false;
+		}
+		config = NULL;
+	}
+
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	ctx.context = eglCreateContext(ctx.display, config, EGL_NO_CONTEXT, context_attribs);
+	if (ctx.context == EGL_NO_CONTEXT) {
+		fprintf(stderr, "Failed to create a 3.3 core EGL context\n");
+		destroyHeadlessContext(ctx);
+		return false;
+	}
+
+	if (!surfaceless) {
+		const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		ctx.surface = eglCreatePbufferSurface(ctx.display, config, pbuffer_attribs);
+	}
+	if (!eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context)) {
+		fprintf(stderr, "Failed to make the EGL context current\n");
+		destroyHeadlessContext(ctx);
+		return false;
+	}
+
+	// GLEW built for GLX complains about the missing X display but has loaded the entry points by then
+	GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	if (err == GLEW_ERROR_NO_GLX_DISPLAY) err = GLEW_OK;
+#endif
+	if (err != GLEW_OK) {
+		fprintf(stderr, "Failed to initialize GLEW\n");
+		destroyHeadlessContext(ctx);
+		return false;
+	}
+
+	printf("Headless: EGL %d.%d, %s\n", major, minor, (const char*)glGetString(GL_RENDERER));
+	return true;
+#else
+	fprintf(stderr, "Headless mode needs EGL, which is not available on this platform\n");
+	return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,32 @@
+#version 330 core
+
+layout(location = 0) in vec3 vert_Position;
+layout(location = 1) in vec3 vert_Color;
+
+// One copy per instance, see instancing.h
+layout(location = 2) in vec4 inst_PositionScale;
+layout(location = 3) in vec2 inst_YawPhase;
+
+// Shared by every program, rewritten once per frame
+layout(std140) uniform Camera {
+	mat4 u_View;
+	mat4 u_Projection;
+};
+
+layout(std140) uniform Object {
+	mat4 u_Model;
+	float u_Time;
+};
+
+out vec3 frag_Color;
+
+void main() {
+	// Turn about y, scale, then move into place
+	float c = cos(inst_YawPhase.x);
+	float s = sin(inst_YawPhase.x);
+	vec3 turned = vec3(c * vert_Position.x + s * vert_Position.z, vert_Position.y, c * vert_Position.z - s * vert_Position.x);
+	vec3 position = inst_PositionScale.xyz + turned * inst_PositionScale.w;
+
+	frag_Color = vert_Color;
+	gl_Position = u_Projection * u_View * u_Model * vec4(position, 1.0);
+}
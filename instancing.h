@@ -0,0 +1,153 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.h"
+
+// Vertex attribute locations of the per-instance data, after position and color
+#define INSTANCE_POSITION_ATTRIB 2
+#define INSTANCE_YAW_ATTRIB 3
+
+// One copy of a mesh: placed at position, turned by yaw radians about the y
+// axis and scaled uniformly. phase offsets the flag wave of this copy.
+//   layout(location = 2) in vec4 inst_PositionScale;
+//   layout(location = 3) in vec2 inst_YawPhase;
+struct instancedata {
+	glm::vec4 position_scale;
+	glm::vec2 yaw_phase;
+};
+
+inline instancedata makeInstance(glm::vec3 position, float yaw, float scale, float phase) {
+	instancedata instance;
+	instance.position_scale = glm::vec4(position, scale);
+	instance.yaw_phase = glm::vec2(yaw, phase);
+	return instance;
+}
+
+// Where a point of the mesh ends up, the same transform the vertex shaders apply
+inline glm::vec3 instancePoint(const instancedata &instance, glm::vec3 p) {
+	float c = cosf(instance.yaw_phase.x), s = sinf(instance.yaw_phase.x);
+	glm::vec3 turned(c * p.x + s * p.z, p.y, c * p.z - s * p.x);
+	return glm::vec3(instance.position_scale.x, instance.position_scale.y, instance.position_scale.z) + turned * instance.position_scale.w;
+}
+
+// World box around a mesh box low..high placed by instance
+inline void instanceBounds(const instancedata &instance, glm::vec3 low, glm::vec3 high, glm::vec3 &out_low, glm::vec3 &out_high) {
+	float c = fabsf(cosf(instance.yaw_phase.x)), s = fabsf(sinf(instance.yaw_phase.x));
+	glm::vec3 half = (high - low) * 0.5f;
+	glm::vec3 extent = glm::vec3(c * half.x + s * half.z, half.y, s * half.x + c * half.z) * instance.position_scale.w;
+	glm::vec3 center = instancePoint(instance, (low + high) * 0.5f);
+	out_low = center - extent;
+	out_high = center + extent;
+}
+
+// World boxes of every copy of a mesh box low..high
+inline void instanceBoxes(const std::vector<instancedata> &instances, glm::vec3 low, glm::vec3 high,
+	std::vector<glm::vec3> &out_low, std::vector<glm::vec3> &out_high) {
+	out_low.resize(instances.size());
+	out_high.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); ++i) instanceBounds(instances[i], low, high, out_low[i], out_high[i]);
+}
+
+// Generic attribute values seen by vertex arrays without an instance buffer, a single untransformed copy
+inline void setIdentityInstance() {
+	glVertexAttrib4f(INSTANCE_POSITION_ATTRIB, 0.0f, 0.0f, 0.0f, 1.0f);
+	glVertexAttrib2f(INSTANCE_YAW_ATTRIB, 0.0f, 0.0f);
+}
+
+// Point the instance attributes of the bound vertex array at buffer, starting at first_instance
+inline void setInstanceAttributes(GLuint buffer, unsigned int first_instance) {
+	GLintptr offset = (GLintptr)first_instance * sizeof(instancedata);
+	cachedBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(INSTANCE_POSITION_ATTRIB, 4, GL_FLOAT, GL_FALSE, sizeof(instancedata), (GLvoid*)offset);
+	glVertexAttribPointer(INSTANCE_YAW_ATTRIB, 2, GL_FLOAT, GL_FALSE, sizeof(instancedata), (GLvoid*)(offset + sizeof(glm::vec4)));
+	glVertexAttribDivisor(INSTANCE_POSITION_ATTRIB, 1);
+	glVertexAttribDivisor(INSTANCE_YAW_ATTRIB, 1);
+	glEnableVertexAttribArray(INSTANCE_POSITION_ATTRIB);
+	glEnableVertexAttribArray(INSTANCE_YAW_ATTRIB);
+	cachedBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draw instance_count copies starting at first_instance of the instance buffer
+// attached to the bound vertex array. Without GL_ARB_base_instance the
+// attributes are pointed at the first instance instead.
+inline void drawInstances(GLsizei index_count, unsigned int first_index, GLint base_vertex,
+	GLsizei instance_count, unsigned int first_instance, GLuint instance_buffer) {
+	const GLvoid *indexes = (const GLvoid*)(first_index * sizeof(unsigned int));
+	if (first_instance == 0) {
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, indexes, instance_count, base_vertex);
+	}
+	else if (GLEW_ARB_base_instance) {
+		glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, indexes, instance_count, base_vertex, first_instance);
+	}
+	else {
+		setInstanceAttributes(instance_buffer, first_instance);
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, indexes, instance_count, base_vertex);
+		setInstanceAttributes(instance_buffer, 0);
+	}
+}
+
+// Instance data rewritten every frame, orphaned so the upload never waits on the GPU
+struct instancebuffer {
+	GLuint buffer = 0;
+	GLsizeiptr capacity = 0;
+};
+
+inline void createInstanceBuffer(instancebuffer &ib) {
+	glGenBuffers(1, &ib.buffer);
+	ib.capacity = 0;
+}
+
+inline void destroyInstanceBuffer(instancebuffer &ib) {
+	cachedDeleteBuffers(1, &ib.buffer);
+	ib = instancebuffer();
+}
+
+inline void uploadInstances(instancebuffer &ib, const std::vector<instancedata> &instances) {
+	if (instances.empty()) return;
+	GLsizeiptr size = (GLsizeiptr)(instances.size() * sizeof(instancedata));
+	cachedBindBuffer(GL_ARRAY_BUFFER, ib.buffer);
+	ib.capacity = std::max(ib.capacity, size);
+	glBufferData(GL_ARRAY_BUFFER, ib.capacity, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, &instances[0]);
+}
+
+// count copies on a square grid centered on the origin, spacing apart. A single
+// copy sits at the origin unturned, more get a small random turn, size and wave phase.
+inline void layoutInstances(std::vector<instancedata> &instances, unsigned int count, float spacing) {
+	instances.clear();
+	instances.reserve(count);
+	unsigned int side = (unsigned int)ceil(sqrt((double)count));
+	float offset = 0.5f * spacing * float(side - 1);
+	unsigned int seed = 2463534242u;
+	for (unsigned int i = 0; i < count; ++i) {
+		glm::vec3 position(float(i % side) * spacing - offset, 0.0f, float(i / side) * spacing - offset);
+		if (count == 1) {
+			instances.push_back(makeInstance(position, 0.0f, 1.0f, 0.0f));
+			continue;
+		}
+		float r[3];
+		for (int k = 0; k < 3; ++k) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			r[k] = float(seed & 0xffffff) / float(0x1000000);
+		}
+		instances.push_back(makeInstance(position, (r[0] - 0.5f) * 0.6f, 0.8f + 0.4f * r[1], r[2] * 2.0f * float(M_PI)));
+	}
+}
+
+// Half the width of a grid made by layoutInstances
+inline float instanceLayoutExtent(unsigned int count, float spacing) {
+	unsigned int side = (unsigned int)ceil(sqrt((double)count));
+	return 0.5f * spacing * float(side);
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <algorithm>
+
+#include "trace.h"
+
+struct jobgraph;
+
+// A piece of work and the jobs that may only start once it has finished
+struct job {
+	std::function<void()> run;
+	std::atomic<int> waiting;
+	std::vector<unsigned int> next;
+	jobgraph *graph = NULL;
+};
+
+// Jobs and the order between them. The graph owns its jobs, it is run once
+// and must stay alive until runJobGraph returns.
+struct jobgraph {
+	std::deque<job> jobs;
+	std::atomic<int> remaining;
+};
+
+// Jobs queued by one thread: it pushes and pops at the back, so it carries on
+// with what it just made, while idle threads steal the oldest from the front
+struct jobqueue {
+	std::mutex lock;
+	std::deque<job*> jobs;
+};
+
+// Pool of thread_count - 1 workers, the thread that runs a graph helps with its
+// jobs until it is done. Queue 0 belongs to every thread outside the pool.
+struct jobsystem {
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<jobqueue> > queues;
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+	std::atomic<int> queued;
+	std::atomic<bool> running;
+	std::atomic<uint64_t> executed;
+	std::atomic<uint64_t> stolen;
+	unsigned int thread_count = 1;
+	~jobsystem();
+};
+
+// Queue of the calling thread, 0 outside any pool
+inline unsigned int &jobThreadIndex() {
+	static thread_local unsigned int index = 0;
+	return index;
+}
+
+inline void pushJob(jobsystem &js, job *j) {
+	unsigned int index = jobThreadIndex();
+	if (index >= js.queues.size()) index = 0;
+	js.queued++;
+	{
+		std::lock_guard<std::mutex> guard(js.queues[index]->lock);
+		js.queues[index]->jobs.push_back(j);
+	}
+	// Taking the lock orders the count before a worker checks it and goes to sleep
+	{
+		std::lock_guard<std::mutex> guard(js.sleep_lock);
+	}
+	js.wake.notify_one();
+}
+
+// Index of the newest job in a queue that belongs to graph, any graph if it is NULL
+inline size_t newestJob(const std::deque<job*> &jobs, const jobgraph *graph) {
+	for (size_t i = jobs.size(); i > 0; --i) {
+		if (graph == NULL || jobs[i - 1]->graph == graph) return i - 1;
+	}
+	return jobs.size();
+}
+
+// Index of the oldest job in a queue that belongs to graph, any graph if it is NULL
+inline size_t oldestJob(const std::deque<job*> &jobs, const jobgraph *graph) {
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		if (graph == NULL || jobs[i]->graph == graph) return i;
+	}
+	return jobs.size();
+}
+
+// The newest job of the calling thread, otherwise the oldest of another thread.
+// A thread waiting for a graph only takes that graph's jobs, so it cannot pick up
+// a long job of some other graph, such as a startup build, and be late itself.
+inline job *takeJob(jobsystem &js, const jobgraph *graph = NULL) {
+	unsigned int index = jobThreadIndex();
+	if (index >= js.queues.size()) index = 0;
+	job *j = NULL;
+	{
+		jobqueue &own = *js.queues[index];
+		std::lock_guard<std::mutex> guard(own.lock);
+		size_t i = newestJob(own.jobs, graph);
+		if (i < own.jobs.size()) {
+			j = own.jobs[i];
+			own.jobs.erase(own.jobs.begin() + i);
+		}
+	}
+	for (size_t k = 1; j == NULL && k < js.queues.size(); ++k) {
+		jobqueue &other = *js.queues[(index + k) % js.queues.size()];
+		std::lock_guard<std::mutex> guard(other.lock);
+		size_t i = oldestJob(other.jobs, graph);
+		if (i < other.jobs.size()) {
+			j = other.jobs[i];
+			other.jobs.erase(other.jobs.begin() + i);
+			js.stolen++;
+		}
+	}
+	if (j != NULL) js.queued--;
+	return j;
+}
+
+// Run a job and queue the jobs that were only waiting for it
+inline void runJob(jobsystem &js, job *j) {
+	{
+		TRACE_ZONE("job");
+		j->run();
+	}
+	js.executed++;
+	jobgraph &graph = *j->graph;
+	for (size_t n = 0; n < j->next.size(); ++n) {
+		job *after = &graph.jobs[j->next[n]];
+		if (--after->waiting == 0) pushJob(js, after);
+	}
+	graph.remaining--;
+}
+
+inline void jobWorker(jobsystem *js, unsigned int index) {
+	jobThreadIndex() = index;
+	traceThreadName("job worker");
+	while (js->running) {
+		job *j = takeJob(*js);
+		if (j != NULL) {
+			runJob(*js, j);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(js->sleep_lock);
+		js->wake.wait(guard, [js] { return js->queued > 0 || !js->running; });
+	}
+}
+
+// threads counts the calling thread, 0 for one per hardware thread
+inline void createJobSystem(jobsystem &js, unsigned int threads = 0) {
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	js.thread_count = threads;
+	js.queued = 0;
+	js.running = true;
+	js.executed = 0;
+	js.stolen = 0;
+	js.queues.clear();
+	for (unsigned int i = 0; i < threads; ++i) js.queues.push_back(std::unique_ptr<jobqueue>(new jobqueue));
+	for (unsigned int i = 1; i < threads; ++i) js.workers.push_back(std::thread(jobWorker, &js, i));
+}
+
+inline void destroyJobSystem(jobsystem &js) {
+	{
+		std::lock_guard<std::mutex> guard(js.sleep_lock);
+		js.running = false;
+	}
+	js.wake.notify_all();
+	for (size_t i = 0; i < js.workers.size(); ++i) js.workers[i].join();
+	js.workers.clear();
+	js.queues.clear();
+	js.thread_count = 1;
+}
+
+// Workers are joined on destruction too, so an early return does not leave them running
+inline jobsystem::~jobsystem() {
+	destroyJobSystem(*this);
+}
+
+// Append a job to a graph, returns its index for addJobDependency
+inline unsigned int addJob(jobgraph &graph, std::function<void()> run) {
+	graph.jobs.emplace_back();
+	job &j = graph.jobs.back();
+	j.run = run;
+	j.waiting = 0;
+	j.graph = &graph;
+	return (unsigned int)graph.jobs.size() - 1;
+}
+
+// after starts once before has finished
+inline void addJobDependency(jobgraph &graph, unsigned int before, unsigned int after) {
+	graph.jobs[before].next.push_back(after);
+	graph.jobs[after].waiting++;
+}
+
+// Queue every job without dependencies and run the graph's jobs until all of
+// them have finished. Without a job system the graph runs on the calling thread.
+inline void runJobGraph(jobsystem *js, jobgraph &graph) {
+	graph.remaining = (int)graph.jobs.size();
+	std::vector<unsigned int> ready;
+	for (size_t i = 0; i < graph.jobs.size(); ++i) {
+		if (graph.jobs[i].waiting == 0) ready.push_back((unsigned int)i);
+	}
+	if (js == NULL || js->thread_count == 1) {
+		for (size_t r = 0; r < ready.size(); ++r) {
+			job &j = graph.jobs[ready[r]];
+			j.run();
+			if (js != NULL) js->executed++;
+			for (size_t n = 0; n < j.next.size(); ++n) {
+				if (--graph.jobs[j.next[n]].waiting == 0) ready.push_back(j.next[n]);
+			}
+			graph.remaining--;
+		}
+		return;
+	}
+
+	// The roots are known before any of them runs, a job queued by a finished one must not be queued again
+	for (size_t r = 0; r < ready.size(); ++r) pushJob(*js, &graph.jobs[ready[r]]);
+	while (graph.remaining > 0) {
+		job *j = takeJob(*js, &graph);
+		if (j != NULL) runJob(*js, j);
+		else std::this_thread::yield();
+	}
+}
+
+// Call body over begin..end split into ranges of at least min_count, as a few
+// ranges per thread so a slow one can be made up for by stealing the rest
+inline void parallelFor(jobsystem *js, size_t begin, size_t end, size_t min_count,
+	const std::function<void(size_t, size_t)> &body) {
+	if (end <= begin) return;
+	size_t count = end - begin;
+	size_t threads = js != NULL ? js->thread_count : 1;
+	size_t ranges = std::max<size_t>(1, std::min(threads * 4, count / std::max<size_t>(1, min_count)));
+	if (ranges == 1 || threads == 1) {
+		body(begin, end);
+		return;
+	}
+
+	jobgraph graph;
+	size_t size = (count + ranges - 1) / ranges;
+	for (size_t first = begin; first < end; first += size) {
+		size_t last = std::min(end, first + size);
+		addJob(graph, [&body, first, last] { body(first, last); });
+	}
+	runJobGraph(js, graph);
+}
+
+// Random graphs on 1 to 4 threads: every job runs once, after all of its
+// dependencies, and the parallelFor inside some of them covers its range once
+inline int testJobSystem(int iterations) {
+	int failures = 0;
+	for (unsigned int threads = 1; threads <= 4; ++threads) {
+		jobsystem js;
+		createJobSystem(js, threads);
+		unsigned int seed = 12345u + threads;
+		int bad_graphs = 0;
+		for (int it = 0; it < iterations; ++it) {
+			seed = seed * 1664525u + 1013904223u;
+			unsigned int count = 1 + (seed >> 8) % 64;
+			std::vector<std::atomic<int> > runs(count);
+			std::vector<std::atomic<int> > finished(count);
+			std::vector<std::vector<unsigned int> > before(count);
+			std::atomic<int> clock(0);
+			std::atomic<int> late(0);
+			std::atomic<int> wrong_sums(0);
+			jobgraph graph;
+			for (unsigned int i = 0; i < count; ++i) {
+				runs[i] = 0;
+				finished[i] = -1;
+				addJob(graph, [&, i] {
+					runs[i]++;
+					for (size_t b = 0; b < before[i].size(); ++b) {
+						if (finished[before[i][b]] < 0) late++;
+					}
+					if (i % 3 == 0) {
+						std::atomic<uint64_t> sum(0);
+						parallelFor(&js, 0, 1000, 16, [&sum](size_t begin, size_t end) {
+							uint64_t part = 0;
+							for (size_t k = begin; k < end; ++k) part += k;
+							sum += part;
+						});
+						if (sum != 999u * 1000u / 2u) wrong_sums++;
+					}
+					finished[i] = clock++;
+				});
+			}
+			// Edges only go forward, so the graph has no cycles
+			for (unsigned int i = 1; i < count; ++i) {
+				seed = seed * 1664525u + 1013904223u;
+				unsigned int edges = (seed >> 8) % 4;
+				for (unsigned int e = 0; e < edges; ++e) {
+					seed = seed * 1664525u + 1013904223u;
+					unsigned int from = (seed >> 8) % i;
+					addJobDependency(graph, from, i);
+					before[i].push_back(from);
+				}
+			}
+			runJobGraph(&js, graph);
+
+			bool ok = late == 0 && wrong_sums == 0 && graph.remaining == 0;
+			for (unsigned int i = 0; i < count; ++i) {
+				if (runs[i] != 1) ok = false;
+			}
+			if (!ok) ++bad_graphs;
+		}
+		printf("jobs: %u threads, %d graphs, %llu jobs run, %llu stolen, %d wrong %s\n", threads, iterations,
+			(unsigned long long)js.executed, (unsigned long long)js.stolen, bad_graphs, bad_graphs == 0 ? "ok" : "FAILED");
+		if (bad_graphs != 0) ++failures;
+		destroyJobSystem(js);
+	}
+	return failures == 0 ? 0 : -1;
+}
+
+#endif
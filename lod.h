@@ -0,0 +1,188 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "meshgen.h"
+#include "meshopt.h"
+#include "geometryarena.h"
+
+// Largest geometric error, in pixels, a level may show on screen
+#define LOD_PIXEL_ERROR 1.0f
+// A coarser level is only taken once its error is this much below the limit,
+// so objects near a switching distance do not flip between levels every frame
+#define LOD_HYSTERESIS 0.25f
+
+// Index range of one tessellation level inside the mesh's element buffer
+struct lodlevel {
+	unsigned int first_index = 0;
+	unsigned int index_count = 0;
+	float error = 0.0f;	// largest distance to the full detail surface, world units
+};
+
+// Levels from finest to coarsest, a bounding sphere for the distance and a box for culling
+struct lodmesh {
+	std::vector<lodlevel> levels;
+	glm::vec3 center = glm::vec3(0.0f);
+	float radius = 0.0f;
+	glm::vec3 low = glm::vec3(0.0f);
+	glm::vec3 high = glm::vec3(0.0f);
+};
+
+// Weld a level and optimize it for the vertex cache on its own, levels can be prepared in parallel
+inline void optimizeLodLevel(std::vector<glm::vec3> &level_vertices, std::vector<unsigned int> &level_indexes) {
+	weldVertices(level_vertices, level_indexes);
+	optimizeVertexCache(level_indexes, level_vertices.size() / 2);
+	optimizeVertexFetch(level_vertices, level_indexes);
+}
+
+// Append a level prepared by optimizeLodLevel
+inline void appendLodLevel(lodmesh &mesh, std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indexes,
+	const std::vector<glm::vec3> &level_vertices, const std::vector<unsigned int> &level_indexes, float error) {
+	unsigned int base = (unsigned int)(vertices.size() / 2);
+	lodlevel level;
+	level.first_index = (unsigned int)indexes.size();
+	level.index_count = (unsigned int)level_indexes.size();
+	level.error = error;
+	for (size_t i = 0; i < level_indexes.size(); ++i) indexes.push_back(base + level_indexes[i]);
+	vertices.insert(vertices.end(), level_vertices.begin(), level_vertices.end());
+	mesh.levels.push_back(level);
+}
+
+// Append a level that indexes vertices already in the buffer
+inline void addLodIndexes(lodmesh &mesh, std::vector<unsigned int> &indexes, const std::vector<unsigned int> &level_indexes, float error) {
+	lodlevel level;
+	level.first_index = (unsigned int)indexes.size();
+	level.index_count = (unsigned int)level_indexes.size();
+	level.error = error;
+	indexes.insert(indexes.end(), level_indexes.begin(), level_indexes.end());
+	mesh.levels.push_back(level);
+}
+
+// Bounding box and sphere of interleaved position/color vertices, grown by margin
+inline void boundLodMesh(lodmesh &mesh, const glm::vec3 *vertices, size_t vertex_count, float margin) {
+	if (vertex_count == 0) return;
+	glm::vec3 low = vertices[0], high = vertices[0];
+	for (size_t v = 1; v < vertex_count; ++v) {
+		low = glm::min(low, vertices[2 * v]);
+		high = glm::max(high, vertices[2 * v]);
+	}
+	mesh.center = (low + high) * 0.5f;
+	mesh.low = low - margin;
+	mesh.high = high + margin;
+
+	// Around the box center, usually much tighter than half the diagonal
+	float radius = 0.0f;
+	for (size_t v = 0; v < vertex_count; ++v) radius = std::max(radius, glm::distance(vertices[2 * v], mesh.center));
+	mesh.radius = radius + margin;
+}
+
+// Largest distance from a circle to the chords of a regular polygon on it
+inline float chordError(float radius, unsigned int segments) {
+	return radius * (1.0f - cosf(float(M_PI) / float(segments)));
+}
+
+inline float cylinderError(float radius, unsigned int segments) {
+	return chordError(radius, segments);
+}
+
+inline float sphereError(float radius, unsigned int sectors, unsigned int stacks) {
+	return std::max(chordError(radius, sectors), chordError(radius, stacks * 2));
+}
+
+// Pixels per world unit at distance 1
+inline float lodProjectionScale(float fovy, float viewport_height) {
+	return viewport_height / (2.0f * tanf(fovy * 0.5f));
+}
+
+// Distance from the camera to the nearest point of the bounding sphere
+inline float lodDistance(const lodmesh &mesh, glm::vec3 camera) {
+	return std::max(glm::length(camera - mesh.center) - mesh.radius, 1e-3f);
+}
+
+inline float lodScreenError(const lodmesh &mesh, unsigned int level, float distance, float projection_scale) {
+	return mesh.levels[level].error * projection_scale / distance;
+}
+
+// Coarsest level within the pixel error, starting from the level used last frame
+inline unsigned int selectLod(const lodmesh &mesh, unsigned int current, float distance, float projection_scale) {
+	if (mesh.levels.empty()) return 0;
+	unsigned int last = (unsigned int)mesh.levels.size() - 1;
+	current = std::min(current, last);
+
+	// Too coarse now, refine right away
+	while (current > 0 && lodScreenError(mesh, current, distance, projection_scale) > LOD_PIXEL_ERROR) --current;
+
+	// Coarsen only with some margin below the limit
+	while (current < last && lodScreenError(mesh, current + 1, distance, projection_scale) <= LOD_PIXEL_ERROR * (1.0f - LOD_HYSTERESIS)) ++current;
+
+	return current;
+}
+
+// Distance from the camera to the bounding sphere of one copy, divided by its
+// scale so the level error can stay in the mesh's own units
+inline float lodInstanceDistance(const lodmesh &mesh, const instancedata &instance, glm::vec3 camera) {
+	float scale = instance.position_scale.w;
+	float distance = glm::length(camera - instancePoint(instance, mesh.center)) - mesh.radius * scale;
+	return std::max(distance / scale, 1e-3f);
+}
+
+// Copies of a mesh drawn at the same level, a range of the instance buffer
+struct lodbatch {
+	unsigned int level;
+	unsigned int first_instance;
+	unsigned int instance_count;
+};
+
+// Pick the level of every visible copy, starting from its level last frame kept in
+// levels, and append the copies to staging grouped by level, one batch per level used
+inline void batchLodInstances(const lodmesh &mesh, const std::vector<instancedata> &instances, const std::vector<unsigned int> &visible,
+	std::vector<unsigned char> &levels, glm::vec3 camera, float projection_scale, std::vector<instancedata> &staging, std::vector<lodbatch> &batches) {
+	batches.clear();
+	levels.resize(instances.size(), 0);
+	std::vector<unsigned int> counts(mesh.levels.size(), 0);
+	for (size_t v = 0; v < visible.size(); ++v) {
+		unsigned int i = visible[v];
+		levels[i] = (unsigned char)selectLod(mesh, levels[i], lodInstanceDistance(mesh, instances[i], camera), projection_scale);
+		counts[levels[i]]++;
+	}
+
+	// Counting sort by level straight into the staging area
+	size_t base = staging.size();
+	staging.resize(base + visible.size());
+	std::vector<unsigned int> offsets(counts.size(), 0);
+	unsigned int first = (unsigned int)base;
+	for (size_t level = 0; level < counts.size(); ++level) {
+		offsets[level] = first;
+		if (counts[level] > 0) {
+			lodbatch batch = { (unsigned int)level, first, counts[level] };
+			batches.push_back(batch);
+		}
+		first += counts[level];
+	}
+	for (size_t v = 0; v < visible.size(); ++v) staging[offsets[levels[visible[v]]]++] = instances[visible[v]];
+}
+
+// Queue every batch of a mesh stored in the arena
+inline void addArenaLodBatches(geometryarena &arena, unsigned int handle, const lodmesh &mesh, const std::vector<lodbatch> &batches) {
+	for (size_t b = 0; b < batches.size(); ++b) {
+		const lodlevel &l = mesh.levels[batches[b].level];
+		addArenaInstances(arena, handle, l.first_index, l.index_count, batches[b].first_instance, batches[b].instance_count);
+	}
+}
+
+inline void printLodMesh(const char *name, const lodmesh &mesh) {
+	printf("LOD %s:", name);
+	for (size_t i = 0; i < mesh.levels.size(); ++i) {
+		printf(" %u", mesh.levels[i].index_count / 3);
+	}
+	printf(" triangles\n");
+}
+
+#endif
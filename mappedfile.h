@@ -0,0 +1,107 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file
+struct mappedfile {
+	const char *data = NULL;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// Close a mapping opened with mapFile
+inline void unmapFile(mappedfile &mf) {
+#ifdef _WIN32
+	if (mf.data != NULL) UnmapViewOfFile(mf.data);
+	if (mf.mapping != NULL) CloseHandle(mf.mapping);
+	if (mf.file != INVALID_HANDLE_VALUE) CloseHandle(mf.file);
+	mf.mapping = NULL;
+	mf.file = INVALID_HANDLE_VALUE;
+#else
+	if (mf.data != NULL && mf.size > 0) munmap((void*)mf.data, mf.size);
+	if (mf.fd >= 0) close(mf.fd);
+	mf.fd = -1;
+#endif
+	mf.data = NULL;
+	mf.size = 0;
+}
+
+// Map a file into memory, an empty file maps to a NULL pointer with size 0
+inline bool mapFile(const char *filename, mappedfile &mf) {
+	unmapFile(mf);
+
+#ifdef _WIN32
+	// Open File
+	mf.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (mf.file == INVALID_HANDLE_VALUE) return false;
+
+	// Calculate Size
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mf.file, &size)) {
+		unmapFile(mf);
+		return false;
+	}
+	mf.size = (size_t)size.QuadPart;
+	if (mf.size == 0) return true;
+
+	// Map the whole file
+	mf.mapping = CreateFileMappingA(mf.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mf.mapping == NULL) {
+		unmapFile(mf);
+		return false;
+	}
+	mf.data = (const char*)MapViewOfFile(mf.mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	// Open File
+	mf.fd = open(filename, O_RDONLY);
+	if (mf.fd < 0) return false;
+
+	// Calculate Size
+	struct stat st;
+	if (fstat(mf.fd, &st) != 0) {
+		unmapFile(mf);
+		return false;
+	}
+	mf.size = (size_t)st.st_size;
+	if (mf.size == 0) return true;
+
+	// Map the whole file
+	void *data = mmap(NULL, mf.size, PROT_READ, MAP_PRIVATE, mf.fd, 0);
+	if (data == MAP_FAILED) {
+		mf.size = 0;
+		unmapFile(mf);
+		return false;
+	}
+	mf.data = (const char*)data;
+
+	// We read front to back
+	madvise(data, mf.size, MADV_SEQUENTIAL);
+#endif
+
+	if (mf.data == NULL) {
+		unmapFile(mf);
+		return false;
+	}
+	return true;
+}
+
+#endif
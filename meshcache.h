@@ -0,0 +1,247 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <glm/glm.hpp>
+
+#include "mappedfile.h"
+
+// Bump whenever the layout below, the loader output or the simplification changes
+#define MESHCACHE_VERSION 4
+
+// Header flag: the simplified levels were made, lod_count is 0 if none was worth keeping
+#define MESHCACHE_SIMPLIFIED 1
+
+// A simplified level stored after the mesh, its indexes follow those of the level before
+struct meshcachelod {
+	uint32_t index_count;
+	float error;
+};
+
+// On-disk layout: header, source path, interleaved vec3 position/color block, index block,
+// then the simplified levels and their indexes if any. Blocks start on 16 byte boundaries.
+struct meshcacheheader {
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t path_length;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t vertex_offset;
+	uint64_t vertex_count;
+	uint64_t index_offset;
+	uint64_t index_count;
+	uint64_t lod_offset;
+	uint64_t lod_count;
+	uint64_t lod_index_offset;
+	uint64_t lod_index_count;
+	uint64_t flags;
+};
+
+// Mesh either pointing into a mapped cache file or owning its data
+struct cachedmesh {
+	const glm::vec3 *vertices = NULL;
+	size_t vertex_count = 0;
+	const unsigned int *indexes = NULL;
+	size_t index_count = 0;
+
+	// Simplified levels found in the cache, they still have to be made unless simplified is set
+	const meshcachelod *lods = NULL;
+	size_t lod_count = 0;
+	const unsigned int *lod_indexes = NULL;
+	size_t lod_index_count = 0;
+	bool simplified = false;
+
+	// true if the data came from the cache file
+	bool warm = false;
+	// Source file the cache belongs to
+	std::string source;
+
+	mappedfile file;
+	std::vector<glm::vec3> owned_vertices;
+	std::vector<unsigned int> owned_indexes;
+};
+
+inline uint64_t meshCacheAlign(uint64_t offset) {
+	return (offset + 15) & ~(uint64_t)15;
+}
+
+// true if count elements of element_size bytes starting at offset lie inside a file of size bytes,
+// written so that no term can wrap around
+inline bool meshCacheSectionFits(uint64_t offset, uint64_t count, uint64_t element_size, uint64_t size) {
+	return offset % 16 == 0 && offset <= size && count <= (size - offset) / element_size;
+}
+
+// true if every index refers to one of vertex_count vertices
+inline bool meshCacheIndexesFit(const unsigned int *indexes, size_t index_count, size_t vertex_count) {
+	for (size_t i = 0; i < index_count; ++i) {
+		if (indexes[i] >= vertex_count) return false;
+	}
+	return true;
+}
+
+// Cache file for a source file
+inline std::string meshCachePath(const char *source) {
+	return std::string(source) + ".meshcache";
+}
+
+// Size and modification time of a file
+inline bool getFileStamp(const char *path, uint64_t &size, int64_t &mtime) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(path, &st) != 0) return false;
+#else
+	struct stat st;
+	if (stat(path, &st) != 0) return false;
+#endif
+	size = (uint64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+// Map a cache file and check it belongs to the current version of source
+inline bool openMeshCache(const char *source, cachedmesh &mesh) {
+	uint64_t size;
+	int64_t mtime;
+	if (!getFileStamp(source, size, mtime)) return false;
+
+	std::string path = meshCachePath(source);
+	if (!mapFile(path.c_str(), mesh.file)) return false;
+
+	const meshcacheheader *header = (const meshcacheheader*)mesh.file.data;
+	size_t length = strlen(source);
+	bool valid = mesh.file.size >= sizeof(meshcacheheader) &&
+		memcmp(header->magic, "SSMC", 4) == 0 &&
+		header->version == MESHCACHE_VERSION &&
+		header->byte_order == 0x01020304 &&
+		header->source_size == size &&
+		header->source_mtime == mtime &&
+		header->path_length == length &&
+		sizeof(meshcacheheader) + length <= mesh.file.size &&
+		memcmp(mesh.file.data + sizeof(meshcacheheader), source, length) == 0 &&
+		meshCacheSectionFits(header->vertex_offset, header->vertex_count, sizeof(glm::vec3), mesh.file.size) &&
+		meshCacheSectionFits(header->index_offset, header->index_count, sizeof(unsigned int), mesh.file.size) &&
+		meshCacheSectionFits(header->lod_offset, header->lod_count, sizeof(meshcachelod), mesh.file.size) &&
+		meshCacheSectionFits(header->lod_index_offset, header->lod_index_count, sizeof(unsigned int), mesh.file.size) &&
+		header->vertex_count % 2 == 0;
+
+	// Every index must land on a vertex, the block holds a position and a color for each
+	valid = valid &&
+		meshCacheIndexesFit((const unsigned int*)(mesh.file.data + header->index_offset), (size_t)header->index_count, (size_t)header->vertex_count / 2) &&
+		meshCacheIndexesFit((const unsigned int*)(mesh.file.data + header->lod_index_offset), (size_t)header->lod_index_count, (size_t)header->vertex_count / 2);
+
+	if (!valid) {
+		unmapFile(mesh.file);
+		return false;
+	}
+
+	mesh.vertices = (const glm::vec3*)(mesh.file.data + header->vertex_offset);
+	mesh.vertex_count = (size_t)header->vertex_count;
+	mesh.indexes = (const unsigned int*)(mesh.file.data + header->index_offset);
+	mesh.index_count = (size_t)header->index_count;
+	mesh.lods = header->lod_count > 0 ? (const meshcachelod*)(mesh.file.data + header->lod_offset) : NULL;
+	mesh.lod_count = (size_t)header->lod_count;
+	mesh.lod_indexes = header->lod_index_count > 0 ? (const unsigned int*)(mesh.file.data + header->lod_index_offset) : NULL;
+	mesh.lod_index_count = (size_t)header->lod_index_count;
+	mesh.simplified = (header->flags & MESHCACHE_SIMPLIFIED) != 0;
+	size_t lod_indexes = 0;
+	for (size_t l = 0; l < mesh.lod_count; ++l) lod_indexes += mesh.lods[l].index_count;
+	if (lod_indexes != mesh.lod_index_count) {
+		mesh.lods = NULL;
+		mesh.lod_count = 0;
+		mesh.lod_indexes = NULL;
+		mesh.lod_index_count = 0;
+		mesh.simplified = false;
+	}
+	mesh.source = source;
+	mesh.warm = true;
+	return true;
+}
+
+// Write the cache file for source, through a temporary file so readers never see half a cache.
+// The simplified levels are optional, lod_indexes holds the indexes of every level in turn.
+// simplified records that they were made, even when there are none.
+inline bool writeMeshCache(const char *source, const glm::vec3 *vertices, size_t vertex_count, const unsigned int *indexes, size_t index_count,
+	const meshcachelod *lods = NULL, size_t lod_count = 0, const unsigned int *lod_indexes = NULL, size_t lod_index_count = 0,
+	bool simplified = false) {
+	meshcacheheader header;
+	memset(&header, 0, sizeof(header));
+	if (!getFileStamp(source, header.source_size, header.source_mtime)) return false;
+
+	memcpy(header.magic, "SSMC", 4);
+	header.version = MESHCACHE_VERSION;
+	header.byte_order = 0x01020304;
+	header.path_length = (uint32_t)strlen(source);
+	header.vertex_offset = meshCacheAlign(sizeof(header) + header.path_length);
+	header.vertex_count = vertex_count;
+	header.index_offset = meshCacheAlign(header.vertex_offset + vertex_count * sizeof(glm::vec3));
+	header.index_count = index_count;
+	header.lod_offset = meshCacheAlign(header.index_offset + index_count * sizeof(unsigned int));
+	header.lod_count = lod_count;
+	header.lod_index_offset = meshCacheAlign(header.lod_offset + lod_count * sizeof(meshcachelod));
+	header.lod_index_count = lod_index_count;
+	header.flags = simplified ? MESHCACHE_SIMPLIFIED : 0;
+
+	std::string path = meshCachePath(source);
+	std::string temp = path + ".tmp";
+	FILE *file = fopen(temp.c_str(), "wb");
+	if (file == NULL) return false;
+
+	static const char padding[16] = { 0 };
+	size_t path_padding = (size_t)(header.vertex_offset - sizeof(header) - header.path_length);
+	size_t vertex_padding = (size_t)(header.index_offset - header.vertex_offset - vertex_count * sizeof(glm::vec3));
+	size_t index_padding = (size_t)(header.lod_offset - header.index_offset - index_count * sizeof(unsigned int));
+	size_t lod_padding = (size_t)(header.lod_index_offset - header.lod_offset - lod_count * sizeof(meshcachelod));
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(source, 1, header.path_length, file) == header.path_length &&
+		fwrite(padding, 1, path_padding, file) == path_padding &&
+		fwrite(vertices, sizeof(glm::vec3), vertex_count, file) == vertex_count &&
+		fwrite(padding, 1, vertex_padding, file) == vertex_padding &&
+		fwrite(indexes, sizeof(unsigned int), index_count, file) == index_count &&
+		fwrite(padding, 1, index_padding, file) == index_padding &&
+		fwrite(lods, sizeof(meshcachelod), lod_count, file) == lod_count &&
+		fwrite(padding, 1, lod_padding, file) == lod_padding &&
+		fwrite(lod_indexes, sizeof(unsigned int), lod_index_count, file) == lod_index_count;
+	ok = (fclose(file) == 0) && ok;
+
+	// rename does not replace an existing file on Windows
+	remove(path.c_str());
+	if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Point mesh at its own vectors
+inline void useOwnedMesh(cachedmesh &mesh) {
+	mesh.vertices = mesh.owned_vertices.empty() ? NULL : &mesh.owned_vertices[0];
+	mesh.vertex_count = mesh.owned_vertices.size();
+	mesh.indexes = mesh.owned_indexes.empty() ? NULL : &mesh.owned_indexes[0];
+	mesh.index_count = mesh.owned_indexes.size();
+}
+
+inline void releaseMesh(cachedmesh &mesh) {
+	unmapFile(mesh.file);
+	std::vector<glm::vec3>().swap(mesh.owned_vertices);
+	std::vector<unsigned int>().swap(mesh.owned_indexes);
+	mesh.vertices = NULL;
+	mesh.indexes = NULL;
+	mesh.vertex_count = 0;
+	mesh.index_count = 0;
+	mesh.lods = NULL;
+	mesh.lod_count = 0;
+	mesh.lod_indexes = NULL;
+	mesh.lod_index_count = 0;
+	mesh.simplified = false;
+	mesh.warm = false;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef MESHGEN_H
+#define MESHGEN_H
+
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Generators append to interleaved position/color vec3 pairs plus a triangle list,
+// the same layout meshopt.h works on. Vertices on a ring are shared by every
+// triangle around them.
+
+// Fewest sectors and stacks that still close a sphere, smaller counts are raised to these
+#define SPHERE_MIN_SECTORS 3u
+#define SPHERE_MIN_STACKS 2u
+
+// Number of vertices and indexes a generator appends
+struct meshcounts {
+	size_t vertices = 0;
+	size_t indexes = 0;
+};
+
+inline meshcounts planeCounts(unsigned int columns, unsigned int rows) {
+	meshcounts counts;
+	counts.vertices = (size_t)(columns + 1) * (rows + 1);
+	counts.indexes = (size_t)columns * rows * 6;
+	return counts;
+}
+
+inline meshcounts cylinderCounts(unsigned int segments, bool capped) {
+	meshcounts counts;
+	counts.vertices = (size_t)segments * 2 + (capped ? 2 : 0);
+	counts.indexes = (size_t)segments * (capped ? 12 : 6);
+	return counts;
+}
+
+inline meshcounts sphereCounts(unsigned int sectors, unsigned int stacks) {
+	sectors = std::max(sectors, SPHERE_MIN_SECTORS);
+	stacks = std::max(stacks, SPHERE_MIN_STACKS);
+	meshcounts counts;
+	counts.vertices = 2 + (size_t)(stacks - 1) * sectors;
+	counts.indexes = (size_t)sectors * 6 + (size_t)(stacks - 2) * sectors * 6;
+	return counts;
+}
+
+// Grow the buffers once for everything about to be generated
+inline void reserveMesh(std::vector<glm::vec3> &out_vertices, std::vector<unsigned int> &out_indexes, meshcounts counts) {
+	out_vertices.reserve(out_vertices.size() + counts.vertices * 2);
+	out_indexes.reserve(out_indexes.size() + counts.indexes);
+}
+
+// sin and cos of 2 * pi * i / segments for i in [0, segments)
+struct trigtable {
+	std::vector<float> sin;
+	std::vector<float> cos;
+};
+
+// Tables are computed once per segment count and live until exit
+inline const trigtable &getTrigTable(unsigned int segments) {
+	static std::mutex lock;
+	static std::map<unsigned int, trigtable> tables;
+
+	std::lock_guard<std::mutex> guard(lock);
+	std::map<unsigned int, trigtable>::iterator found = tables.find(segments);
+	if (found != tables.end()) return found->second;
+
+	trigtable &table = tables[segments];
+	table.sin.resize(segments);
+	table.cos.resize(segments);
+	for (unsigned int i = 0; i < segments; ++i) {
+		double angle = 2.0 * M_PI * i / segments;
+		table.sin[i] = (float)sin(angle);
+		table.cos[i] = (float)cos(angle);
+	}
+	return table;
+}
+
+inline unsigned int meshBaseVertex(const std::vector<glm::vec3> &out_vertices) {
+	return (unsigned int)(out_vertices.size() / 2);
+}
+
+inline void pushVertex(std::vector<glm::vec3> &out_vertices, glm::vec3 position, glm::vec3 color) {
+	out_vertices.push_back(position);
+	out_vertices.push_back(color);
+}
+
+inline void pushTriangle(std::vector<unsigned int> &out_indexes, unsigned int a, unsigned int b, unsigned int c) {
+	out_indexes.push_back(a);
+	out_indexes.push_back(b);
+	out_indexes.push_back(c);
+}
+
+// Horizontal plane at center.y, columns x rows quads
+inline void generatePlane(std::vector<glm::vec3> &out_vertices, std::vector<unsigned int> &out_indexes,
+	glm::vec3 center, float width, float depth, unsigned int columns, unsigned int rows, glm::vec3 color) {
+	unsigned int base = meshBaseVertex(out_vertices);
+
+	for (unsigned int row = 0; row <= rows; ++row) {
+		float z = center.z - depth * 0.5f + depth * row / rows;
+		for (unsigned int column = 0; column <= columns; ++column) {
+			float x = center.x - width * 0.5f + width * column / columns;
+			pushVertex(out_vertices, glm::vec3(x, center.y, z), color);
+		}
+	}
+
+	for (unsigned int row = 0; row < rows; ++row) {
+		unsigned int k1 = base + row * (columns + 1);
+		unsigned int k2 = k1 + columns + 1;
+		for (unsigned int column = 0; column < columns; ++column, ++k1, ++k2) {
+			pushTriangle(out_indexes, k1, k2, k1 + 1);
+			pushTriangle(out_indexes, k1 + 1, k2, k2 + 1);
+		}
+	}
+}
+
+// Vertical cylinder around center.x/center.z from bottom to top, capped closes both ends
+inline void generateCylinder(std::vector<glm::vec3> &out_vertices, std::vector<unsigned int> &out_indexes,
+	glm::vec3 center, float radius, float bottom, float top, unsigned int segments, bool capped, glm::vec3 color) {
+	const trigtable &trig = getTrigTable(segments);
+	unsigned int base = meshBaseVertex(out_vertices);
+
+	// Top and bottom vertex of each segment edge
+	for (unsigned int n = 0; n < segments; ++n) {
+		float x = center.x + trig.sin[n] * radius;
+		float z = center.z + trig.cos[n] * radius;
+		pushVertex(out_vertices, glm::vec3(x, top, z), color);
+		pushVertex(out_vertices, glm::vec3(x, bottom, z), color);
+	}
+
+	for (unsigned int n = 0; n < segments; ++n) {
+		unsigned int t0 = base + 2 * n, b0 = t0 + 1;
+		unsigned int t1 = base + 2 * ((n + 1) % segments), b1 = t1 + 1;
+		pushTriangle(out_indexes, t0, b0, t1);
+		pushTriangle(out_indexes, b0, t1, b1);
+	}
+
+	if (capped) {
+		unsigned int top_center = meshBaseVertex(out_vertices);
+		pushVertex(out_vertices, glm::vec3(center.x, top, center.z), color);
+		pushVertex(out_vertices, glm::vec3(center.x, bottom, center.z), color);
+
+		for (unsigned int n = 0; n < segments; ++n) {
+			unsigned int t0 = base + 2 * n;
+			unsigned int t1 = base + 2 * ((n + 1) % segments);
+			pushTriangle(out_indexes, top_center, t0, t1);
+			pushTriangle(out_indexes, top_center + 1, t1 + 1, t0 + 1);
+		}
+	}
+}
+
+// UV sphere with its poles on the z axis and a single vertex at each pole
+inline void generateSphere(std::vector<glm::vec3> &out_vertices, std::vector<unsigned int> &out_indexes,
+	glm::vec3 center, float radius, unsigned int sectors, unsigned int stacks, glm::vec3 color) {
+	sectors = std::max(sectors, SPHERE_MIN_SECTORS);
+	stacks = std::max(stacks, SPHERE_MIN_STACKS);
+	const trigtable &sector = getTrigTable(sectors);
+	// Stacks run over half a circle, so take every other entry of the full circle table
+	const trigtable &stack = getTrigTable(stacks * 2);
+	unsigned int base = meshBaseVertex(out_vertices);
+
+	pushVertex(out_vertices, glm::vec3(center.x, center.y, center.z + radius), color);
+	for (unsigned int i = 1; i < stacks; ++i) {
+		// From pi/2 down to -pi/2: cos(pi/2 - a) = sin(a), sin(pi/2 - a) = cos(a)
+		float xy = radius * stack.sin[i];
+		float z = center.z + radius * stack.cos[i];
+		for (unsigned int j = 0; j < sectors; ++j) {
+			pushVertex(out_vertices, glm::vec3(center.x + xy * sector.cos[j], center.y + xy * sector.sin[j], z), color);
+		}
+	}
+	unsigned int south = meshBaseVertex(out_vertices);
+	pushVertex(out_vertices, glm::vec3(center.x, center.y, center.z - radius), color);
+
+	// Fan around the north pole
+	unsigned int ring = base + 1;
+	for (unsigned int j = 0; j < sectors; ++j) {
+		pushTriangle(out_indexes, base, ring + j, ring + (j + 1) % sectors);
+	}
+
+	//  k1--k1+1
+	//  |  / |
+	//  | /  |
+	//  k2--k2+1
+	for (unsigned int i = 0; i + 2 < stacks; ++i) {
+		unsigned int k1 = ring + i * sectors;
+		unsigned int k2 = k1 + sectors;
+		for (unsigned int j = 0; j < sectors; ++j) {
+			unsigned int j1 = (j + 1) % sectors;
+			pushTriangle(out_indexes, k1 + j, k2 + j, k1 + j1);
+			pushTriangle(out_indexes, k1 + j1, k2 + j, k2 + j1);
+		}
+	}
+
+	// Fan around the south pole
+	unsigned int last = ring + (stacks - 2) * sectors;
+	for (unsigned int j = 0; j < sectors; ++j) {
+		pushTriangle(out_indexes, last + j, south, last + (j + 1) % sectors);
+	}
+}
+
+#endif
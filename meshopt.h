@@ -0,0 +1,240 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+// Meshes here are interleaved position/color vec3 pairs plus a triangle list
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache
+inline float computeACMR(const std::vector<unsigned int> &indexes, size_t vertex_count, unsigned int cache_size = 16) {
+	if (indexes.size() < 3) return 0.0f;
+
+	// Time stamp at which each vertex entered the cache
+	std::vector<unsigned int> timestamp(vertex_count, 0);
+	unsigned int time = cache_size + 1;
+	size_t misses = 0;
+
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		unsigned int v = indexes[i];
+		if (time - timestamp[v] > cache_size) {
+			timestamp[v] = time++;
+			++misses;
+		}
+	}
+
+	return float(misses) / float(indexes.size() / 3);
+}
+
+inline uint32_t meshHashVertex(const glm::vec3 *vertex) {
+	// FNV-1a over the raw bits of position and color
+	uint32_t words[6];
+	memcpy(words, vertex, sizeof(words));
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < 6; ++i) {
+		hash = (hash ^ words[i]) * 16777619u;
+	}
+	return hash ^ (hash >> 15);
+}
+
+// Merge vertices with identical position and color, returns the new vertex count
+inline size_t weldVertices(std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indexes) {
+	size_t vertex_count = vertices.size() / 2;
+
+	// Open addressing table, power of two and at most half full
+	size_t table_size = 16;
+	while (table_size < vertex_count * 2) table_size *= 2;
+	std::vector<unsigned int> table(table_size, ~0u);
+
+	std::vector<unsigned int> remap(vertex_count);
+	size_t unique = 0;
+
+	for (size_t v = 0; v < vertex_count; ++v) {
+		const glm::vec3 *vertex = &vertices[2 * v];
+		size_t slot = meshHashVertex(vertex) & (table_size - 1);
+
+		// Linear probe until an empty slot or an equal vertex
+		while (table[slot] != ~0u && memcmp(&vertices[2 * table[slot]], vertex, 2 * sizeof(glm::vec3)) != 0) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+
+		if (table[slot] == ~0u) {
+			// Compact in place, unique never overtakes v
+			vertices[2 * unique] = vertex[0];
+			vertices[2 * unique + 1] = vertex[1];
+			table[slot] = (unsigned int)unique;
+			++unique;
+		}
+		remap[v] = table[slot];
+	}
+
+	vertices.resize(unique * 2);
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		indexes[i] = remap[indexes[i]];
+	}
+
+	return unique;
+}
+
+// Reorder triangles for the post-transform vertex cache (Forsyth, "Linear-speed vertex cache optimisation")
+inline void optimizeVertexCache(std::vector<unsigned int> &indexes, size_t vertex_count) {
+	const int cache_size = 32;
+	const size_t triangle_count = indexes.size() / 3;
+	if (triangle_count == 0) return;
+
+	// Score tables indexed by cache position and by remaining valence
+	float cache_scores[cache_size];
+	for (int i = 0; i < cache_size; ++i) {
+		if (i < 3) {
+			// The last triangle's vertices get a fixed score so we do not favour one of them
+			cache_scores[i] = 0.75f;
+		}
+		else {
+			cache_scores[i] = powf(1.0f - float(i - 3) / float(cache_size - 3), 1.5f);
+		}
+	}
+	const int max_valence = 32;
+	float valence_scores[max_valence];
+	for (int i = 0; i < max_valence; ++i) {
+		valence_scores[i] = (i == 0) ? 0.0f : 2.0f * powf(float(i), -0.5f);
+	}
+
+	// Triangle adjacency per vertex
+	std::vector<unsigned int> offsets(vertex_count + 1, 0);
+	std::vector<unsigned int> valence(vertex_count, 0);
+	for (size_t i = 0; i < indexes.size(); ++i) ++valence[indexes[i]];
+	for (size_t v = 0; v < vertex_count; ++v) offsets[v + 1] = offsets[v] + valence[v];
+	std::vector<unsigned int> adjacency(indexes.size());
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t t = 0; t < triangle_count; ++t) {
+		for (int k = 0; k < 3; ++k) adjacency[fill[indexes[3 * t + k]]++] = (unsigned int)t;
+	}
+
+	std::vector<int> cache_position(vertex_count, -1);
+	std::vector<float> vertex_score(vertex_count);
+	std::vector<float> triangle_score(triangle_count, 0.0f);
+	std::vector<char> emitted(triangle_count, 0);
+
+	auto score = [&](unsigned int v) {
+		if (valence[v] == 0) return -1.0f;
+		float s = (cache_position[v] >= 0) ? cache_scores[cache_position[v]] : 0.0f;
+		return s + valence_scores[std::min<unsigned int>(valence[v], max_valence - 1)];
+	};
+
+	for (size_t v = 0; v < vertex_count; ++v) vertex_score[v] = score((unsigned int)v);
+	for (size_t t = 0; t < triangle_count; ++t) {
+		triangle_score[t] = vertex_score[indexes[3 * t]] + vertex_score[indexes[3 * t + 1]] + vertex_score[indexes[3 * t + 2]];
+	}
+
+	std::vector<unsigned int> result;
+	result.reserve(indexes.size());
+	unsigned int cache[cache_size + 3];
+	int cache_count = 0;
+	size_t scan = 0;
+	long best = -1;
+
+	for (size_t emitted_count = 0; emitted_count < triangle_count; ++emitted_count) {
+		// No candidate from the cache, take the best not yet emitted triangle in input order
+		if (best < 0) {
+			while (emitted[scan]) ++scan;
+			best = (long)scan;
+			for (size_t t = scan; t < triangle_count && t < scan + 64; ++t) {
+				if (!emitted[t] && triangle_score[t] > triangle_score[best]) best = (long)t;
+			}
+		}
+
+		// Emit it
+		const unsigned int *tri = &indexes[3 * best];
+		emitted[best] = 1;
+		result.insert(result.end(), tri, tri + 3);
+
+		// Push its vertices to the front of the LRU cache
+		unsigned int next[cache_size + 3];
+		int next_count = 0;
+		for (int k = 0; k < 3; ++k) {
+			next[next_count++] = tri[k];
+
+			// Remove this triangle from the vertex's adjacency
+			unsigned int v = tri[k];
+			unsigned int *begin = &adjacency[offsets[v]];
+			unsigned int *end = begin + valence[v];
+			*std::find(begin, end, (unsigned int)best) = *(end - 1);
+			--valence[v];
+		}
+		for (int i = 0; i < cache_count; ++i) {
+			if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2]) next[next_count++] = cache[i];
+		}
+
+		// Vertices that fell out of the cache lose their cache score
+		for (int i = cache_size; i < next_count; ++i) cache_position[next[i]] = -1;
+		cache_count = std::min(next_count, cache_size);
+		memcpy(cache, next, cache_count * sizeof(unsigned int));
+
+		// Rescore the vertices in the cache and their triangles, remember the best one
+		for (int i = 0; i < next_count; ++i) {
+			unsigned int v = next[i];
+			if (i < cache_size) cache_position[v] = i;
+			float delta = score(v) - vertex_score[v];
+			vertex_score[v] += delta;
+			for (unsigned int a = offsets[v]; a < offsets[v] + valence[v]; ++a) triangle_score[adjacency[a]] += delta;
+		}
+
+		best = -1;
+		float best_score = -1.0f;
+		for (int i = 0; i < cache_count; ++i) {
+			unsigned int v = cache[i];
+			for (unsigned int a = offsets[v]; a < offsets[v] + valence[v]; ++a) {
+				unsigned int t = adjacency[a];
+				if (triangle_score[t] > best_score) {
+					best_score = triangle_score[t];
+					best = (long)t;
+				}
+			}
+		}
+	}
+
+	indexes.swap(result);
+}
+
+// Reorder vertices by first use so vertex fetch walks memory linearly
+inline void optimizeVertexFetch(std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indexes) {
+	size_t vertex_count = vertices.size() / 2;
+	std::vector<unsigned int> remap(vertex_count, ~0u);
+	std::vector<glm::vec3> result;
+	result.reserve(vertices.size());
+
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		unsigned int v = indexes[i];
+		if (remap[v] == ~0u) {
+			remap[v] = (unsigned int)(result.size() / 2);
+			result.push_back(vertices[2 * v]);
+			result.push_back(vertices[2 * v + 1]);
+		}
+		indexes[i] = remap[v];
+	}
+
+	// Unreferenced vertices are dropped
+	vertices.swap(result);
+}
+
+// Weld, reorder for the vertex cache and for fetch locality, then report the effect
+inline void optimizeMesh(const char *name, std::vector<glm::vec3> &vertices, std::vector<unsigned int> &indexes) {
+	size_t before_vertices = vertices.size() / 2;
+	float before_acmr = computeACMR(indexes, before_vertices);
+
+	weldVertices(vertices, indexes);
+	optimizeVertexCache(indexes, vertices.size() / 2);
+	optimizeVertexFetch(vertices, indexes);
+
+	printf("Optimized %s: %u -> %u vertices, ACMR %.3f -> %.3f\n", name,
+		(unsigned int)before_vertices, (unsigned int)(vertices.size() / 2),
+		before_acmr, computeACMR(indexes, vertices.size() / 2));
+}
+
+#endif
@@ -0,0 +1,404 @@
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <float.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "mappedfile.h"
+#include "jobs.h"
+
+// Parsed contents of one line-aligned slice of an OBJ file
+struct objchunk {
+	const char *begin = NULL;
+	const char *end = NULL;
+
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::vec3> colors;
+
+	// vertex/color index pairs, one pair per face corner (1-based as in the file)
+	std::vector<unsigned int> corners;
+
+	// first line that could not be parsed, NULL on success
+	const char *error = NULL;
+};
+
+inline bool objIsSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char *objSkipSpace(const char *p, const char *end) {
+	while (p < end && objIsSpace(*p)) ++p;
+	return p;
+}
+
+// strtof on a copy of [p, end), for what the fast path below cannot round exactly.
+// Returns the end of the number in the original text, NULL if there was none.
+inline const char *objParseFloatSlow(const char *p, const char *end, float &out) {
+	char buffer[128];
+	std::string long_text;
+	const char *text = buffer;
+	size_t length = (size_t)(end - p);
+	if (length < sizeof(buffer)) {
+		memcpy(buffer, p, length);
+		buffer[length] = 0;
+	}
+	else {
+		long_text.assign(p, length);
+		text = long_text.c_str();
+	}
+	char *stop = NULL;
+	out = strtof(text, &stop);
+	return stop == text ? NULL : p + (stop - text);
+}
+
+// Parse a float, returns NULL if no number was found. Plain decimals of up to 15
+// digits are converted here and round exactly like strtof, anything longer, with a
+// large exponent, or nan and inf is handed to strtof.
+inline const char *objParseFloat(const char *p, const char *end, float &out) {
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	p = objSkipSpace(p, end);
+	const char *start = p;
+
+	// Sign
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	// Up to 19 significant digits fit in the mantissa, the rest only move the exponent
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool found = false;
+
+	while (p < end && *p >= '0' && *p <= '9') {
+		found = true;
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+			if (mantissa != 0) ++digits;
+		}
+		else {
+			++exponent;
+		}
+		++p;
+	}
+
+	if (p < end && *p == '.') {
+		++p;
+		while (p < end && *p >= '0' && *p <= '9') {
+			found = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+				if (mantissa != 0) ++digits;
+				--exponent;
+			}
+			++p;
+		}
+	}
+
+	if (!found) {
+		// nan, inf and infinity in any case
+		if (p < end && (*p == 'n' || *p == 'N' || *p == 'i' || *p == 'I')) {
+			return objParseFloatSlow(start, std::min(end, start + 64), out);
+		}
+		return NULL;
+	}
+
+	// Exponent
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negexp = false;
+		if (q < end && (*q == '-' || *q == '+')) {
+			negexp = *q == '-';
+			++q;
+		}
+		if (q < end && *q >= '0' && *q <= '9') {
+			int e = 0;
+			while (q < end && *q >= '0' && *q <= '9') {
+				if (e < 10000) e = e * 10 + (*q - '0');
+				++q;
+			}
+			exponent += negexp ? -e : e;
+			p = q;
+		}
+	}
+
+	// Below 2^53 the mantissa is exact and so are the powers in the table, one multiply
+	// or divide gives the correctly rounded double. Rounding that to float again only
+	// goes wrong when it lands exactly halfway between two floats, those and results
+	// outside the normal float range are left to strtof.
+	if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+		double value = exponent < 0 ? (double)mantissa / powers[-exponent] : (double)mantissa * powers[exponent];
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		bool halfway = (bits & 0x1FFFFFFFull) == 0x10000000ull;
+		if (value == 0.0 || (value >= FLT_MIN && value <= FLT_MAX && !halfway)) {
+			out = (float)(negative ? -value : value);
+			return p;
+		}
+	}
+	return objParseFloatSlow(start, p, out);
+}
+
+// Parse an unsigned decimal integer, returns NULL if no digits were found
+inline const char *objParseIndex(const char *p, const char *end, unsigned int &out) {
+	p = objSkipSpace(p, end);
+	if (p >= end || *p < '0' || *p > '9') return NULL;
+
+	unsigned int value = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		value = value * 10 + (unsigned int)(*p - '0');
+		++p;
+	}
+
+	out = value;
+	return p;
+}
+
+// Parse every line in [chunk.begin, chunk.end)
+inline void parseOBJChunk(objchunk &chunk) {
+	const char *p = chunk.begin;
+	const char *end = chunk.end;
+
+	// Rough guess, a typical line is about 30 bytes
+	size_t lines = (size_t)(end - p) / 30;
+	chunk.vertices.reserve(lines / 4);
+	chunk.colors.reserve(lines / 4);
+	chunk.corners.reserve(lines * 3);
+
+	while (p < end) {
+		const char *line = p;
+
+		// Find end of line
+		const char *eol = (const char*)memchr(p, '\n', (size_t)(end - p));
+		if (eol == NULL) eol = end;
+
+		// Read the first word of the line
+		p = objSkipSpace(p, eol);
+		const char *word = p;
+		while (p < eol && !objIsSpace(*p)) ++p;
+		size_t length = (size_t)(p - word);
+
+		if (length == 1 && (word[0] == 'v' || word[0] == 'c')) {
+			glm::vec3 value;
+			if ((p = objParseFloat(p, eol, value.x)) == NULL ||
+				(p = objParseFloat(p, eol, value.y)) == NULL ||
+				(p = objParseFloat(p, eol, value.z)) == NULL) {
+				chunk.error = line;
+				return;
+			}
+			if (word[0] == 'v') chunk.vertices.push_back(value);
+			else chunk.colors.push_back(value);
+		}
+		else if (length == 1 && word[0] == 'f') {
+			// Exactly three vertex/color corners, anything after them is ignored
+			unsigned int corner[6];
+			for (int i = 0; i < 3; ++i) {
+				if ((p = objParseIndex(p, eol, corner[2 * i])) == NULL || p >= eol || *p != '/' ||
+					(p = objParseIndex(p + 1, eol, corner[2 * i + 1])) == NULL) {
+					chunk.error = line;
+					return;
+				}
+			}
+			chunk.corners.insert(chunk.corners.end(), corner, corner + 6);
+		}
+		// Anything else is a comment or unsupported, eat up the rest of the line
+
+		p = eol + 1;
+	}
+}
+
+// Memory-map an OBJ file and parse it on the threads of jobs, output matches loadOBJ:
+// interleaved position/color per face corner and a 0..N-1 index list
+inline bool loadOBJMapped(
+	const char * path,
+	std::vector<glm::vec3> & out_vertices,
+	std::vector<unsigned int> & out_indexes,
+	jobsystem * jobs = NULL
+) {
+	mappedfile file;
+	if (!mapFile(path, file)) {
+		return false;
+	}
+
+	// Small files are not worth splitting
+	const size_t min_chunk = 1 << 20;
+	size_t threads = jobs != NULL ? jobs->thread_count : 1;
+	size_t count = std::max<size_t>(1, std::min<size_t>(threads, file.size / min_chunk));
+
+	// Split into line-aligned chunks
+	std::vector<objchunk> chunks(count);
+	const char *data = file.data;
+	const char *end = file.data + file.size;
+	const char *p = data;
+	for (size_t i = 0; i < count; ++i) {
+		chunks[i].begin = p;
+		if (i + 1 == count) {
+			p = end;
+		}
+		else {
+			const char *split = std::max(p, data + file.size / count * (i + 1));
+			const char *eol = (const char*)memchr(split, '\n', (size_t)(end - split));
+			p = (eol == NULL) ? end : eol + 1;
+		}
+		chunks[i].end = p;
+	}
+
+	// Parse chunks in parallel, one job each
+	parallelFor(jobs, 0, count, 1, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) parseOBJChunk(chunks[i]);
+	});
+
+	// Report the first error in file order
+	for (size_t i = 0; i < count; ++i) {
+		if (chunks[i].error != NULL) {
+			unsigned int line = 1 + (unsigned int)std::count(data, chunks[i].error, '\n');
+			printf("File can't be read by our simple parser :-( Try exporting with other options (line %u)\n", line);
+			unmapFile(file);
+			return false;
+		}
+	}
+	unmapFile(file);
+
+	// Merge attribute lists, indices in the file are global so order is all that matters
+	std::vector<glm::vec3> temp_vertices;
+	std::vector<glm::vec3> temp_colors;
+	std::vector<size_t> corner_offset(count + 1, 0);
+	size_t vertex_count = 0, color_count = 0;
+	for (size_t i = 0; i < count; ++i) {
+		vertex_count += chunks[i].vertices.size();
+		color_count += chunks[i].colors.size();
+		corner_offset[i + 1] = corner_offset[i] + chunks[i].corners.size() / 2;
+	}
+	temp_vertices.reserve(vertex_count);
+	temp_colors.reserve(color_count);
+	for (size_t i = 0; i < count; ++i) {
+		temp_vertices.insert(temp_vertices.end(), chunks[i].vertices.begin(), chunks[i].vertices.end());
+		temp_colors.insert(temp_colors.end(), chunks[i].colors.begin(), chunks[i].colors.end());
+		std::vector<glm::vec3>().swap(chunks[i].vertices);
+		std::vector<glm::vec3>().swap(chunks[i].colors);
+	}
+
+	// Resolve face corners into the interleaved output, each chunk writes its own range
+	size_t total = corner_offset[count];
+	size_t vertex_base = out_vertices.size();
+	size_t index_base = out_indexes.size();
+	out_vertices.resize(vertex_base + total * 2);
+	out_indexes.resize(index_base + total);
+
+	std::vector<char> bad(count, 0);
+	auto resolve = [&](size_t i) {
+		const std::vector<unsigned int> &corners = chunks[i].corners;
+		glm::vec3 *vout = &out_vertices[0] + vertex_base + corner_offset[i] * 2;
+		unsigned int *iout = &out_indexes[0] + index_base;
+		for (size_t c = 0; c < corners.size() / 2; ++c) {
+			unsigned int vertexIndex = corners[2 * c];
+			unsigned int colorIndex = corners[2 * c + 1];
+			if (vertexIndex - 1 >= vertex_count || colorIndex - 1 >= color_count) {
+				bad[i] = 1;
+				return;
+			}
+			vout[2 * c] = temp_vertices[vertexIndex - 1];
+			vout[2 * c + 1] = temp_colors[colorIndex - 1];
+			iout[corner_offset[i] + c] = (unsigned int)(corner_offset[i] + c);
+		}
+	};
+
+	if (total > 0) {
+		parallelFor(jobs, 0, count, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) resolve(i);
+		});
+	}
+
+	if (std::find(bad.begin(), bad.end(), 1) != bad.end()) {
+		printf("OBJ face refers to a vertex or color that does not exist\n");
+		out_vertices.resize(vertex_base);
+		out_indexes.resize(index_base);
+		return false;
+	}
+
+	return true;
+}
+
+// Parse awkward and random numbers with objParseFloat and strtof, both must agree on
+// every bit and on where the number ends
+inline int testOBJFloat(int count) {
+	static const char *fixed[] = {
+		"0", "-0", "+1", "1.", ".5", "-.5e1", "0.1", "3.14159274", "16777216", "16777217", "16777218",
+		"1.00000005960464477539062", "1.000000059604644775390625", "1.0000000596046447753906251",
+		"3.4028235e38", "3.40282357e38", "1e39", "-1e39", "1.17549435e-38", "1e-38", "1.4e-45", "1e-46",
+		"123456789012345678901234567890", "0.000000000000000000000000000000123", "1e22", "1e23", "9007199254740993",
+		"nan", "-nan", "NaN", "inf", "-inf", "Infinity", "1e", "1e+", "2.5e-3x", "7e0007"
+	};
+	const int fixed_count = (int)(sizeof(fixed) / sizeof(fixed[0]));
+
+	uint32_t seed = 12345;
+	auto next = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return seed >> 8;
+	};
+
+	int failures = 0;
+	char text[128];
+	for (int i = 0; i < fixed_count + count; ++i) {
+		if (i < fixed_count) {
+			snprintf(text, sizeof(text), "%s", fixed[i]);
+		}
+		else {
+			// Random floats as exporters print them, halfway points between two floats and random digit strings
+			uint32_t bits = next() << 8 | (next() & 0xFF);
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			if (!std::isfinite(f)) f = 1.0f;
+			switch (i % 5) {
+			case 0: snprintf(text, sizeof(text), "%.6f", f); break;
+			case 1: snprintf(text, sizeof(text), "%.9g", f); break;
+			case 2: snprintf(text, sizeof(text), "%.17g", f); break;
+			case 3: snprintf(text, sizeof(text), "%.40g", ((double)f + (double)nextafterf(f, INFINITY)) / 2.0); break;
+			default: {
+				int length = 0;
+				if (next() & 1) text[length++] = '-';
+				int integer = (int)(next() % 12), fraction = (int)(next() % 24);
+				for (int k = 0; k < integer; ++k) text[length++] = (char)('0' + next() % 10);
+				text[length++] = '.';
+				for (int k = 0; k < fraction; ++k) text[length++] = (char)('0' + next() % 10);
+				if (integer + fraction == 0) text[length++] = '0';
+				if (next() & 1) length += snprintf(text + length, sizeof(text) - length, "e%d", (int)(next() % 90) - 45);
+				text[length] = 0;
+			}
+			}
+		}
+
+		size_t length = strlen(text);
+		float parsed = 0.0f;
+		const char *stop = objParseFloat(text, text + length, parsed);
+		char *expected_stop = NULL;
+		float expected = strtof(text, &expected_stop);
+		bool same_end = stop == NULL ? expected_stop == text : stop == expected_stop;
+		bool same_value = stop == NULL || (std::isnan(parsed) && std::isnan(expected)) || memcmp(&parsed, &expected, sizeof(float)) == 0;
+		if (!same_end || !same_value) {
+			if (failures < 10) printf("  %s: parsed %.9g, strtof %.9g\n", text, parsed, expected);
+			++failures;
+		}
+	}
+
+	printf("objParseFloat against strtof, %d values: %d different %s\n", fixed_count + count, failures, failures == 0 ? "ok" : "FAILED");
+	return failures == 0 ? 0 : -1;
+}
+
+#endif
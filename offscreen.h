@@ -0,0 +1,64 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <vector>
+#include <iostream>
+
+#include <GL/glew.h>
+
+// Framebuffer object with a color and a depth renderbuffer
+struct offscreen {
+	GLuint fbo = 0;
+	GLuint color = 0;
+	GLuint depth = 0;
+	int width = 0;
+	int height = 0;
+};
+
+inline void destroyOffscreen(offscreen &target) {
+	if (target.fbo != 0) glDeleteFramebuffers(1, &target.fbo);
+	if (target.color != 0) glDeleteRenderbuffers(1, &target.color);
+	if (target.depth != 0) glDeleteRenderbuffers(1, &target.depth);
+	target.fbo = target.color = target.depth = 0;
+}
+
+// Create the target and leave it bound as the draw framebuffer
+inline bool createOffscreen(offscreen &target, int width, int height) {
+	target.width = width;
+	target.height = height;
+
+	glGenRenderbuffers(1, &target.color);
+	glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	glGenRenderbuffers(1, &target.depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &target.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+
+	// Check framebuffer is complete
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		std::cerr << "Error: offscreen framebuffer incomplete" << std::endl;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		destroyOffscreen(target);
+		return false;
+	}
+
+	glViewport(0, 0, width, height);
+	return true;
+}
+
+// Read back the color buffer as tightly packed RGBA, bottom row first
+inline void readOffscreen(const offscreen &target, std::vector<unsigned char> &pixels) {
+	pixels.resize((size_t)target.width * target.height * 4);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, target.width, target.height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+}
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+
+#include <GL/glew.h>
+
+// Set to 0 to compile the PROFILE_PASS scopes out entirely
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+// Passes of the render loop
+enum profilepass {
+	PASS_INSTANCES,
+	PASS_FLAG_UPLOAD,
+	PASS_QUEUE,
+	PASS_DRAW,
+	PASS_COUNT
+};
+
+inline const char *profilePassName(int pass) {
+	static const char *names[PASS_COUNT] = { "instances", "flag_upload", "queue", "draw" };
+	return names[pass];
+}
+
+// Histogram bins are quarter octaves of nanoseconds, bin 0 collects everything below 1 us
+#define HISTOGRAM_BINS 96
+#define HISTOGRAM_FIRST_NS 1000.0
+// Number of most recent samples the histogram covers
+#define HISTOGRAM_WINDOW 1024
+
+// Histogram over the last HISTOGRAM_WINDOW samples. Writers and readers never lock:
+// a new sample takes a ring slot with fetch_add and removes whatever it evicts.
+struct rollinghistogram {
+	std::atomic<uint32_t> counts[HISTOGRAM_BINS];
+	std::atomic<uint32_t> ring[HISTOGRAM_WINDOW];	// sample in ns + 1, 0 = empty
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> sum;	// ns over the window
+
+	rollinghistogram() : head(0), sum(0) {
+		for (int i = 0; i < HISTOGRAM_BINS; ++i) counts[i].store(0, std::memory_order_relaxed);
+		for (int i = 0; i < HISTOGRAM_WINDOW; ++i) ring[i].store(0, std::memory_order_relaxed);
+	}
+};
+
+inline int histogramBin(uint32_t ns) {
+	if (ns < HISTOGRAM_FIRST_NS) return 0;
+	int bin = 1 + (int)(4.0 * log2(ns / HISTOGRAM_FIRST_NS));
+	return bin < HISTOGRAM_BINS ? bin : HISTOGRAM_BINS - 1;
+}
+
+// Lower edge of a bin in ns
+inline double histogramBinStart(int bin) {
+	return bin == 0 ? 0.0 : HISTOGRAM_FIRST_NS * pow(2.0, (bin - 1) / 4.0);
+}
+
+inline void addSample(rollinghistogram &h, uint64_t ns) {
+	uint32_t value = (uint32_t)(ns < 0xfffffffeu ? ns : 0xfffffffeu);
+	uint64_t slot = h.head.fetch_add(1, std::memory_order_relaxed) % HISTOGRAM_WINDOW;
+	uint32_t old = h.ring[slot].exchange(value + 1, std::memory_order_relaxed);
+	if (old != 0) {
+		h.counts[histogramBin(old - 1)].fetch_sub(1, std::memory_order_relaxed);
+		h.sum.fetch_sub(old - 1, std::memory_order_relaxed);
+	}
+	h.counts[histogramBin(value)].fetch_add(1, std::memory_order_relaxed);
+	h.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+// Number of samples in the window
+inline uint32_t histogramCount(const rollinghistogram &h) {
+	uint32_t total = 0;
+	for (int i = 0; i < HISTOGRAM_BINS; ++i) total += h.counts[i].load(std::memory_order_relaxed);
+	return total;
+}
+
+// Upper edge of the bin holding the given fraction of samples, in ns
+inline double histogramPercentile(const rollinghistogram &h, double fraction) {
+	uint32_t total = histogramCount(h);
+	if (total == 0) return 0.0;
+	uint32_t rank = (uint32_t)ceil(fraction * total), seen = 0;
+	for (int i = 0; i < HISTOGRAM_BINS; ++i) {
+		seen += h.counts[i].load(std::memory_order_relaxed);
+		if (seen >= rank) return histogramBinStart(i + 1);
+	}
+	return histogramBinStart(HISTOGRAM_BINS);
+}
+
+// Timer queries per pass for the current and the previous frame, results are
+// read one frame later and only if already available so the CPU never waits
+#define PROFILER_QUERY_FRAMES 2
+
+struct profiler {
+	bool enabled = false;
+	bool gpu = false;
+	unsigned int frame = 0;
+	uint64_t dropped = 0;	// GPU results not ready in time
+
+	rollinghistogram cpu[PASS_COUNT];
+	rollinghistogram gpu_time[PASS_COUNT];
+
+	GLuint queries[PROFILER_QUERY_FRAMES][PASS_COUNT] = {};
+	bool issued[PROFILER_QUERY_FRAMES][PASS_COUNT] = {};
+};
+
+// gpu needs a current context, without it only CPU time is recorded
+inline void initProfiler(profiler &prof, bool enabled, bool gpu) {
+	prof.enabled = enabled;
+	prof.gpu = enabled && gpu;
+	if (prof.gpu) {
+		glGenQueries(PROFILER_QUERY_FRAMES * PASS_COUNT, &prof.queries[0][0]);
+	}
+}
+
+inline void destroyProfiler(profiler &prof) {
+	if (prof.gpu) {
+		glDeleteQueries(PROFILER_QUERY_FRAMES * PASS_COUNT, &prof.queries[0][0]);
+	}
+	prof.enabled = prof.gpu = false;
+}
+
+// Call once per frame before the first pass, collects the results from PROFILER_QUERY_FRAMES ago
+inline void beginProfilerFrame(profiler &prof) {
+	if (!prof.gpu) return;
+
+	prof.frame++;
+	unsigned int slot = prof.frame % PROFILER_QUERY_FRAMES;
+	for (int pass = 0; pass < PASS_COUNT; ++pass) {
+		if (!prof.issued[slot][pass]) continue;
+		prof.issued[slot][pass] = false;
+
+		GLint available = 0;
+		glGetQueryObjectiv(prof.queries[slot][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			prof.dropped++;
+			continue;
+		}
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(prof.queries[slot][pass], GL_QUERY_RESULT, &ns);
+		addSample(prof.gpu_time[pass], ns);
+	}
+}
+
+// Times the enclosing block on the CPU and, through GL_TIME_ELAPSED, on the GPU.
+// Passes must not nest because time elapsed queries cannot overlap.
+struct profilescope {
+	profiler *prof;
+	int pass;
+	std::chrono::steady_clock::time_point start;
+
+	profilescope(profiler &p, int which) : prof(NULL), pass(which) {
+		if (!p.enabled) return;
+		prof = &p;
+		if (p.gpu) {
+			unsigned int slot = p.frame % PROFILER_QUERY_FRAMES;
+			glBeginQuery(GL_TIME_ELAPSED, p.queries[slot][pass]);
+			p.issued[slot][pass] = true;
+		}
+		start = std::chrono::steady_clock::now();
+	}
+
+	~profilescope() {
+		if (prof == NULL) return;
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		if (prof->gpu) glEndQuery(GL_TIME_ELAPSED);
+		addSample(prof->cpu[pass], ns);
+	}
+};
+
+#if PROFILER_ENABLED
+#define PROFILE_PASS(prof, pass) profilescope profile_scope_##pass(prof, pass)
+#else
+#define PROFILE_PASS(prof, pass)
+#endif
+
+// Write every non-empty bin: pass, clock, bin range and count
+inline bool writeProfileCSV(const profiler &prof, const char *filename) {
+	FILE *file = fopen(filename, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Error: Could not open %s\n", filename);
+		return false;
+	}
+
+	fprintf(file, "pass,clock,bin_start_us,bin_end_us,count\n");
+	for (int pass = 0; pass < PASS_COUNT; ++pass) {
+		for (int clock = 0; clock < 2; ++clock) {
+			const rollinghistogram &h = clock == 0 ? prof.cpu[pass] : prof.gpu_time[pass];
+			for (int bin = 0; bin < HISTOGRAM_BINS; ++bin) {
+				uint32_t count = h.counts[bin].load(std::memory_order_relaxed);
+				if (count == 0) continue;
+				fprintf(file, "%s,%s,%.3f,%.3f,%u\n", profilePassName(pass), clock == 0 ? "cpu" : "gpu",
+					histogramBinStart(bin) / 1000.0, histogramBinStart(bin + 1) / 1000.0, count);
+			}
+		}
+	}
+
+	fclose(file);
+	printf("Wrote %s\n", filename);
+	return true;
+}
+
+// Mean and p95 per pass over the current window
+inline void printProfile(const profiler &prof) {
+	if (!prof.enabled) return;
+
+	for (int pass = 0; pass < PASS_COUNT; ++pass) {
+		const rollinghistogram &c = prof.cpu[pass];
+		const rollinghistogram &g = prof.gpu_time[pass];
+		uint32_t cn = histogramCount(c), gn = histogramCount(g);
+		printf("  %-12s cpu mean %8.3f ms p95 < %8.3f ms   gpu mean %8.3f ms p95 < %8.3f ms\n", profilePassName(pass),
+			cn ? c.sum.load() / 1e6 / cn : 0.0, histogramPercentile(c, 0.95) / 1e6,
+			gn ? g.sum.load() / 1e6 / gn : 0.0, histogramPercentile(g, 0.95) / 1e6);
+	}
+	if (prof.dropped > 0) {
+		printf("  %u GPU timings were not ready after %d frames and were dropped\n", (unsigned int)prof.dropped, PROFILER_QUERY_FRAMES);
+	}
+}
+
+// Cost of a PROFILE_PASS scope with the profiler disabled and enabled (CPU clock only)
+inline int benchmarkProfiler(int iterations) {
+	typedef std::chrono::steady_clock clock;
+	volatile unsigned int sink = 0;
+
+	clock::time_point start = clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		sink = sink + 1;
+	}
+	double baseline = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+	profiler disabled;
+	initProfiler(disabled, false, false);
+	start = clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		PROFILE_PASS(disabled, PASS_DRAW);
+		sink = sink + 1;
+	}
+	double off = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+	profiler enabled;
+	initProfiler(enabled, true, false);
+	start = clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		PROFILE_PASS(enabled, PASS_DRAW);
+		sink = sink + 1;
+	}
+	double on = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+	printf("profiler scope cost over %d iterations (compiled %s):\n", iterations, PROFILER_ENABLED ? "in" : "out");
+	printf("  disabled: %.2f ns per scope\n", (off - baseline) / iterations);
+	printf("  enabled:  %.2f ns per scope (cpu clock only)\n", (on - baseline) / iterations);
+	return 0;
+}
+
+#endif
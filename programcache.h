@@ -0,0 +1,145 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Bump whenever the layout below changes
+#define PROGRAMCACHE_VERSION 1
+
+// On-disk layout: header followed by the driver's program binary
+struct programcacheheader {
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+// Cache file for a program, named after its vertex shader
+inline std::string programCachePath(const char *vert_file) {
+	return std::string(vert_file) + ".progcache";
+}
+
+inline uint64_t programCacheHash(uint64_t hash, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Drivers that cannot hand out program binaries get a source compile every time
+inline bool programCacheSupported() {
+	if (!GLEW_ARB_get_program_binary) return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+// Hash of every stage source and the driver identity, a binary is only reused
+// when all of them match. files may contain NULL for unused stages.
+inline bool programCacheKey(const char *const *files, int count, uint64_t &key) {
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = 0; i < count; ++i) {
+		// Stage separator, so moving code between stages changes the key
+		hash = programCacheHash(hash, &i, sizeof(i));
+		if (files[i] == NULL) continue;
+
+		std::ifstream input(files[i], std::ios::binary);
+		if (!input.good()) return false;
+		std::stringstream source;
+		source << input.rdbuf();
+		std::string text = source.str();
+		hash = programCacheHash(hash, text.data(), text.size());
+	}
+
+	const GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; ++i) {
+		const char *value = (const char*)glGetString(strings[i]);
+		if (value == NULL) return false;
+		hash = programCacheHash(hash, value, strlen(value) + 1);
+	}
+
+	key = hash;
+	return true;
+}
+
+// Create a program from the cached binary, 0 if the cache is missing, stale or rejected by the driver
+inline GLuint loadProgramBinary(const char *path, uint64_t key) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) return 0;
+
+	programcacheheader header;
+	std::vector<char> binary;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, "SSPB", 4) == 0 &&
+		header.version == PROGRAMCACHE_VERSION &&
+		header.key == key &&
+		header.length > 0;
+	if (valid) {
+		binary.resize(header.length);
+		valid = fread(&binary[0], 1, header.length, file) == header.length;
+	}
+	fclose(file);
+	if (!valid) return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, &binary[0], (GLsizei)header.length);
+
+	// A driver update may invalidate binaries even when the version string is unchanged
+	GLint status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+// Store a linked program, it must have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+inline bool saveProgramBinary(const char *path, uint64_t key, GLuint program) {
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return false;
+
+	programcacheheader header;
+	memset(&header, 0, sizeof(header));
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, &binary[0]);
+	if (length <= 0) return false;
+
+	memcpy(header.magic, "SSPB", 4);
+	header.version = PROGRAMCACHE_VERSION;
+	header.key = key;
+	header.format = format;
+	header.length = (uint32_t)length;
+
+	// Through a temporary file so readers never see half a binary
+	std::string temp = std::string(path) + ".tmp";
+	FILE *file = fopen(temp.c_str(), "wb");
+	if (file == NULL) return false;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(&binary[0], 1, header.length, file) == header.length;
+	ok = (fclose(file) == 0) && ok;
+
+	// rename does not replace an existing file on Windows
+	remove(path);
+	if (!ok || rename(temp.c_str(), path) != 0) {
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+#endif
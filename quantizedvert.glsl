@@ -0,0 +1,42 @@
+#version 330 core
+
+// Relative to the box of the mesh, w is the mesh's slot in MeshBounds
+layout(location = 0) in vec4 vert_Position;
+layout(location = 1) in vec4 vert_Color;
+
+// One copy per instance, see instancing.h
+layout(location = 2) in vec4 inst_PositionScale;
+layout(location = 3) in vec2 inst_YawPhase;
+
+// Shared by every program, rewritten once per frame
+layout(std140) uniform Camera {
+	mat4 u_View;
+	mat4 u_Projection;
+};
+
+layout(std140) uniform Object {
+	mat4 u_Model;
+	float u_Time;
+};
+
+// Box of every mesh in the arena, see vertexformat.h
+layout(std140) uniform MeshBounds {
+	vec4 u_BoundsCenter[256];
+	vec4 u_BoundsExtent[256];
+};
+
+out vec3 frag_Color;
+
+void main() {
+	int slot = int(vert_Position.w);
+	vec3 local = u_BoundsCenter[slot].xyz + vert_Position.xyz * u_BoundsExtent[slot].xyz;
+
+	// Turn about y, scale, then move into place
+	float c = cos(inst_YawPhase.x);
+	float s = sin(inst_YawPhase.x);
+	vec3 turned = vec3(c * local.x + s * local.z, local.y, c * local.z - s * local.x);
+	vec3 position = inst_PositionScale.xyz + turned * inst_PositionScale.w;
+
+	frag_Color = vert_Color.rgb;
+	gl_Position = u_Projection * u_View * u_Model * vec4(position, 1.0);
+}
@@ -0,0 +1,345 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <GL/glew.h>
+
+#include "glstate.h"
+#include "trace.h"
+
+// Pixel buffers the frames are read back through, a frame is mapped
+// RECORDER_PBOS - 1 frames after its glReadPixels
+#define RECORDER_PBOS 3
+// Frames that may wait for the writer thread before the render loop has to
+#define RECORDER_QUEUE 4
+
+enum recordformat {
+	RECORD_Y4M,	// one YUV4MPEG2 stream, 4:2:0
+	RECORD_PPM	// one binary PPM per frame, the path holds a %d style pattern for the frame number
+};
+
+// Widest frame number a PPM pattern may ask for
+#define RECORDER_MAX_WIDTH 16
+
+// Rendered frames read back without stalling the GPU and written to disk on a
+// thread of their own. A PBO's readback is only mapped once the frames after it
+// have been issued, by then its fence has usually signalled.
+struct framerecorder {
+	recordformat format = RECORD_Y4M;
+	std::string path;
+	// A PPM frame is named prefix, the frame number padded to width and suffix
+	std::string name_prefix;
+	std::string name_suffix;
+	int name_width = 0;
+	bool name_zeros = false;
+	int width = 0;
+	int height = 0;
+	unsigned int fps = 60;
+	FILE *file = NULL;
+
+	GLuint pbos[RECORDER_PBOS] = {};
+	GLsync fences[RECORDER_PBOS] = {};
+	unsigned int next = 0;
+
+	// RGBA frames, bottom row first, handed between the two threads
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<std::vector<unsigned char> > queued;
+	std::vector<std::vector<unsigned char> > spare;
+	bool stopping = false;
+	bool write_failed = false;
+
+	// Frames read back, time the render thread spent waiting on fences and on
+	// the writer, and what the writer put on disk
+	uint64_t captured = 0;
+	uint64_t dropped = 0;
+	uint64_t written = 0;
+	uint64_t bytes = 0;
+	double stall_ms = 0.0;
+	double max_stall_ms = 0.0;
+	double writer_wait_ms = 0.0;
+	bool wait_failed = false;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Split a path around its frame number. %% is a literal %, and at most one
+// %d with an optional 0 flag and width may appear, anything else is refused.
+// conversions is set to the number of %d found, 0 or 1.
+inline bool parseFramePattern(framerecorder &rec, const char *path, int &conversions) {
+	rec.name_prefix.clear();
+	rec.name_suffix.clear();
+	rec.name_width = 0;
+	rec.name_zeros = false;
+	conversions = 0;
+	for (const char *c = path; *c != 0; ++c) {
+		std::string &out = conversions == 0 ? rec.name_prefix : rec.name_suffix;
+		if (*c != '%') {
+			out += *c;
+			continue;
+		}
+		++c;
+		if (*c == '%') {
+			out += '%';
+			continue;
+		}
+		bool zeros = *c == '0';
+		if (zeros) ++c;
+		int width = 0;
+		while (*c >= '0' && *c <= '9' && width <= RECORDER_MAX_WIDTH) width = width * 10 + (*c++ - '0');
+		if (*c != 'd' || conversions > 0 || width > RECORDER_MAX_WIDTH) {
+			fprintf(stderr, "Error: %s is not a frame pattern, it may hold one %%d, %%0Nd or %%Nd (N up to %d) and %%%% for a %%\n",
+				path, RECORDER_MAX_WIDTH);
+			return false;
+		}
+		rec.name_zeros = zeros;
+		rec.name_width = width;
+		conversions = 1;
+	}
+	return true;
+}
+
+// File name of a PPM frame
+inline void recorderFrameName(const framerecorder &rec, uint64_t frame, std::string &name) {
+	char number[32];
+	snprintf(number, sizeof(number), rec.name_zeros ? "%0*llu" : "%*llu", rec.name_width, (unsigned long long)frame);
+	name = rec.name_prefix;
+	name += number;
+	name += rec.name_suffix;
+}
+
+// BT.601 studio range, 4:2:0 chroma from the average of each 2x2 block
+inline void writeY4MFrame(FILE *file, const unsigned char *rgba, int width, int height, std::vector<unsigned char> &planes) {
+	int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+	planes.resize((size_t)width * height + 2 * (size_t)chroma_width * chroma_height);
+	unsigned char *y_plane = &planes[0];
+	unsigned char *u_plane = y_plane + (size_t)width * height;
+	unsigned char *v_plane = u_plane + (size_t)chroma_width * chroma_height;
+	for (int y = 0; y < height; ++y) {
+		// GL rows start at the bottom
+		const unsigned char *row = rgba + (size_t)(height - 1 - y) * width * 4;
+		for (int x = 0; x < width; ++x) {
+			int r = row[x * 4], g = row[x * 4 + 1], b = row[x * 4 + 2];
+			y_plane[(size_t)y * width + x] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+		}
+	}
+	for (int cy = 0; cy < chroma_height; ++cy) {
+		for (int cx = 0; cx < chroma_width; ++cx) {
+			int r = 0, g = 0, b = 0;
+			for (int k = 0; k < 4; ++k) {
+				int x = std::min(width - 1, cx * 2 + (k & 1)), y = std::min(height - 1, cy * 2 + (k >> 1));
+				const unsigned char *p = rgba + ((size_t)(height - 1 - y) * width + x) * 4;
+				r += p[0];
+				g += p[1];
+				b += p[2];
+			}
+			r = (r + 2) / 4;
+			g = (g + 2) / 4;
+			b = (b + 2) / 4;
+			u_plane[(size_t)cy * chroma_width + cx] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			v_plane[(size_t)cy * chroma_width + cx] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+	fputs("FRAME\n", file);
+	fwrite(&planes[0], 1, planes.size(), file);
+}
+
+inline bool writePPMFrame(const char *path, const unsigned char *rgba, int width, int height, std::vector<unsigned char> &rgb) {
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) return false;
+	rgb.resize((size_t)width * height * 3);
+	for (int y = 0; y < height; ++y) {
+		const unsigned char *row = rgba + (size_t)(height - 1 - y) * width * 4;
+		unsigned char *out = &rgb[(size_t)y * width * 3];
+		for (int x = 0; x < width; ++x) {
+			out[x * 3] = row[x * 4];
+			out[x * 3 + 1] = row[x * 4 + 1];
+			out[x * 3 + 2] = row[x * 4 + 2];
+		}
+	}
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	bool ok = fwrite(&rgb[0], 1, rgb.size(), file) == rgb.size();
+	return fclose(file) == 0 && ok;
+}
+
+inline void recorderWriter(framerecorder *rec) {
+	std::vector<unsigned char> scratch;
+	std::string name;
+	traceThreadName("recorder");
+	while (true) {
+		std::vector<unsigned char> frame;
+		{
+			std::unique_lock<std::mutex> guard(rec->lock);
+			rec->changed.wait(guard, [rec] { return !rec->queued.empty() || rec->stopping; });
+			if (rec->queued.empty()) return;
+			frame.swap(rec->queued.front());
+			rec->queued.pop_front();
+		}
+
+		TRACE_ZONE("write frame");
+		size_t bytes = 0;
+		bool ok = true;
+		if (rec->format == RECORD_Y4M) {
+			writeY4MFrame(rec->file, &frame[0], rec->width, rec->height, scratch);
+			bytes = scratch.size() + 6;
+			ok = ferror(rec->file) == 0;
+		}
+		else {
+			recorderFrameName(*rec, rec->written, name);
+			ok = writePPMFrame(name.c_str(), &frame[0], rec->width, rec->height, scratch);
+			bytes = scratch.size();
+		}
+
+		std::lock_guard<std::mutex> guard(rec->lock);
+		rec->written++;
+		rec->bytes += bytes;
+		if (!ok) rec->write_failed = true;
+		rec->spare.push_back(std::vector<unsigned char>());
+		rec->spare.back().swap(frame);
+		rec->changed.notify_all();
+	}
+}
+
+// A path with a frame number is a PPM pattern such as frame%05d.ppm, anything else is a Y4M file
+inline bool createRecorder(framerecorder &rec, const char *path, int width, int height, unsigned int fps) {
+	int conversions = 0;
+	if (!parseFramePattern(rec, path, conversions)) return false;
+	rec.path = path;
+	rec.format = conversions > 0 ? RECORD_PPM : RECORD_Y4M;
+	rec.width = width;
+	rec.height = height;
+	rec.fps = fps;
+	if (rec.format == RECORD_Y4M) {
+		rec.file = fopen(rec.name_prefix.c_str(), "wb");
+		if (rec.file == NULL) {
+			fprintf(stderr, "Cannot open %s for recording\n", rec.name_prefix.c_str());
+			return false;
+		}
+		fprintf(rec.file, "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C420jpeg\n", width, height, fps);
+	}
+
+	GLsizeiptr size = (GLsizeiptr)width * height * 4;
+	glGenBuffers(RECORDER_PBOS, rec.pbos);
+	for (unsigned int i = 0; i < RECORDER_PBOS; ++i) {
+		cachedBindBuffer(GL_PIXEL_PACK_BUFFER, rec.pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+	}
+	cachedBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	rec.spare.assign(RECORDER_QUEUE, std::vector<unsigned char>(size));
+	rec.stopping = false;
+	rec.start = std::chrono::steady_clock::now();
+	rec.writer = std::thread(recorderWriter, &rec);
+	return true;
+}
+
+// Copy the oldest readback out of its PBO and queue it for the writer, the
+// render thread only waits here if the GPU or the writer has fallen behind.
+// A frame that cannot be mapped is dropped and counted.
+inline void collectRecordedFrame(framerecorder &rec, unsigned int index) {
+	if (rec.fences[index] == NULL) return;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+	while (true) {
+		GLenum result = glClientWaitSync(rec.fences[index], flags, 1000000);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) break;
+		if (result == GL_WAIT_FAILED) {
+			// The fence says nothing, so wait for everything before reading the PBO
+			if (!rec.wait_failed) fprintf(stderr, "Recorder: waiting on a readback fence failed, finishing the GL commands instead\n");
+			rec.wait_failed = true;
+			glFinish();
+			break;
+		}
+		flags = 0;
+	}
+	glDeleteSync(rec.fences[index]);
+	rec.fences[index] = NULL;
+	std::chrono::steady_clock::time_point signalled = std::chrono::steady_clock::now();
+
+	std::vector<unsigned char> frame;
+	{
+		std::unique_lock<std::mutex> guard(rec.lock);
+		rec.changed.wait(guard, [&rec] { return !rec.spare.empty(); });
+		frame.swap(rec.spare.back());
+		rec.spare.pop_back();
+	}
+	std::chrono::steady_clock::time_point available = std::chrono::steady_clock::now();
+
+	cachedBindBuffer(GL_PIXEL_PACK_BUFFER, rec.pbos[index]);
+	const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)frame.size(), GL_MAP_READ_BIT);
+	if (pixels != NULL) {
+		memcpy(&frame[0], pixels, frame.size());
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	cachedBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	double stall = std::chrono::duration<double, std::milli>(signalled - begin).count();
+	rec.stall_ms += stall;
+	rec.max_stall_ms = std::max(rec.max_stall_ms, stall);
+	rec.writer_wait_ms += std::chrono::duration<double, std::milli>(available - signalled).count();
+
+	std::lock_guard<std::mutex> guard(rec.lock);
+	if (pixels == NULL) {
+		rec.dropped++;
+		rec.spare.push_back(std::vector<unsigned char>());
+		rec.spare.back().swap(frame);
+		return;
+	}
+	rec.queued.push_back(std::vector<unsigned char>());
+	rec.queued.back().swap(frame);
+	rec.changed.notify_all();
+}
+
+// Read back the framebuffer just rendered, call once per frame after the draws
+inline void captureFrame(framerecorder &rec) {
+	TRACE_ZONE("readback");
+	unsigned int index = rec.next;
+	cachedBindBuffer(GL_PIXEL_PACK_BUFFER, rec.pbos[index]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, rec.width, rec.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	cachedBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	rec.fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	rec.captured++;
+
+	// The oldest readback goes out while the newer ones are still in flight
+	rec.next = (index + 1) % RECORDER_PBOS;
+	collectRecordedFrame(rec, rec.next);
+}
+
+// Collect the readbacks still in flight, let the writer finish and close the output
+inline bool finishRecorder(framerecorder &rec) {
+	for (unsigned int k = 1; k <= RECORDER_PBOS; ++k) collectRecordedFrame(rec, (rec.next + k) % RECORDER_PBOS);
+	{
+		std::lock_guard<std::mutex> guard(rec.lock);
+		rec.stopping = true;
+		rec.changed.notify_all();
+	}
+	if (rec.writer.joinable()) rec.writer.join();
+	if (rec.file != NULL && fclose(rec.file) != 0) rec.write_failed = true;
+	rec.file = NULL;
+	cachedDeleteBuffers(RECORDER_PBOS, rec.pbos);
+	memset(rec.pbos, 0, sizeof(rec.pbos));
+	return !rec.write_failed;
+}
+
+inline void printRecorder(const framerecorder &rec) {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - rec.start).count();
+	double frames = rec.captured > 0 ? double(rec.captured) : 1.0;
+	printf("Recorded %llu frames of %dx%d to %s: %.1f fps sustained, %.1f MB written%s\n", (unsigned long long)rec.written,
+		rec.width, rec.height, rec.path.c_str(), rec.written / seconds, rec.bytes / 1048576.0, rec.write_failed ? ", WRITE FAILED" : "");
+	if (rec.dropped > 0) printf("  %llu frames dropped, their readback could not be mapped\n", (unsigned long long)rec.dropped);
+	printf("  readback stall mean %.3f ms, max %.3f ms, waiting on the writer %.3f ms per frame\n",
+		rec.stall_ms / frames, rec.max_stall_ms, rec.writer_wait_ms / frames);
+}
+
+#endif
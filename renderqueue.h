@@ -0,0 +1,221 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.h"
+#include "shaderprogram.h"
+#include "instancing.h"
+#include "geometryarena.h"
+#include "lod.h"
+
+// Fields of a draw key from the most significant bit down: the pass, the
+// program, the vertex array or material, the Object block slot and the
+// distance from the camera. Sorting the keys runs the passes in order, keeps
+// each program's draws together, the draws of a vertex array together within
+// a program, and those of one object together so arena draws stay in one
+// submit. Only then does the nearest go first, so the depth test rejects what
+// lies behind without splitting a run.
+#define DRAWKEY_PASS_SHIFT 60
+#define DRAWKEY_PROGRAM_SHIFT 50
+#define DRAWKEY_MATERIAL_SHIFT 36
+#define DRAWKEY_OBJECT_SHIFT 28
+#define DRAWKEY_PASS_MASK 0xFu
+#define DRAWKEY_PROGRAM_MASK 0x3FFu
+#define DRAWKEY_MATERIAL_MASK 0x3FFFu
+#define DRAWKEY_OBJECT_MASK 0xFFu
+// Low bits of the depth dropped to make room for the object
+#define DRAWKEY_DEPTH_DROP 4
+
+// Passes run in increasing order
+enum renderpass {
+	RENDER_PASS_OPAQUE
+};
+
+// The program and vertex array fields hold the low bits of their GL names
+inline uint64_t makeDrawKey(unsigned int pass, GLuint program, GLuint material, unsigned int object, float depth) {
+	// Non negative floats order the same as their bits
+	float d = depth > 0.0f ? depth : 0.0f;
+	uint32_t depth_bits;
+	memcpy(&depth_bits, &d, sizeof(depth_bits));
+	return (uint64_t)(pass & DRAWKEY_PASS_MASK) << DRAWKEY_PASS_SHIFT |
+		(uint64_t)(program & DRAWKEY_PROGRAM_MASK) << DRAWKEY_PROGRAM_SHIFT |
+		(uint64_t)(material & DRAWKEY_MATERIAL_MASK) << DRAWKEY_MATERIAL_SHIFT |
+		(uint64_t)(object & DRAWKEY_OBJECT_MASK) << DRAWKEY_OBJECT_SHIFT | depth_bits >> DRAWKEY_DEPTH_DROP;
+}
+
+// An instanced draw, of a mesh in an arena or of a plain vertex array
+struct drawcommand {
+	const shaderprogram *program;
+	unsigned int object;	// slot of the Object block
+	geometryarena *arena;	// NULL for a plain vertex array
+	GLuint vertex_array;
+	unsigned int mesh;	// arena handle, first_index is counted from the mesh's first index
+	unsigned int first_index;
+	unsigned int index_count;
+	GLint base_vertex;
+	unsigned int first_instance;
+	unsigned int instance_count;
+	GLuint instance_buffer;
+};
+
+struct drawpacket {
+	uint64_t key;
+	unsigned int command;
+};
+
+// Draws of one frame, submitted in any order and run sorted by their keys
+struct renderqueue {
+	std::vector<drawcommand> commands;
+	std::vector<drawpacket> packets;
+	std::vector<drawpacket> scratch;
+	// Of the last execute
+	unsigned int program_changes = 0;
+	unsigned int vertex_array_changes = 0;
+	unsigned int object_changes = 0;
+	unsigned int calls = 0;
+};
+
+inline void clearRenderQueue(renderqueue &q) {
+	q.commands.clear();
+	q.packets.clear();
+}
+
+inline void submitDrawCommand(renderqueue &q, uint64_t key, const drawcommand &command) {
+	drawpacket packet = { key, (unsigned int)q.commands.size() };
+	q.commands.push_back(command);
+	q.packets.push_back(packet);
+}
+
+inline void submitArenaDraw(renderqueue &q, uint64_t key, const shaderprogram &program, unsigned int object, geometryarena &arena,
+	unsigned int mesh, unsigned int first_index, unsigned int index_count, unsigned int first_instance, unsigned int instance_count) {
+	drawcommand command = { &program, object, &arena, arena.vao, mesh, first_index, index_count, 0, first_instance, instance_count, arena.instance_buffer };
+	submitDrawCommand(q, key, command);
+}
+
+inline void submitVertexArrayDraw(renderqueue &q, uint64_t key, const shaderprogram &program, unsigned int object, GLuint vertex_array,
+	unsigned int first_index, unsigned int index_count, GLint base_vertex, unsigned int first_instance, unsigned int instance_count, GLuint instance_buffer) {
+	drawcommand command = { &program, object, NULL, vertex_array, 0, first_index, index_count, base_vertex, first_instance, instance_count, instance_buffer };
+	submitDrawCommand(q, key, command);
+}
+
+// Distance from the camera to the bounding sphere of the nearest copy in a batch
+inline float nearestBatchDistance(const lodmesh &mesh, const std::vector<instancedata> &staging, const lodbatch &batch, glm::vec3 camera) {
+	float nearest = FLT_MAX;
+	for (unsigned int i = batch.first_instance; i < batch.first_instance + batch.instance_count; ++i) {
+		const instancedata &instance = staging[i];
+		float distance = glm::length(camera - instancePoint(instance, mesh.center)) - mesh.radius * instance.position_scale.w;
+		nearest = std::min(nearest, distance);
+	}
+	return std::max(nearest, 0.0f);
+}
+
+// Every batch of a mesh stored in the arena, keyed by its nearest copy
+inline void submitArenaLodBatches(renderqueue &q, unsigned int pass, const shaderprogram &program, unsigned int object, geometryarena &arena,
+	unsigned int handle, const lodmesh &mesh, const std::vector<lodbatch> &batches, const std::vector<instancedata> &staging, glm::vec3 camera) {
+	for (size_t b = 0; b < batches.size(); ++b) {
+		const lodlevel &level = mesh.levels[batches[b].level];
+		uint64_t key = makeDrawKey(pass, program.id, arena.vao, object, nearestBatchDistance(mesh, staging, batches[b], camera));
+		submitArenaDraw(q, key, program, object, arena, handle, level.first_index, level.index_count, batches[b].first_instance, batches[b].instance_count);
+	}
+}
+
+// Every batch of a mesh in a plain vertex array, keyed by its nearest copy
+inline void submitVertexArrayLodBatches(renderqueue &q, unsigned int pass, const shaderprogram &program, unsigned int object, GLuint vertex_array,
+	GLint base_vertex, GLuint instance_buffer, const lodmesh &mesh, const std::vector<lodbatch> &batches, const std::vector<instancedata> &staging,
+	glm::vec3 camera) {
+	for (size_t b = 0; b < batches.size(); ++b) {
+		const lodlevel &level = mesh.levels[batches[b].level];
+		uint64_t key = makeDrawKey(pass, program.id, vertex_array, object, nearestBatchDistance(mesh, staging, batches[b], camera));
+		submitVertexArrayDraw(q, key, program, object, vertex_array, level.first_index, level.index_count, base_vertex,
+			batches[b].first_instance, batches[b].instance_count, instance_buffer);
+	}
+}
+
+// Least significant byte first, stable, so equal keys keep their submission
+// order. Bytes every key shares are skipped, which with a handful of programs
+// and vertex arrays leaves the depth bytes and one or two more.
+inline void sortRenderQueue(renderqueue &q) {
+	size_t count = q.packets.size();
+	if (count < 2) return;
+	q.scratch.resize(count);
+
+	uint32_t histograms[8][256];
+	memset(histograms, 0, sizeof(histograms));
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t key = q.packets[i].key;
+		for (int b = 0; b < 8; ++b) histograms[b][(key >> (b * 8)) & 0xFF]++;
+	}
+
+	drawpacket *from = &q.packets[0], *to = &q.scratch[0];
+	for (int b = 0; b < 8; ++b) {
+		uint32_t *histogram = histograms[b];
+		unsigned int shift = b * 8;
+		if (histogram[(from[0].key >> shift) & 0xFF] == count) continue;
+		uint32_t offset = 0;
+		for (int d = 0; d < 256; ++d) {
+			uint32_t n = histogram[d];
+			histogram[d] = offset;
+			offset += n;
+		}
+		for (size_t i = 0; i < count; ++i) to[histogram[(from[i].key >> shift) & 0xFF]++] = from[i];
+		std::swap(from, to);
+	}
+	if (from != &q.packets[0]) q.packets.swap(q.scratch);
+}
+
+// Issue the packets in their current order. State only changes between
+// packets that differ, and consecutive arena draws with the same program and
+// object go out in one submit. Returns the number of draw calls.
+inline unsigned int executeRenderQueue(renderqueue &q, const frameuniforms &frame) {
+	const shaderprogram *program = NULL;
+	unsigned int object = ~0u;
+	GLuint vertex_array = GLSTATE_UNKNOWN;
+	geometryarena *pending = NULL;
+	q.program_changes = q.vertex_array_changes = q.object_changes = q.calls = 0;
+
+	for (size_t p = 0; p < q.packets.size(); ++p) {
+		const drawcommand &c = q.commands[q.packets[p].command];
+		bool program_change = c.program != program;
+		if (pending != NULL && (program_change || c.object != object || c.arena != pending)) {
+			q.calls += submitGeometryArena(*pending);
+			pending = NULL;
+		}
+		if (program_change) {
+			useShaderProgram(*c.program, frame);
+			program = c.program;
+			q.program_changes++;
+		}
+		// Plain uniforms belong to the program, so they are set again after a switch
+		if (program_change || c.object != object) {
+			if (c.object != object) q.object_changes++;
+			bindObject(*c.program, frame, c.object);
+			object = c.object;
+		}
+		if (c.vertex_array != vertex_array) {
+			vertex_array = c.vertex_array;
+			q.vertex_array_changes++;
+		}
+
+		if (c.arena != NULL) {
+			addArenaInstances(*c.arena, c.mesh, c.first_index, c.index_count, c.first_instance, c.instance_count);
+			pending = c.arena;
+			continue;
+		}
+		cachedBindVertexArray(c.vertex_array);
+		drawInstances((GLsizei)c.index_count, c.first_index, c.base_vertex, (GLsizei)c.instance_count, c.first_instance, c.instance_buffer);
+		q.calls++;
+	}
+	if (pending != NULL) q.calls += submitGeometryArena(*pending);
+	return q.calls;
+}
+
+#endif
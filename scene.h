@@ -0,0 +1,172 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "instancing.h"
+#include "jobs.h"
+
+// Parent of an entity at the root of the hierarchy
+#define SCENE_NO_PARENT 0xffffffffu
+// Mesh of an entity that only places its children
+#define SCENE_NO_MESH 0xffffffffu
+// Fewest entities in one job of the world pass
+#define SCENE_MIN_RANGE 16384
+
+// Every entity is an index into parallel arrays, one per component.
+// A parent is always created before its children, so one pass in index
+// order sees every parent's world transform before it is needed.
+struct scene {
+	// Transform, relative to the parent: turned by yaw about y, scaled uniformly
+	std::vector<glm::vec3> position;
+	std::vector<float> yaw;
+	std::vector<float> scale;
+	// Hierarchy
+	std::vector<unsigned int> parent;
+	std::vector<unsigned int> depth;
+	// Mesh, an index into the caller's table of meshes
+	std::vector<unsigned int> mesh;
+	// Animation: radians per second about y, and the flag wave phase
+	std::vector<float> spin;
+	std::vector<float> phase;
+	// World transform written by updateScene, in the layout of the instance buffer
+	std::vector<instancedata> world;
+	// First entity of each depth and one past the last, set by sortScene
+	std::vector<unsigned int> depth_first;
+	bool sorted = true;
+};
+
+inline unsigned int sceneSize(const scene &s) {
+	return (unsigned int)s.parent.size();
+}
+
+inline void reserveScene(scene &s, size_t count) {
+	s.position.reserve(count);
+	s.yaw.reserve(count);
+	s.scale.reserve(count);
+	s.parent.reserve(count);
+	s.depth.reserve(count);
+	s.mesh.reserve(count);
+	s.spin.reserve(count);
+	s.phase.reserve(count);
+	s.world.reserve(count);
+}
+
+// Append an entity, parent must already exist. Returns its index or SCENE_NO_PARENT on error.
+inline unsigned int createEntity(scene &s, unsigned int parent, unsigned int mesh, glm::vec3 position, float yaw, float scale) {
+	unsigned int e = sceneSize(s);
+	if (parent != SCENE_NO_PARENT && parent >= e) {
+		fprintf(stderr, "Entity parent %u does not exist\n", parent);
+		return SCENE_NO_PARENT;
+	}
+	unsigned int depth = parent == SCENE_NO_PARENT ? 0 : s.depth[parent] + 1;
+	if (e > 0 && depth < s.depth[e - 1]) s.sorted = false;
+	s.position.push_back(position);
+	s.yaw.push_back(yaw);
+	s.scale.push_back(scale);
+	s.parent.push_back(parent);
+	s.depth.push_back(depth);
+	s.mesh.push_back(mesh);
+	s.spin.push_back(0.0f);
+	s.phase.push_back(0.0f);
+	s.world.push_back(makeInstance(position, yaw, scale, 0.0f));
+	if (s.sorted) {
+		if (depth + 1 >= s.depth_first.size()) s.depth_first.resize(depth + 2, e);
+		s.depth_first[depth + 1] = e + 1;
+	}
+	return e;
+}
+
+inline void setEntityAnimation(scene &s, unsigned int e, float spin, float phase) {
+	s.spin[e] = spin;
+	s.phase[e] = phase;
+}
+
+template <typename T>
+inline void permuteComponent(std::vector<T> &component, const std::vector<unsigned int> &order) {
+	std::vector<T> sorted(component.size());
+	for (size_t i = 0; i < order.size(); ++i) sorted[i] = component[order[i]];
+	component.swap(sorted);
+}
+
+// Reorder the entities by depth so each depth is one contiguous range the world
+// pass can split between threads. The relative order within a depth is kept, so
+// children stay in the order of their parents. remap[old index] is the new index.
+inline void sortScene(scene &s, std::vector<unsigned int> &remap) {
+	unsigned int count = sceneSize(s);
+	unsigned int depths = 0;
+	for (unsigned int e = 0; e < count; ++e) depths = std::max(depths, s.depth[e] + 1);
+
+	// Counting sort by depth
+	s.depth_first.assign(depths + 1, 0);
+	for (unsigned int e = 0; e < count; ++e) s.depth_first[s.depth[e] + 1]++;
+	for (unsigned int d = 0; d < depths; ++d) s.depth_first[d + 1] += s.depth_first[d];
+	std::vector<unsigned int> next(s.depth_first.begin(), s.depth_first.end() - 1);
+	std::vector<unsigned int> order(count);
+	remap.resize(count);
+	for (unsigned int e = 0; e < count; ++e) {
+		remap[e] = next[s.depth[e]]++;
+		order[remap[e]] = e;
+	}
+
+	permuteComponent(s.position, order);
+	permuteComponent(s.yaw, order);
+	permuteComponent(s.scale, order);
+	permuteComponent(s.parent, order);
+	permuteComponent(s.depth, order);
+	permuteComponent(s.mesh, order);
+	permuteComponent(s.spin, order);
+	permuteComponent(s.phase, order);
+	permuteComponent(s.world, order);
+	for (unsigned int e = 0; e < count; ++e) {
+		if (s.parent[e] != SCENE_NO_PARENT) s.parent[e] = remap[s.parent[e]];
+	}
+	s.sorted = true;
+}
+
+// World transforms of entities begin..end, their parents must be done already
+inline void updateSceneRange(scene &s, unsigned int begin, unsigned int end, double time) {
+	for (unsigned int e = begin; e < end; ++e) {
+		float yaw = s.yaw[e];
+		if (s.spin[e] != 0.0f) yaw += (float)fmod(s.spin[e] * time, 2.0 * M_PI);
+		unsigned int p = s.parent[e];
+		if (p == SCENE_NO_PARENT) {
+			s.world[e] = makeInstance(s.position[e], yaw, s.scale[e], s.phase[e]);
+			continue;
+		}
+		const instancedata &up = s.world[p];
+		s.world[e] = makeInstance(instancePoint(up, s.position[e]), up.yaw_phase.x + yaw, up.position_scale.w * s.scale[e], s.phase[e]);
+	}
+}
+
+// World transform of every entity at time seconds. A sorted scene is updated one
+// depth at a time, each depth split between the threads of jobs. An unsorted
+// scene, or one without a job system, is updated in one pass on the calling thread.
+inline void updateScene(scene &s, double time, jobsystem *jobs = NULL) {
+	if (!s.sorted || jobs == NULL || jobs->thread_count == 1) {
+		updateSceneRange(s, 0, sceneSize(s), time);
+		return;
+	}
+
+	for (size_t d = 0; d + 1 < s.depth_first.size(); ++d) {
+		parallelFor(jobs, s.depth_first[d], s.depth_first[d + 1], SCENE_MIN_RANGE, [&s, time](size_t begin, size_t end) {
+			updateSceneRange(s, (unsigned int)begin, (unsigned int)end, time);
+		});
+	}
+}
+
+// Entities of visible grouped by mesh, groups[mesh] keeps the order of visible
+inline void groupSceneMeshes(const scene &s, const std::vector<unsigned int> &visible, std::vector<std::vector<unsigned int> > &groups) {
+	for (size_t m = 0; m < groups.size(); ++m) groups[m].clear();
+	for (size_t v = 0; v < visible.size(); ++v) {
+		unsigned int mesh = s.mesh[visible[v]];
+		if (mesh < groups.size()) groups[mesh].push_back(visible[v]);
+	}
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef SHADERPROGRAM_H
+#define SHADERPROGRAM_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.h"
+
+// Uniform buffer binding points shared by every program
+#define CAMERA_BINDING 0
+#define OBJECT_BINDING 1
+#define BOUNDS_BINDING 2
+// Meshes with quantized positions one MeshBounds block can describe
+#define MESH_BOUNDS_SLOTS 256
+
+// std140 layout of
+//   layout(std140) uniform Camera { mat4 u_View; mat4 u_Projection; };
+struct camerablock {
+	glm::mat4 view;
+	glm::mat4 projection;
+};
+
+// std140 layout of
+//   layout(std140) uniform Object { mat4 u_Model; float u_Time; };
+struct objectblock {
+	glm::mat4 model;
+	float time;
+	float padding[3];
+};
+
+// std140 layout of
+//   layout(std140) uniform MeshBounds { vec4 u_BoundsCenter[256]; vec4 u_BoundsExtent[256]; };
+struct meshboundsblock {
+	glm::vec4 center[MESH_BOUNDS_SLOTS];
+	glm::vec4 extent[MESH_BOUNDS_SLOTS];
+};
+
+struct shaderuniform {
+	std::string name;
+	GLint location;	// -1 for block members
+	GLenum type;
+	GLint size;
+};
+
+struct shaderblock {
+	std::string name;
+	GLuint index;
+	GLint size;
+};
+
+// Linked program with its interface, reflected once after linking
+struct shaderprogram {
+	GLuint id = 0;
+	std::vector<shaderuniform> uniforms;
+	std::vector<shaderblock> blocks;
+
+	bool camera_block = false;
+	bool object_block = false;
+	bool bounds_block = false;
+
+	// Locations for programs that declare these as plain uniforms instead of blocks
+	GLint model = -1;
+	GLint view = -1;
+	GLint projection = -1;
+	GLint time = -1;
+};
+
+// Location of a plain uniform, -1 if the program has none by that name
+inline GLint findUniform(const shaderprogram &prog, const char *name) {
+	for (size_t i = 0; i < prog.uniforms.size(); ++i) {
+		if (prog.uniforms[i].name == name) return prog.uniforms[i].location;
+	}
+	return -1;
+}
+
+// Record every active uniform and block of a linked program and attach the
+// Camera, Object and MeshBounds blocks to their shared binding points
+inline bool reflectProgram(shaderprogram &prog, GLuint id) {
+	prog = shaderprogram();
+	if (id == 0) return false;
+	prog.id = id;
+
+	GLint count = 0, length = 0;
+	glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &length);
+	std::vector<char> name(length > 0 ? length : 1);
+	for (GLint i = 0; i < count; ++i) {
+		shaderuniform uniform;
+		GLsizei written = 0;
+		glGetActiveUniform(id, (GLuint)i, (GLsizei)name.size(), &written, &uniform.size, &uniform.type, &name[0]);
+		uniform.name.assign(&name[0], written);
+		uniform.location = glGetUniformLocation(id, uniform.name.c_str());
+		prog.uniforms.push_back(uniform);
+	}
+
+	glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &length);
+	name.resize(length > 0 ? length : 1);
+	for (GLint i = 0; i < count; ++i) {
+		shaderblock block;
+		GLsizei written = 0;
+		glGetActiveUniformBlockName(id, (GLuint)i, (GLsizei)name.size(), &written, &name[0]);
+		block.name.assign(&name[0], written);
+		block.index = (GLuint)i;
+		glGetActiveUniformBlockiv(id, block.index, GL_UNIFORM_BLOCK_DATA_SIZE, &block.size);
+		prog.blocks.push_back(block);
+
+		if (block.name == "Camera" && block.size <= (GLint)sizeof(camerablock)) {
+			glUniformBlockBinding(id, block.index, CAMERA_BINDING);
+			prog.camera_block = true;
+		}
+		else if (block.name == "Object" && block.size <= (GLint)sizeof(objectblock)) {
+			glUniformBlockBinding(id, block.index, OBJECT_BINDING);
+			prog.object_block = true;
+		}
+		else if (block.name == "MeshBounds" && block.size <= (GLint)sizeof(meshboundsblock)) {
+			glUniformBlockBinding(id, block.index, BOUNDS_BINDING);
+			prog.bounds_block = true;
+		}
+		else {
+			std::cerr << "Warning: uniform block " << block.name << " (" << block.size << " bytes) is not bound" << std::endl;
+		}
+	}
+
+	prog.model = findUniform(prog, "u_Model");
+	prog.view = findUniform(prog, "u_View");
+	prog.projection = findUniform(prog, "u_Projection");
+	prog.time = findUniform(prog, "u_Time");
+	return true;
+}
+
+inline void destroyShaderProgram(shaderprogram &prog) {
+	if (prog.id != 0) glDeleteProgram(prog.id);
+	prog = shaderprogram();
+}
+
+// Uniform buffers rewritten once per frame: one camera block and one object
+// block per draw, each object slot aligned for glBindBufferRange
+struct frameuniforms {
+	GLuint camera_buffer = 0;
+	GLuint object_buffer = 0;
+	GLsizeiptr object_stride = 0;
+	camerablock camera;
+	std::vector<char> objects;
+};
+
+inline void createFrameUniforms(frameuniforms &frame, unsigned int object_count) {
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	frame.object_stride = ((GLsizeiptr)sizeof(objectblock) + alignment - 1) / alignment * alignment;
+	frame.objects.assign(frame.object_stride * object_count, 0);
+	frame.camera = camerablock();
+
+	glGenBuffers(1, &frame.camera_buffer);
+	cachedBindBuffer(GL_UNIFORM_BUFFER, frame.camera_buffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(camerablock), NULL, GL_DYNAMIC_DRAW);
+	cachedBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, frame.camera_buffer);
+
+	glGenBuffers(1, &frame.object_buffer);
+	cachedBindBuffer(GL_UNIFORM_BUFFER, frame.object_buffer);
+	glBufferData(GL_UNIFORM_BUFFER, frame.objects.size(), NULL, GL_DYNAMIC_DRAW);
+	cachedBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+inline void destroyFrameUniforms(frameuniforms &frame) {
+	cachedDeleteBuffers(1, &frame.camera_buffer);
+	cachedDeleteBuffers(1, &frame.object_buffer);
+	frame.camera_buffer = frame.object_buffer = 0;
+	frame.objects.clear();
+}
+
+inline void setObject(frameuniforms &frame, unsigned int slot, const glm::mat4 &model, float time) {
+	objectblock *object = (objectblock*)&frame.objects[slot * frame.object_stride];
+	object->model = model;
+	object->time = time;
+}
+
+// Upload the camera and every object slot, once per frame before the draws
+inline void uploadFrameUniforms(frameuniforms &frame, const glm::mat4 &view, const glm::mat4 &projection) {
+	frame.camera.view = view;
+	frame.camera.projection = projection;
+	cachedBindBuffer(GL_UNIFORM_BUFFER, frame.camera_buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(camerablock), &frame.camera);
+	cachedBindBuffer(GL_UNIFORM_BUFFER, frame.object_buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, frame.objects.size(), &frame.objects[0]);
+}
+
+// Make prog current, programs without the Camera block get the camera as plain uniforms
+inline void useShaderProgram(const shaderprogram &prog, const frameuniforms &frame) {
+	cachedUseProgram(prog.id);
+	if (!prog.camera_block) {
+		if (prog.view != -1) glUniformMatrix4fv(prog.view, 1, GL_FALSE, &frame.camera.view[0][0]);
+		if (prog.projection != -1) glUniformMatrix4fv(prog.projection, 1, GL_FALSE, &frame.camera.projection[0][0]);
+	}
+}
+
+// Point the Object block at slot, or set the plain uniforms of the current program
+inline void bindObject(const shaderprogram &prog, const frameuniforms &frame, unsigned int slot) {
+	if (prog.object_block) {
+		cachedBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BINDING, frame.object_buffer, slot * frame.object_stride, sizeof(objectblock));
+		return;
+	}
+	const objectblock *object = (const objectblock*)&frame.objects[slot * frame.object_stride];
+	if (prog.model != -1) glUniformMatrix4fv(prog.model, 1, GL_FALSE, &object->model[0][0]);
+	if (prog.time != -1) glUniform1f(prog.time, object->time);
+}
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+// Quadric error simplification (Garland and Heckbert, "Surface Simplification
+// Using Quadric Error Metrics") by half-edge collapses. Vertices never move, a
+// collapse only redirects triangles from one vertex to a neighbour, so every
+// simplified index list still indexes the original vertex buffer.
+//
+// Meshes that deform at runtime pass several poses; a collapse has to be cheap
+// in all of them.
+
+// Symmetric 4x4 matrix of the summed squared plane distances and the total plane weight
+struct quadric {
+	double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+	double w = 0;
+};
+
+inline void addPlane(quadric &q, double a, double b, double c, double d, double weight) {
+	q.a2 += weight * a * a; q.ab += weight * a * b; q.ac += weight * a * c; q.ad += weight * a * d;
+	q.b2 += weight * b * b; q.bc += weight * b * c; q.bd += weight * b * d;
+	q.c2 += weight * c * c; q.cd += weight * c * d;
+	q.d2 += weight * d * d;
+	q.w += weight;
+}
+
+inline void addQuadric(quadric &q, const quadric &r) {
+	q.a2 += r.a2; q.ab += r.ab; q.ac += r.ac; q.ad += r.ad;
+	q.b2 += r.b2; q.bc += r.bc; q.bd += r.bd;
+	q.c2 += r.c2; q.cd += r.cd;
+	q.d2 += r.d2;
+	q.w += r.w;
+}
+
+// Weighted mean of the squared distances of p to the planes in q
+inline double quadricError(const quadric &q, const glm::vec3 &p) {
+	if (q.w <= 0.0) return 0.0;
+	double x = p.x, y = p.y, z = p.z;
+	double error = q.a2 * x * x + q.b2 * y * y + q.c2 * z * z
+		+ 2.0 * (q.ab * x * y + q.ac * x * z + q.bc * y * z)
+		+ 2.0 * (q.ad * x + q.bd * y + q.cd * z) + q.d2;
+	return error > 0.0 ? error / q.w : 0.0;
+}
+
+// Weight of the planes that keep open borders in place, relative to surface planes
+#define SIMPLIFY_BORDER_WEIGHT 10.0
+
+// State kept between simplification steps, so the levels of a chain are cut
+// from one run and the errors accumulate the way they do on screen
+struct simplifier {
+	const glm::vec3 *vertices = NULL;	// interleaved position/color pairs
+	size_t vertex_count = 0;
+	std::vector<std::vector<glm::vec3> > poses;
+	std::vector<quadric> quadrics;	// vertex_count x pose count
+	std::vector<char> locked;
+	std::vector<unsigned int> indexes;	// current triangles
+	double worst_cost = 0.0;
+};
+
+inline uint64_t simplifyEdgeKey(unsigned int a, unsigned int b) {
+	return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+}
+
+// Sorted keys of the edges used by a single triangle, and the vertices on them
+inline void findBorderEdges(const std::vector<unsigned int> &indexes, size_t vertex_count, std::vector<uint64_t> &edges, std::vector<uint64_t> &borders, std::vector<char> &border) {
+	edges.clear();
+	for (size_t i = 0; i < indexes.size(); i += 3) {
+		for (int k = 0; k < 3; ++k) edges.push_back(simplifyEdgeKey(indexes[i + k], indexes[i + (k + 1) % 3]));
+	}
+	std::sort(edges.begin(), edges.end());
+
+	borders.clear();
+	border.assign(vertex_count, 0);
+	for (size_t i = 0; i < edges.size(); ) {
+		size_t j = i + 1;
+		while (j < edges.size() && edges[j] == edges[i]) ++j;
+		if (j - i == 1) {
+			borders.push_back(edges[i]);
+			border[edges[i] >> 32] = border[edges[i] & 0xffffffffu] = 1;
+		}
+		i = j;
+	}
+}
+
+inline bool isBorderEdge(const std::vector<uint64_t> &borders, unsigned int a, unsigned int b) {
+	return std::binary_search(borders.begin(), borders.end(), simplifyEdgeKey(a, b));
+}
+
+// vertices: interleaved position/color pairs, vertex_count vertices.
+// poses: per pose positions for vertex_count vertices, the rest positions are used if empty.
+inline void initSimplifier(simplifier &s, const std::vector<unsigned int> &indexes, const glm::vec3 *vertices, size_t vertex_count,
+	const std::vector<std::vector<glm::vec3> > &poses) {
+	s.vertices = vertices;
+	s.vertex_count = vertex_count;
+	s.indexes = indexes;
+	s.worst_cost = 0.0;
+	s.poses = poses;
+	if (s.poses.empty()) {
+		s.poses.resize(1);
+		s.poses[0].resize(vertex_count);
+		for (size_t v = 0; v < vertex_count; ++v) s.poses[0][v] = vertices[2 * v];
+	}
+	const size_t pose_count = s.poses.size();
+
+	// Vertices at the same rest position but with another color sit on a seam and are locked
+	std::vector<unsigned int> order(vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v) order[v] = (unsigned int)v;
+	std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		return memcmp(&vertices[2 * a], &vertices[2 * b], sizeof(glm::vec3)) < 0;
+	});
+	s.locked.assign(vertex_count, 0);
+	for (size_t i = 1; i < vertex_count; ++i) {
+		if (memcmp(&vertices[2 * order[i]], &vertices[2 * order[i - 1]], sizeof(glm::vec3)) == 0) {
+			s.locked[order[i]] = s.locked[order[i - 1]] = 1;
+		}
+	}
+
+	std::vector<uint64_t> edges, borders;
+	std::vector<char> border;
+	findBorderEdges(s.indexes, vertex_count, edges, borders, border);
+
+	// Which edges of each triangle are on a border, looked up once for all poses
+	std::vector<unsigned char> border_mask(s.indexes.size() / 3, 0);
+	for (size_t i = 0; i < s.indexes.size(); i += 3) {
+		for (int k = 0; k < 3; ++k) {
+			if (isBorderEdge(borders, s.indexes[i + k], s.indexes[i + (k + 1) % 3])) border_mask[i / 3] |= 1 << k;
+		}
+	}
+
+	// Quadrics per vertex and pose: area weighted triangle planes plus planes through the borders
+	s.quadrics.assign(vertex_count * pose_count, quadric());
+	for (size_t p = 0; p < pose_count; ++p) {
+		const std::vector<glm::vec3> &P = s.poses[p];
+		for (size_t i = 0; i < s.indexes.size(); i += 3) {
+			const unsigned int *tri = &s.indexes[i];
+			glm::dvec3 p0(P[tri[0]]), p1(P[tri[1]]), p2(P[tri[2]]);
+			glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+			double length = glm::length(normal);
+			if (length == 0.0) continue;
+			normal /= length;
+			double d = -glm::dot(normal, p0);
+			for (int k = 0; k < 3; ++k) {
+				addPlane(s.quadrics[tri[k] * pose_count + p], normal.x, normal.y, normal.z, d, length * 0.5);
+			}
+
+			for (int k = 0; k < 3; ++k) {
+				unsigned int a = tri[k], b = tri[(k + 1) % 3];
+				if (!(border_mask[i / 3] & (1 << k))) continue;
+				glm::dvec3 pa(P[a]), pb(P[b]);
+				glm::dvec3 along = pb - pa;
+				double edge_length = glm::length(along);
+				if (edge_length == 0.0) continue;
+				glm::dvec3 side = glm::normalize(glm::cross(along, normal));
+				double sd = -glm::dot(side, pa);
+				double weight = SIMPLIFY_BORDER_WEIGHT * edge_length * edge_length;
+				addPlane(s.quadrics[a * pose_count + p], side.x, side.y, side.z, sd, weight);
+				addPlane(s.quadrics[b * pose_count + p], side.x, side.y, side.z, sd, weight);
+			}
+		}
+	}
+}
+
+// Collapse until s.indexes is at most target_index_count long or the next
+// collapse would move the surface by more than max_error. Only vertices of equal
+// color are merged and border vertices only slide along their border.
+// Returns the largest error of any collapse so far, in the units of the positions.
+inline float simplifyTo(simplifier &s, size_t target_index_count, float max_error) {
+	const size_t vertex_count = s.vertex_count;
+	const size_t pose_count = s.poses.size();
+	const double max_cost = double(max_error) * double(max_error) * double(pose_count);
+	std::vector<unsigned int> &indexes = s.indexes;
+
+	struct collapse { unsigned int from, to; double cost; };
+	std::vector<collapse> candidates;
+	std::vector<unsigned int> offsets, adjacency, fill;
+	std::vector<uint64_t> edges, borders;
+	std::vector<char> border, touched(vertex_count);
+	std::vector<double> best_cost(vertex_count);
+	std::vector<unsigned int> best_target(vertex_count);
+	// Vertices whose best collapse may have changed, all of them at first
+	std::vector<char> dirty(vertex_count, 1);
+
+	auto cost = [&](unsigned int from, unsigned int to) {
+		double total = 0.0;
+		for (size_t p = 0; p < pose_count; ++p) {
+			quadric q = s.quadrics[from * pose_count + p];
+			addQuadric(q, s.quadrics[to * pose_count + p]);
+			total += quadricError(q, s.poses[p][to]);
+		}
+		return total;
+	};
+
+	size_t triangle_count = indexes.size() / 3;
+	const size_t target_triangles = target_index_count / 3;
+	while (triangle_count > target_triangles) {
+		findBorderEdges(indexes, vertex_count, edges, borders, border);
+
+		// Triangles around each vertex
+		offsets.assign(vertex_count + 1, 0);
+		for (size_t i = 0; i < indexes.size(); ++i) offsets[indexes[i] + 1]++;
+		for (size_t v = 0; v < vertex_count; ++v) offsets[v + 1] += offsets[v];
+		adjacency.resize(indexes.size());
+		fill.assign(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < indexes.size(); ++i) adjacency[fill[indexes[i]]++] = (unsigned int)(i / 3);
+
+		// Cheapest allowed collapse out of every vertex, kept from the last pass where nothing nearby changed
+		for (size_t v = 0; v < vertex_count; ++v) {
+			if (dirty[v]) best_cost[v] = max_cost * 2.0 + 1.0;
+		}
+		for (size_t i = 0; i < indexes.size(); ++i) {
+			unsigned int from = indexes[i];
+			if (s.locked[from] || !dirty[from]) continue;
+			size_t t = i / 3 * 3;
+			for (int j = 1; j < 3; ++j) {
+				unsigned int to = indexes[t + (i - t + j) % 3];
+				if (memcmp(&s.vertices[2 * from + 1], &s.vertices[2 * to + 1], sizeof(glm::vec3)) != 0) continue;
+				if (border[from] && (!border[to] || !isBorderEdge(borders, from, to))) continue;
+				double c = cost(from, to);
+				if (c < best_cost[from]) {
+					best_cost[from] = c;
+					best_target[from] = to;
+				}
+			}
+		}
+		candidates.clear();
+		for (size_t v = 0; v < vertex_count; ++v) {
+			if (best_cost[v] <= max_cost) {
+				collapse c = { (unsigned int)v, best_target[v], best_cost[v] };
+				candidates.push_back(c);
+			}
+		}
+		if (candidates.empty()) break;
+		std::sort(candidates.begin(), candidates.end(), [](const collapse &x, const collapse &y) { return x.cost < y.cost; });
+
+		// Apply the cheapest ones whose neighbourhoods do not overlap
+		std::fill(touched.begin(), touched.end(), 0);
+		size_t applied = 0;
+		for (size_t c = 0; c < candidates.size() && triangle_count > target_triangles; ++c) {
+			unsigned int from = candidates[c].from, to = candidates[c].to;
+			if (touched[from] || touched[to]) continue;
+
+			// Reject collapses that flip or flatten a remaining triangle in any pose
+			bool valid = true;
+			size_t removed = 0;
+			for (unsigned int a = offsets[from]; a < offsets[from + 1] && valid; ++a) {
+				const unsigned int *tri = &indexes[3 * adjacency[a]];
+				if (tri[0] == to || tri[1] == to || tri[2] == to) {
+					++removed;
+					continue;
+				}
+				for (size_t p = 0; p < pose_count && valid; ++p) {
+					const std::vector<glm::vec3> &P = s.poses[p];
+					glm::vec3 q[3], r[3];
+					for (int k = 0; k < 3; ++k) {
+						q[k] = P[tri[k]];
+						r[k] = P[tri[k] == from ? to : tri[k]];
+					}
+					glm::vec3 before = glm::cross(q[1] - q[0], q[2] - q[0]);
+					glm::vec3 after = glm::cross(r[1] - r[0], r[2] - r[0]);
+					valid = glm::dot(before, after) > 0.25f * glm::length(before) * glm::length(after);
+				}
+			}
+			if (!valid) continue;
+
+			// Redirect the triangles, the ones holding both vertices are dropped when compacting
+			for (unsigned int a = offsets[from]; a < offsets[from + 1]; ++a) {
+				unsigned int *tri = &indexes[3 * adjacency[a]];
+				for (int k = 0; k < 3; ++k) {
+					touched[tri[k]] = 1;
+					if (tri[k] == from) tri[k] = to;
+				}
+			}
+			for (size_t p = 0; p < pose_count; ++p) addQuadric(s.quadrics[to * pose_count + p], s.quadrics[from * pose_count + p]);
+			// from is gone from every triangle and must not come back as a candidate
+			best_cost[from] = max_cost * 2.0 + 1.0;
+
+			triangle_count -= removed;
+			s.worst_cost = std::max(s.worst_cost, candidates[c].cost);
+			++applied;
+		}
+
+		// Everything sharing a triangle with a changed vertex needs a new best collapse
+		std::fill(dirty.begin(), dirty.end(), 0);
+		for (size_t i = 0; i < indexes.size(); i += 3) {
+			if (touched[indexes[i]] || touched[indexes[i + 1]] || touched[indexes[i + 2]]) {
+				dirty[indexes[i]] = dirty[indexes[i + 1]] = dirty[indexes[i + 2]] = 1;
+			}
+		}
+
+		// Drop the degenerate triangles
+		size_t write = 0;
+		for (size_t i = 0; i < indexes.size(); i += 3) {
+			unsigned int a = indexes[i], b = indexes[i + 1], c = indexes[i + 2];
+			if (a == b || b == c || a == c) continue;
+			indexes[write++] = a;
+			indexes[write++] = b;
+			indexes[write++] = c;
+		}
+		indexes.resize(write);
+		triangle_count = write / 3;
+
+		if (applied == 0) break;
+	}
+
+	return (float)sqrt(s.worst_cost / double(pose_count));
+}
+
+// Simplify indexes in place in one step, see simplifyTo
+inline float simplifyMesh(std::vector<unsigned int> &indexes, const glm::vec3 *vertices, size_t vertex_count,
+	const std::vector<std::vector<glm::vec3> > &poses, size_t target_index_count, float max_error) {
+	simplifier s;
+	initSimplifier(s, indexes, vertices, vertex_count, poses);
+	float error = simplifyTo(s, target_index_count, max_error);
+	indexes.swap(s.indexes);
+	return error;
+}
+
+#endif
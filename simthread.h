@@ -0,0 +1,218 @@
+#ifndef SIMTHREAD_H
+#define SIMTHREAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "trace.h"
+
+// Fixed step of the simulation thread, seconds
+#define SIM_TIMESTEP (1.0 / 60.0)
+// Steps the simulation may fall behind its schedule before it gives the time up
+#define SIM_MAX_LAG 4
+// Set in the middle index of a triple buffer until the reader has taken it
+#define TRIPLEBUFFER_FRESH 4u
+// Most recent samples a sample ring keeps for its percentiles
+#define SAMPLE_RING_SIZE 4096
+
+// The last SAMPLE_RING_SIZE of a series of samples in milliseconds and how many
+// there were in all. The storage is allocated once, adding never allocates.
+struct samplering {
+	std::vector<double> samples;
+	uint64_t count = 0;
+};
+
+inline void resetSampleRing(samplering &r) {
+	r.samples.assign(SAMPLE_RING_SIZE, 0.0);
+	r.count = 0;
+}
+
+inline void addRingSample(samplering &r, double ms) {
+	if (r.samples.empty()) return;
+	r.samples[r.count % r.samples.size()] = ms;
+	r.count++;
+}
+
+// Samples still in the ring, in no particular order
+inline std::vector<double> ringSamples(const samplering &r) {
+	size_t n = (size_t)std::min<uint64_t>(r.count, r.samples.size());
+	return std::vector<double>(r.samples.begin(), r.samples.begin() + n);
+}
+
+// Three copies of T: the writer fills its back copy, the reader holds its front
+// copy and the middle one is the latest complete copy. Each side swaps its copy
+// with the middle in one atomic exchange, so neither ever waits for the other.
+template <typename T>
+struct triplebuffer {
+	T slots[3];
+	std::atomic<unsigned int> middle;
+	unsigned int back = 0;
+	unsigned int front = 2;
+	triplebuffer() : middle(1) {}
+};
+
+template <typename T>
+inline T &tripleBufferBack(triplebuffer<T> &tb) {
+	return tb.slots[tb.back];
+}
+
+template <typename T>
+inline const T &tripleBufferFront(const triplebuffer<T> &tb) {
+	return tb.slots[tb.front];
+}
+
+// Make the back copy the latest, the writer carries on in the old middle one
+template <typename T>
+inline void publishTripleBuffer(triplebuffer<T> &tb) {
+	tb.back = tb.middle.exchange(tb.back | TRIPLEBUFFER_FRESH, std::memory_order_acq_rel) & 3u;
+}
+
+// Take the latest copy as the front one if it is newer, returns whether it was
+template <typename T>
+inline bool acquireTripleBuffer(triplebuffer<T> &tb) {
+	if ((tb.middle.load(std::memory_order_relaxed) & TRIPLEBUFFER_FRESH) == 0) return false;
+	tb.front = tb.middle.exchange(tb.front, std::memory_order_acq_rel) & 3u;
+	return true;
+}
+
+// State of one simulation step and of the step before it, so the render
+// thread can draw any moment in between
+struct simsnapshot {
+	uint64_t step = 0;
+	// Simulation time of the step and when it was due, seconds since the thread started
+	double time = 0.0;
+	double due = 0.0;
+	// When the step was published
+	double published = 0.0;
+	// Previous and current camera and flag positions, no positions when the GPU animates the flag
+	glm::vec3 camera[2];
+	std::vector<glm::vec3> positions[2];
+};
+
+// Thread running a fixed step simulation, independent of the frame rate
+struct simthread {
+	std::thread thread;
+	std::atomic<bool> running;
+	triplebuffer<simsnapshot> snapshots;
+	// Fills the current camera and positions of a snapshot for time seconds, called on the simulation thread
+	std::function<void(simsnapshot&, double)> step;
+	std::chrono::steady_clock::time_point start;
+	// Lateness of the steps against their schedule in milliseconds and the steps given up,
+	// only read once the thread has stopped
+	samplering lateness;
+	uint64_t dropped = 0;
+	~simthread();
+};
+
+// Seconds on the clock of the simulation
+inline double simClock(const simthread &sim) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - sim.start).count();
+}
+
+inline void simThreadLoop(simthread *sim) {
+	typedef std::chrono::steady_clock clock;
+	clock::duration dt = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(SIM_TIMESTEP));
+	clock::time_point due = sim->start;
+	std::vector<glm::vec3> last_positions;
+	glm::vec3 last_camera(0.0f);
+	uint64_t step = 0;
+	traceThreadName("simulation");
+	while (sim->running) {
+		std::this_thread::sleep_until(due);
+		addRingSample(sim->lateness, std::chrono::duration<double, std::milli>(clock::now() - due).count());
+
+		simsnapshot &s = tripleBufferBack(sim->snapshots);
+		s.step = step;
+		s.time = double(step) * SIM_TIMESTEP;
+		s.due = std::chrono::duration<double>(due - sim->start).count();
+		{
+			TRACE_ZONE("sim step");
+			sim->step(s, s.time);
+		}
+		// The first step has nothing before it
+		if (step == 0) {
+			last_positions = s.positions[1];
+			last_camera = s.camera[1];
+		}
+		s.positions[0].swap(last_positions);
+		s.camera[0] = last_camera;
+		last_positions = s.positions[1];
+		last_camera = s.camera[1];
+		s.published = simClock(*sim);
+		publishTripleBuffer(sim->snapshots);
+
+		// A step that took too long makes the following ones late, past a few the time is dropped
+		++step;
+		due += dt;
+		clock::time_point now = clock::now();
+		if (now - due > SIM_MAX_LAG * dt) {
+			sim->dropped += (uint64_t)((now - due) / dt);
+			due = now;
+		}
+	}
+}
+
+// Start stepping. Every copy of the snapshot must hold the initial positions,
+// a step may only write what changes.
+inline void startSimThread(simthread &sim, const std::vector<glm::vec3> &positions, std::function<void(simsnapshot&, double)> step) {
+	for (int k = 0; k < 3; ++k) {
+		sim.snapshots.slots[k].positions[0] = positions;
+		sim.snapshots.slots[k].positions[1] = positions;
+	}
+	sim.step = step;
+	resetSampleRing(sim.lateness);
+	sim.dropped = 0;
+	sim.start = std::chrono::steady_clock::now();
+	sim.running = true;
+	sim.thread = std::thread(simThreadLoop, &sim);
+}
+
+inline void stopSimThread(simthread &sim) {
+	sim.running = false;
+	if (sim.thread.joinable()) sim.thread.join();
+}
+
+inline simthread::~simthread() {
+	stopSimThread(*this);
+}
+
+// Where the render thread is between the two steps of a snapshot: it draws
+// one step behind the simulation, so the newest step is reached when the next is due
+inline float snapshotBlend(const simthread &sim, const simsnapshot &s) {
+	return (float)std::min(1.0, std::max(0.0, (simClock(sim) - s.due) / SIM_TIMESTEP));
+}
+
+inline void blendSnapshotPositions(const simsnapshot &s, float blend, glm::vec3 *positions) {
+	const glm::vec3 *from = &s.positions[0][0], *to = &s.positions[1][0];
+	for (size_t i = 0; i < s.positions[1].size(); ++i) positions[i] = from[i] + (to[i] - from[i]) * blend;
+}
+
+// Nearest rank percentiles of the samples in a ring
+inline void printPercentiles(const char *label, const samplering &ring) {
+	std::vector<double> samples = ringSamples(ring);
+	if (samples.empty()) return;
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	printf("%s: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms", label, samples[(n * 50 + 99) / 100 - 1],
+		samples[(n * 95 + 99) / 100 - 1], samples[(n * 99 + 99) / 100 - 1], samples[n - 1]);
+	if (n < ring.count) printf(" over the last %u", (unsigned int)n);
+	printf("\n");
+}
+
+// Step jitter of a stopped simulation thread and the render latency, from a step
+// being published to the end of the frame that showed it
+inline void printSimStats(const simthread &sim, const samplering &latency) {
+	printf("Simulation: %llu steps at %.0f Hz, %llu dropped\n", (unsigned long long)sim.lateness.count, 1.0 / SIM_TIMESTEP, (unsigned long long)sim.dropped);
+	printPercentiles("  step lateness", sim.lateness);
+	printPercentiles("  render latency", latency);
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+#include <GL/glew.h>
+
+#include "glstate.h"
+
+// Number of regions in the ring, the CPU writes one while the GPU may still read the others
+#define STREAMBUFFER_REGIONS 3
+
+// How per-frame vertex data reaches the GPU
+enum streammode {
+	STREAM_SUBDATA,		// glBufferSubData into the same storage every frame
+	STREAM_ORPHAN,		// glBufferData(NULL) to orphan, then glBufferSubData
+	STREAM_PERSISTENT	// persistent coherent mapping with a fenced ring of regions
+};
+
+inline const char *streamModeName(streammode mode) {
+	switch (mode) {
+	case STREAM_SUBDATA: return "subdata";
+	case STREAM_ORPHAN: return "orphan";
+	default: return "persistent";
+	}
+}
+
+// Ring buffer for vertex data rewritten every frame
+struct streambuffer {
+	GLuint buffer = 0;
+	GLsizeiptr region_size = 0;
+	unsigned int region = 0;
+	streammode mode = STREAM_SUBDATA;
+	char *mapped = NULL;
+	GLsync fences[STREAMBUFFER_REGIONS] = {};
+	bool wait_failed = false;
+};
+
+// Create the buffer, initial fills every region. Persistent mode falls back to
+// orphaning when the context lacks GL_ARB_buffer_storage.
+inline bool createStreamBuffer(streambuffer &sb, GLsizeiptr region_size, const void *initial, streammode mode) {
+	if (mode == STREAM_PERSISTENT && !GLEW_ARB_buffer_storage) {
+		std::cerr << "Warning: GL_ARB_buffer_storage not supported, orphaning instead" << std::endl;
+		mode = STREAM_ORPHAN;
+	}
+
+	sb.region_size = region_size;
+	sb.region = 0;
+	sb.mode = mode;
+
+	glGenBuffers(1, &sb.buffer);
+	cachedBindBuffer(GL_ARRAY_BUFFER, sb.buffer);
+
+	if (mode == STREAM_PERSISTENT) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, region_size * STREAMBUFFER_REGIONS, NULL, flags);
+		sb.mapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, region_size * STREAMBUFFER_REGIONS, flags);
+		if (sb.mapped == NULL) {
+			std::cerr << "Error: could not map stream buffer" << std::endl;
+			cachedDeleteBuffers(1, &sb.buffer);
+			sb.buffer = 0;
+			return false;
+		}
+		for (unsigned int i = 0; i < STREAMBUFFER_REGIONS; ++i) {
+			memcpy(sb.mapped + i * region_size, initial, region_size);
+		}
+	}
+	else {
+		glBufferData(GL_ARRAY_BUFFER, region_size, initial, mode == STREAM_ORPHAN ? GL_STREAM_DRAW : GL_DYNAMIC_DRAW);
+	}
+
+	return true;
+}
+
+// Wait until the GPU is done with the current region and return it for writing,
+// NULL if the buffer is not persistently mapped
+inline char *mapStreamRegion(streambuffer &sb) {
+	if (sb.mode != STREAM_PERSISTENT) return NULL;
+
+	GLsync fence = sb.fences[sb.region];
+	if (fence != NULL) {
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (true) {
+			GLenum result = glClientWaitSync(fence, flags, 1000000);
+			if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) break;
+			if (result == GL_WAIT_FAILED) {
+				// The fence cannot tell us whether the GPU is done, so make sure it is
+				if (!sb.wait_failed) std::cerr << "Warning: waiting on a stream buffer fence failed, finishing the GL commands instead" << std::endl;
+				sb.wait_failed = true;
+				glFinish();
+				break;
+			}
+			flags = 0;
+		}
+		glDeleteSync(fence);
+		sb.fences[sb.region] = NULL;
+	}
+
+	return sb.mapped + sb.region * sb.region_size;
+}
+
+// Copy a frame's data in for the non persistent modes, the buffer must be bound to GL_ARRAY_BUFFER
+inline void uploadStreamRegion(streambuffer &sb, const void *data) {
+	if (sb.mode == STREAM_ORPHAN) {
+		glBufferData(GL_ARRAY_BUFFER, sb.region_size, NULL, GL_STREAM_DRAW);
+	}
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sb.region_size, data);
+}
+
+// First vertex of the current region for glDrawElementsBaseVertex
+inline GLint streamBaseVertex(const streambuffer &sb, GLsizeiptr vertex_size) {
+	return (GLint)(sb.region * (sb.region_size / vertex_size));
+}
+
+// Call after the draws that read the current region have been issued
+inline void fenceStreamRegion(streambuffer &sb) {
+	if (sb.mode != STREAM_PERSISTENT) return;
+
+	sb.fences[sb.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	sb.region = (sb.region + 1) % STREAMBUFFER_REGIONS;
+}
+
+inline void destroyStreamBuffer(streambuffer &sb) {
+	for (unsigned int i = 0; i < STREAMBUFFER_REGIONS; ++i) {
+		if (sb.fences[i] != NULL) glDeleteSync(sb.fences[i]);
+		sb.fences[i] = NULL;
+	}
+	if (sb.mapped != NULL) {
+		cachedBindBuffer(GL_ARRAY_BUFFER, sb.buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		sb.mapped = NULL;
+	}
+	cachedDeleteBuffers(1, &sb.buffer);
+	sb.buffer = 0;
+}
+
+#endif
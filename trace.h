@@ -0,0 +1,276 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+// Set to 0 to compile the TRACE_ZONE scopes and counters out entirely
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Events one thread keeps, a power of two. Past that the newest overwrite the oldest.
+#ifndef TRACE_THREAD_EVENTS
+#define TRACE_THREAD_EVENTS (1 << 18)
+#endif
+
+enum traceeventtype { TRACE_ZONE_EVENT, TRACE_COUNTER_EVENT };
+
+// A zone with its duration or a counter with its value, name must outlive the trace
+struct traceevent {
+	const char *name;
+	uint64_t start_ns;
+	int64_t value;
+	int type;
+};
+
+// Ring of the newest events of one thread. Only that thread writes them and it
+// publishes the number written after each event, so an export from another
+// thread knows which slots hold complete events and which it may have raced with.
+struct tracebuffer {
+	std::unique_ptr<traceevent[]> events;
+	std::atomic<uint64_t> written;
+	unsigned int thread_id = 0;
+	std::string name;
+	tracebuffer() : written(0) {}
+};
+
+// Buffers of every thread that recorded something. The lock is only taken when
+// a thread records its first event, names itself and when the trace is written.
+struct tracer {
+	std::atomic<bool> enabled;
+	std::mutex lock;
+	std::vector<std::unique_ptr<tracebuffer> > buffers;
+	std::chrono::steady_clock::time_point start;
+	tracer() : enabled(false), start(std::chrono::steady_clock::now()) {}
+};
+
+inline tracer &getTracer() {
+	static tracer t;
+	return t;
+}
+
+inline bool traceEnabled() {
+	return getTracer().enabled.load(std::memory_order_relaxed);
+}
+
+// Events are only recorded while tracing is enabled, timestamps count from the first enable
+inline void enableTracing(bool enabled) {
+	tracer &t = getTracer();
+	if (enabled && !t.enabled) {
+		std::lock_guard<std::mutex> guard(t.lock);
+		bool empty = true;
+		for (size_t b = 0; b < t.buffers.size(); ++b) {
+			if (t.buffers[b]->written > 0) empty = false;
+		}
+		if (empty) t.start = std::chrono::steady_clock::now();
+	}
+	t.enabled = enabled;
+}
+
+inline uint64_t traceNow() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - getTracer().start).count();
+}
+
+// Name given to the calling thread before it had a buffer
+inline const char *&traceThreadPendingName() {
+	static thread_local const char *name = NULL;
+	return name;
+}
+
+inline tracebuffer *&traceThreadSlot() {
+	static thread_local tracebuffer *buffer = NULL;
+	return buffer;
+}
+
+// Buffer of the calling thread, registered on its first event
+inline tracebuffer &traceThreadBuffer() {
+	tracebuffer *&buffer = traceThreadSlot();
+	if (buffer != NULL) return *buffer;
+	tracer &t = getTracer();
+	std::lock_guard<std::mutex> guard(t.lock);
+	t.buffers.push_back(std::unique_ptr<tracebuffer>(new tracebuffer));
+	buffer = t.buffers.back().get();
+	buffer->events.reset(new traceevent[TRACE_THREAD_EVENTS]);
+	buffer->thread_id = (unsigned int)t.buffers.size();
+	const char *name = traceThreadPendingName();
+	if (name != NULL) buffer->name = name;
+	return *buffer;
+}
+
+// Shown as the name of the calling thread's track
+inline void traceThreadName(const char *name) {
+	tracebuffer *buffer = traceThreadSlot();
+	if (buffer == NULL) {
+		traceThreadPendingName() = name;
+		return;
+	}
+	std::lock_guard<std::mutex> guard(getTracer().lock);
+	buffer->name = name;
+}
+
+inline void traceEvent(const char *name, uint64_t start_ns, int64_t value, int type) {
+	tracebuffer &buffer = traceThreadBuffer();
+	uint64_t index = buffer.written.load(std::memory_order_relaxed);
+	traceevent &event = buffer.events[index & (TRACE_THREAD_EVENTS - 1)];
+	event.name = name;
+	event.start_ns = start_ns;
+	event.value = value;
+	event.type = type;
+	buffer.written.store(index + 1, std::memory_order_release);
+}
+
+inline void traceCounter(const char *name, int64_t value) {
+	if (!traceEnabled()) return;
+	traceEvent(name, traceNow(), value, TRACE_COUNTER_EVENT);
+}
+
+// Records the enclosing block as one complete event
+struct tracezone {
+	const char *name;
+	uint64_t start;
+
+	tracezone(const char *zone) : name(NULL), start(0) {
+		if (!traceEnabled()) return;
+		name = zone;
+		start = traceNow();
+	}
+
+	~tracezone() {
+		if (name == NULL) return;
+		traceEvent(name, start, (int64_t)(traceNow() - start), TRACE_ZONE_EVENT);
+	}
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#if TRACE_ENABLED
+#define TRACE_ZONE(name) tracezone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define TRACE_COUNTER(name, value) traceCounter(name, (int64_t)(value))
+#else
+#define TRACE_ZONE(name)
+#define TRACE_COUNTER(name, value)
+#endif
+
+inline void writeTraceString(FILE *file, const char *text) {
+	fputc('"', file);
+	for (const char *c = text; *c != 0; ++c) {
+		if (*c == '"' || *c == '\\') fputc('\\', file);
+		if ((unsigned char)*c >= 0x20) fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+// Newest events of a buffer in the order they were recorded. The thread may
+// keep recording, so the events are copied first and any slot it could have
+// overwritten meanwhile is left out.
+inline void copyTraceEvents(const tracebuffer &buffer, std::vector<traceevent> &events, uint64_t &lost) {
+	uint64_t end = buffer.written.load(std::memory_order_acquire);
+	uint64_t first = end > TRACE_THREAD_EVENTS ? end - TRACE_THREAD_EVENTS : 0;
+	events.resize((size_t)(end - first));
+	for (uint64_t i = first; i < end; ++i) events[(size_t)(i - first)] = buffer.events[i & (TRACE_THREAD_EVENTS - 1)];
+	std::atomic_thread_fence(std::memory_order_acquire);
+	// The slot of the event being written when the copy ended is not safe either
+	uint64_t now = buffer.written.load(std::memory_order_relaxed) + 1;
+	uint64_t safe = now > TRACE_THREAD_EVENTS ? now - TRACE_THREAD_EVENTS : 0;
+	if (safe > first) {
+		size_t skip = (size_t)std::min(safe - first, end - first);
+		events.erase(events.begin(), events.begin() + skip);
+		first += skip;
+	}
+	lost = first;
+}
+
+// The newest events of every thread in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Threads may keep recording meanwhile.
+inline bool writeChromeTrace(const char *filename) {
+	FILE *file = fopen(filename, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Error: Could not open %s\n", filename);
+		return false;
+	}
+
+	tracer &t = getTracer();
+	std::lock_guard<std::mutex> guard(t.lock);
+	uint64_t events = 0, overwritten = 0;
+	std::vector<traceevent> copied;
+	bool first = true;
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (size_t b = 0; b < t.buffers.size(); ++b) {
+		const tracebuffer &buffer = *t.buffers[b];
+		if (!buffer.name.empty()) {
+			fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",", buffer.thread_id);
+			writeTraceString(file, buffer.name.c_str());
+			fprintf(file, "}}");
+			first = false;
+		}
+		uint64_t lost = 0;
+		copyTraceEvents(buffer, copied, lost);
+		for (size_t i = 0; i < copied.size(); ++i) {
+			const traceevent &event = copied[i];
+			fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+			writeTraceString(file, event.name);
+			if (event.type == TRACE_ZONE_EVENT) {
+				fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", buffer.thread_id,
+					event.start_ns / 1000.0, event.value / 1000.0);
+			}
+			else {
+				fprintf(file, ",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"value\":%lld}}", buffer.thread_id,
+					event.start_ns / 1000.0, (long long)event.value);
+			}
+			first = false;
+		}
+		events += copied.size();
+		overwritten += lost;
+	}
+	fprintf(file, "\n]}\n");
+	bool ok = ferror(file) == 0;
+	if (fclose(file) != 0) ok = false;
+	printf("Wrote %s: %llu events from %u threads", filename, (unsigned long long)events, (unsigned int)t.buffers.size());
+	if (overwritten > 0) printf(", %llu older ones overwritten, each thread keeps its last %d", (unsigned long long)overwritten, TRACE_THREAD_EVENTS);
+	printf("\n");
+	return ok;
+}
+
+// Cost of a TRACE_ZONE scope with tracing disabled and enabled
+inline int benchmarkTrace(int iterations) {
+	typedef std::chrono::steady_clock clock;
+	volatile unsigned int sink = 0;
+
+	clock::time_point start = clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		sink = sink + 1;
+	}
+	double baseline = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+	enableTracing(false);
+	start = clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		TRACE_ZONE("bench");
+		sink = sink + 1;
+	}
+	double off = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+	enableTracing(true);
+	start = clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		TRACE_ZONE("bench");
+		sink = sink + 1;
+	}
+	double on = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+	enableTracing(false);
+
+	printf("trace zone cost (compiled %s):\n", TRACE_ENABLED ? "in" : "out");
+	printf("  disabled: %.2f ns per zone over %d iterations\n", (off - baseline) / iterations, iterations);
+	printf("  enabled:  %.2f ns per zone over %d iterations\n", (on - baseline) / iterations, iterations);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef VERTEXFORMAT_H
+#define VERTEXFORMAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "shaderprogram.h"
+
+// Per-vertex attribute locations, the instance attributes sit at 2 and 3
+#define VERTEX_POSITION_ATTRIB 0
+#define VERTEX_COLOR_ATTRIB 1
+#define VERTEX_NORMAL_ATTRIB 4
+
+// How positions are stored: as they are, or relative to the box of their mesh
+// as half floats or as 16 bit integers
+enum positionencoding { POSITION_FLOAT, POSITION_HALF, POSITION_SNORM16 };
+
+enum vertexsemantic { VERTEX_POSITION, VERTEX_COLOR, VERTEX_NORMAL };
+
+// One attribute, everything glVertexAttribPointer needs besides the stride
+struct vertexattribute {
+	vertexsemantic semantic;
+	GLuint location;
+	GLint size;
+	GLenum type;
+	GLboolean normalized;
+	GLuint offset;
+};
+
+// Layout of one vertex. Quantized positions carry the bounds slot of their
+// mesh in w, so a multi draw of many meshes still finds each mesh's box.
+struct vertexformat {
+	std::string name = "float";
+	GLsizei stride = 0;
+	bool quantized = false;
+	std::vector<vertexattribute> attributes;
+};
+
+// Append an attribute after the ones already there
+inline void addVertexAttribute(vertexformat &format, vertexsemantic semantic, GLuint location, GLint size, GLenum type, GLboolean normalized, GLsizei bytes) {
+	vertexattribute attribute = { semantic, location, size, type, normalized, (GLuint)format.stride };
+	format.attributes.push_back(attribute);
+	format.stride += bytes;
+}
+
+// float: the original 24 byte position/color layout. half and snorm16: 8 byte
+// positions and RGBA8 colors, 12 bytes. Normals add 4 octahedral bytes to either.
+inline vertexformat makeVertexFormat(positionencoding position, bool normals) {
+	vertexformat format;
+	if (position == POSITION_FLOAT) {
+		addVertexAttribute(format, VERTEX_POSITION, VERTEX_POSITION_ATTRIB, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float));
+		addVertexAttribute(format, VERTEX_COLOR, VERTEX_COLOR_ATTRIB, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float));
+	}
+	else {
+		format.name = position == POSITION_HALF ? "half" : "snorm16";
+		format.quantized = true;
+		// Integers are read as they are, the 1/32767 is folded into the extent so w stays the slot
+		addVertexAttribute(format, VERTEX_POSITION, VERTEX_POSITION_ATTRIB, 4, position == POSITION_HALF ? GL_HALF_FLOAT : GL_SHORT, GL_FALSE, 4 * sizeof(uint16_t));
+		addVertexAttribute(format, VERTEX_COLOR, VERTEX_COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_TRUE, 4);
+	}
+	if (normals) {
+		format.name += "+normals";
+		addVertexAttribute(format, VERTEX_NORMAL, VERTEX_NORMAL_ATTRIB, 2, GL_SHORT, GL_TRUE, 2 * sizeof(int16_t));
+	}
+	return format;
+}
+
+// float, half or snorm16, false for anything else
+inline bool parsePositionEncoding(const char *name, positionencoding &position) {
+	if (strcmp(name, "float") == 0) position = POSITION_FLOAT;
+	else if (strcmp(name, "half") == 0) position = POSITION_HALF;
+	else if (strcmp(name, "snorm16") == 0) position = POSITION_SNORM16;
+	else return false;
+	return true;
+}
+
+// Only the colors of format, for meshes whose positions are streamed separately
+inline vertexformat makeColorFormat(const vertexformat &format) {
+	vertexformat colors;
+	colors.name = format.name + " colors";
+	for (size_t a = 0; a < format.attributes.size(); ++a) {
+		const vertexattribute &attribute = format.attributes[a];
+		if (attribute.semantic != VERTEX_COLOR) continue;
+		addVertexAttribute(colors, VERTEX_COLOR, attribute.location, attribute.size, attribute.type, attribute.normalized,
+			attribute.type == GL_FLOAT ? attribute.size * sizeof(float) : attribute.size);
+	}
+	return colors;
+}
+
+// Point the attributes at the bound array buffer, base is the byte offset of the first vertex
+inline void bindVertexFormat(const vertexformat &format, GLintptr base) {
+	for (size_t a = 0; a < format.attributes.size(); ++a) {
+		const vertexattribute &attribute = format.attributes[a];
+		glVertexAttribPointer(attribute.location, attribute.size, attribute.type, attribute.normalized, format.stride, (GLvoid*)(base + attribute.offset));
+		glEnableVertexAttribArray(attribute.location);
+	}
+}
+
+// IEEE half float, rounded to nearest even
+inline uint16_t floatToHalf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = bits & 0x80000000u;
+	bits ^= sign;
+	uint16_t half;
+	if (bits >= 0x47800000u) {
+		// Too large for a half, or already infinite or NaN
+		half = bits > 0x7f800000u ? 0x7e00 : 0x7c00;
+	}
+	else if (bits < 0x38800000u) {
+		// Subnormal: adding 0.5 lines the half mantissa up with the low float bits and rounds it
+		float shifted;
+		memcpy(&shifted, &bits, sizeof(shifted));
+		shifted += 0.5f;
+		uint32_t rounded;
+		memcpy(&rounded, &shifted, sizeof(rounded));
+		half = (uint16_t)(rounded - 0x3f000000u);
+	}
+	else {
+		uint32_t odd = (bits >> 13) & 1u;
+		bits += 0xc8000fffu + odd;
+		half = (uint16_t)(bits >> 13);
+	}
+	return (uint16_t)(half | (sign >> 16));
+}
+
+inline float halfToFloat(uint16_t half) {
+	uint32_t sign = (uint32_t)(half & 0x8000u) << 16;
+	uint32_t exponent = (half >> 10) & 0x1fu;
+	uint32_t mantissa = half & 0x3ffu;
+	if (exponent == 0) {
+		float value = ldexpf((float)mantissa, -24);
+		return sign != 0 ? -value : value;
+	}
+	uint32_t bits = sign | (exponent == 31 ? 0x7f800000u | (mantissa << 13) : ((exponent + 112) << 23) | (mantissa << 13));
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+inline int16_t toSnorm16(float value) {
+	return (int16_t)floorf(std::max(-1.0f, std::min(1.0f, value)) * 32767.0f + 0.5f);
+}
+
+// Unit vector folded onto the octahedron and flattened into two snorm16 values
+inline void octEncode(glm::vec3 n, int16_t out[2]) {
+	float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	glm::vec2 p = sum > 0.0f ? glm::vec2(n.x, n.y) / sum : glm::vec2(0.0f);
+	if (n.z < 0.0f) {
+		glm::vec2 folded(1.0f - fabsf(p.y), 1.0f - fabsf(p.x));
+		p = glm::vec2(p.x >= 0.0f ? folded.x : -folded.x, p.y >= 0.0f ? folded.y : -folded.y);
+	}
+	out[0] = toSnorm16(p.x);
+	out[1] = toSnorm16(p.y);
+}
+
+inline glm::vec3 octDecode(const int16_t in[2]) {
+	glm::vec2 p(std::max(-1.0f, in[0] / 32767.0f), std::max(-1.0f, in[1] / 32767.0f));
+	glm::vec3 n(p.x, p.y, 1.0f - fabsf(p.x) - fabsf(p.y));
+	float t = std::max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return glm::normalize(n);
+}
+
+// Area weighted normals of interleaved position/color vertices, up for vertices no triangle uses
+inline void computeVertexNormals(const glm::vec3 *vertices, size_t vertex_count, const unsigned int *indexes, size_t index_count,
+	std::vector<glm::vec3> &normals) {
+	normals.assign(vertex_count, glm::vec3(0.0f));
+	for (size_t i = 0; i + 2 < index_count; i += 3) {
+		unsigned int a = indexes[i], b = indexes[i + 1], c = indexes[i + 2];
+		if (a >= vertex_count || b >= vertex_count || c >= vertex_count) continue;
+		glm::vec3 face = glm::cross(vertices[b * 2] - vertices[a * 2], vertices[c * 2] - vertices[a * 2]);
+		normals[a] += face;
+		normals[b] += face;
+		normals[c] += face;
+	}
+	for (size_t v = 0; v < vertex_count; ++v) {
+		float length = glm::length(normals[v]);
+		normals[v] = length > 0.0f ? normals[v] / length : glm::vec3(0.0f, 1.0f, 0.0f);
+	}
+}
+
+// Encode interleaved position/color vertices in format. Quantized positions
+// are stored relative to the box of the mesh: the shader computes
+// center + position * extent, and reads slot from w to find them.
+inline void packVertices(const vertexformat &format, const glm::vec3 *vertices, size_t vertex_count,
+	const unsigned int *indexes, size_t index_count, unsigned int slot,
+	std::vector<unsigned char> &out, glm::vec4 &center, glm::vec4 &extent) {
+	glm::vec3 low(0.0f), high(0.0f);
+	for (size_t v = 0; v < vertex_count; ++v) {
+		low = v == 0 ? vertices[0] : glm::min(low, vertices[v * 2]);
+		high = v == 0 ? vertices[0] : glm::max(high, vertices[v * 2]);
+	}
+	// A flat mesh still needs something to divide by
+	glm::vec3 half_size = glm::max((high - low) * 0.5f, glm::vec3(1e-6f));
+	center = glm::vec4((low + high) * 0.5f, 0.0f);
+	extent = glm::vec4(half_size, 0.0f);
+
+	std::vector<glm::vec3> normals;
+	out.assign(vertex_count * format.stride, 0);
+	for (size_t a = 0; a < format.attributes.size(); ++a) {
+		const vertexattribute &attribute = format.attributes[a];
+		if (attribute.semantic == VERTEX_NORMAL) computeVertexNormals(vertices, vertex_count, indexes, index_count, normals);
+		if (attribute.semantic == VERTEX_POSITION && attribute.type == GL_SHORT) extent = glm::vec4(half_size / 32767.0f, 0.0f);
+
+		for (size_t v = 0; v < vertex_count; ++v) {
+			unsigned char *dst = &out[v * format.stride + attribute.offset];
+			glm::vec3 position = vertices[v * 2], color = vertices[v * 2 + 1];
+			glm::vec3 unit = (position - glm::vec3(center)) / half_size;
+			if (attribute.semantic == VERTEX_POSITION && attribute.type == GL_FLOAT) {
+				memcpy(dst, &position, sizeof(position));
+			}
+			else if (attribute.semantic == VERTEX_POSITION && attribute.type == GL_HALF_FLOAT) {
+				uint16_t packed[4] = { floatToHalf(unit.x), floatToHalf(unit.y), floatToHalf(unit.z), floatToHalf((float)slot) };
+				memcpy(dst, packed, sizeof(packed));
+			}
+			else if (attribute.semantic == VERTEX_POSITION) {
+				int16_t packed[4] = { toSnorm16(unit.x), toSnorm16(unit.y), toSnorm16(unit.z), (int16_t)slot };
+				memcpy(dst, packed, sizeof(packed));
+			}
+			else if (attribute.semantic == VERTEX_COLOR && attribute.type == GL_FLOAT) {
+				memcpy(dst, &color, sizeof(color));
+			}
+			else if (attribute.semantic == VERTEX_COLOR) {
+				for (int k = 0; k < 3; ++k) dst[k] = (unsigned char)floorf(std::max(0.0f, std::min(1.0f, color[k])) * 255.0f + 0.5f);
+				dst[3] = 255;
+			}
+			else {
+				int16_t packed[2];
+				octEncode(normals[v], packed);
+				memcpy(dst, packed, sizeof(packed));
+			}
+		}
+	}
+}
+
+// Position of a packed vertex as the shader sees it
+inline glm::vec3 unpackPosition(const vertexformat &format, const unsigned char *vertex, glm::vec4 center, glm::vec4 extent) {
+	for (size_t a = 0; a < format.attributes.size(); ++a) {
+		const vertexattribute &attribute = format.attributes[a];
+		if (attribute.semantic != VERTEX_POSITION) continue;
+		const unsigned char *src = vertex + attribute.offset;
+		glm::vec3 stored;
+		if (attribute.type == GL_FLOAT) {
+			memcpy(&stored, src, sizeof(stored));
+			return stored;
+		}
+		uint16_t packed[3];
+		memcpy(packed, src, sizeof(packed));
+		for (int k = 0; k < 3; ++k) stored[k] = attribute.type == GL_HALF_FLOAT ? halfToFloat(packed[k]) : (float)(int16_t)packed[k];
+		return glm::vec3(center) + stored * glm::vec3(extent);
+	}
+	return glm::vec3(0.0f);
+}
+
+#endif